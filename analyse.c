@@ -0,0 +1,558 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Static analyser for CHIP-8 programs.
+
+    Usage: analyse [-xo] rom_path [sidecar_path]
+
+    Follows the code reachable from 0x200 through jumps, calls, returns,
+    skips and every target of BNNN, keeping the range of values I can hold
+    before each instruction. Writes a sidecar (rom_path.c8a by default)
+    for chip8_load_analysis with the basic blocks, the disassembly, the
+    sprites drawn from a known address, the data ranges and every FX55,
+    FX33 and 5XY2 store with the addresses it may write. The program is
+    clean if no store can reach its code or the stack.
+
+    Returns are assumed to go back to a call site, a program that returns
+    without calling first is not analysed correctly.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define PROGRAM_OFFSET 0x200
+#define MEMORY_SIZE 0x10000
+#define STACK_OFFSET 0xea0
+#define STACK_SIZE 512
+#define SUPER_DIGITS_OFFSET 0x50
+#define MAX_SUCCESSORS 256
+
+#define BYTE_CODE 0x1       // part of a reached instruction
+#define BYTE_INSTR 0x2      // a reached instruction starts here
+#define BYTE_LEADER 0x4     // a basic block starts here
+
+typedef enum flow {
+    FLOW_NEXT,
+    FLOW_JUMP,
+    FLOW_CALL,
+    FLOW_RETURN,
+    FLOW_SKIP,
+    FLOW_COMPUTED,          // BNNN
+    FLOW_STOP,              // invalid opcode, the core stops
+} flow_t;
+
+// Values I can hold, lo > hi if the instruction wasn't reached
+typedef struct range {
+    int lo;
+    int hi;
+} range_t;
+
+typedef struct analysis {
+    const uint8_t *program;
+    int end;                            // first address past the program
+    bool xochip;
+    uint8_t flags[MEMORY_SIZE];
+    range_t i_reg[MEMORY_SIZE];         // before each reached instruction
+    uint8_t sprite_len[MEMORY_SIZE];
+    bool queued[MEMORY_SIZE];
+    uint16_t worklist[MEMORY_SIZE];
+    int num_queued;
+    bool is_return_site[MEMORY_SIZE];
+    uint16_t return_sites[MEMORY_SIZE / 2];
+    int num_return_sites;
+    range_t return_i;                   // I at every reached 00EE
+} analysis_t;
+
+static void analyse(analysis_t *a);
+static void reach(analysis_t *a, int addr, range_t i);
+static void step(analysis_t *a, int addr);
+static range_t transfer(analysis_t *a, int addr, range_t i);
+static bool store_range(analysis_t *a, int addr, range_t *out_range);
+static const char* store_target(analysis_t *a, range_t range);
+static flow_t flow_of(analysis_t *a, int addr);
+static int successors(analysis_t *a, int addr, int *out);
+static int instr_length(analysis_t *a, int addr);
+static int skip_target(analysis_t *a, int addr);
+static bool in_program(analysis_t *a, int addr);
+static uint16_t opcode_at(analysis_t *a, int addr);
+static bool join(range_t *dst, range_t src);
+static void mark_leaders(analysis_t *a);
+static bool write_sidecar(analysis_t *a, FILE *fp, size_t size);
+static uint64_t fnv1a(const uint8_t *data, size_t size);
+static unsigned char* read_file(const char *filename, size_t *out_size);
+
+int main(int argc, char *argv[]) {
+    bool xochip = false;
+    int first_arg = 1;
+    if (argc > 1 && strcmp(argv[1], "-xo") == 0) {
+        xochip = true;
+        first_arg++;
+    }
+    if (argc - first_arg < 1 || argc - first_arg > 2) {
+        printf("Usage: %s [-xo] rom_path [sidecar_path]\n", argv[0]);
+        return 1;
+    }
+    const char *rom_path = argv[first_arg];
+    size_t size;
+    unsigned char *program = read_file(rom_path, &size);
+    if (program == NULL) {
+        printf("%s: can't read\n", rom_path);
+        return 1;
+    }
+
+    // reject what chip8_load_program would
+    chip8_t *ch = chip8_make();
+    if (ch == NULL || (xochip && !chip8_set_variant(ch, CHIP8_VARIANT_XOCHIP)) ||
+        !chip8_load_program(ch, program, size)) {
+        printf("%s: can't be loaded\n", rom_path);
+        chip8_destroy(ch);
+        free(program);
+        return 1;
+    }
+    chip8_destroy(ch);
+
+    analysis_t *a = calloc(1, sizeof(analysis_t));
+    if (a == NULL) {
+        free(program);
+        return 1;
+    }
+    a->program = program;
+    a->end = PROGRAM_OFFSET + (int)size;
+    a->xochip = xochip;
+    analyse(a);
+
+    char default_path[4096];
+    const char *sidecar_path = argv[first_arg + 1];
+    if (sidecar_path == NULL) {
+        snprintf(default_path, sizeof(default_path), "%s.c8a", rom_path);
+        sidecar_path = default_path;
+    }
+    FILE *fp = fopen(sidecar_path, "w");
+    bool ok = fp != NULL && write_sidecar(a, fp, size);
+    if (fp != NULL && fclose(fp) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        printf("%s: can't write\n", sidecar_path);
+    }
+    free(a);
+    free(program);
+    return ok ? 0 : 1;
+}
+
+static void analyse(analysis_t *a) {
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        a->i_reg[addr] = (range_t){1, 0};
+    }
+    a->return_i = (range_t){1, 0};
+    // chip8_load_program clears I
+    reach(a, PROGRAM_OFFSET, (range_t){0, 0});
+    while (a->num_queued > 0) {
+        int addr = a->worklist[--a->num_queued];
+        a->queued[addr] = false;
+        step(a, addr);
+    }
+    mark_leaders(a);
+}
+
+static void reach(analysis_t *a, int addr, range_t i) {
+    if (i.lo > i.hi) {
+        return;
+    }
+    if (!in_program(a, addr)) {
+        return;
+    }
+    if (join(&a->i_reg[addr], i) && !a->queued[addr]) {
+        a->queued[addr] = true;
+        a->worklist[a->num_queued++] = addr;
+    }
+}
+
+static void step(analysis_t *a, int addr) {
+    flow_t flow = flow_of(a, addr);
+    int len = instr_length(a, addr);
+    a->flags[addr] |= BYTE_INSTR;
+    for (int i = 0; i < len; i++) {
+        a->flags[addr + i] |= BYTE_CODE;
+    }
+    if (flow == FLOW_STOP) {
+        return;
+    }
+    range_t i = a->i_reg[addr];
+    range_t out = transfer(a, addr, i);
+    uint16_t opcode = opcode_at(a, addr);
+    if (opcode >> 12 == 0xd && i.lo == i.hi) {
+        int n = opcode & 0xf;
+        int sprite_len = n != 0 ? n : 32;
+        if (sprite_len > a->sprite_len[i.lo]) {
+            a->sprite_len[i.lo] = sprite_len;
+        }
+    }
+    if (flow == FLOW_RETURN) {
+        if (join(&a->return_i, out)) {
+            for (int r = 0; r < a->num_return_sites; r++) {
+                reach(a, a->return_sites[r], a->return_i);
+            }
+        }
+        return;
+    }
+    if (flow == FLOW_CALL && in_program(a, addr + 2) && !a->is_return_site[addr + 2]) {
+        a->is_return_site[addr + 2] = true;
+        a->return_sites[a->num_return_sites++] = addr + 2;
+        reach(a, addr + 2, a->return_i);
+    }
+    int succ[MAX_SUCCESSORS];
+    int num_succ = successors(a, addr, succ);
+    for (int s = 0; s < num_succ; s++) {
+        // the return site is reached through 00EE
+        if (flow != FLOW_CALL || s == 0) {
+            reach(a, succ[s], out);
+        }
+    }
+}
+
+// I after the instruction
+static range_t transfer(analysis_t *a, int addr, range_t i) {
+    uint16_t opcode = opcode_at(a, addr);
+    int x = (opcode >> 8) & 0xf;
+    uint8_t nn = opcode & 0xff;
+    range_t out = i;
+    if (opcode >> 12 == 0xa) {
+        out.lo = out.hi = opcode & 0xfff;
+    } else if (opcode == 0xf000) {
+        out.lo = out.hi = opcode_at(a, addr + 2);
+    } else if (opcode >> 12 == 0xf) {
+        switch (nn) {
+            case 0x1e: out.hi += 255; break;
+            case 0x29: out = (range_t){0, 255 * 5}; break;
+            case 0x30: out = (range_t){SUPER_DIGITS_OFFSET, SUPER_DIGITS_OFFSET + 255 * 10}; break;
+            // with or without the I increment
+            case 0x55: case 0x65: out.hi += x + 1; break;
+        }
+    }
+    if (out.hi > 0xffff) {
+        // I wrapped around
+        out = (range_t){0, 0xffff};
+    }
+    return out;
+}
+
+// Addresses the store at addr may write, false if it isn't a store
+static bool store_range(analysis_t *a, int addr, range_t *out_range) {
+    uint16_t opcode = opcode_at(a, addr);
+    int x = (opcode >> 8) & 0xf;
+    int y = (opcode >> 4) & 0xf;
+    range_t i = a->i_reg[addr];
+    if (opcode >> 12 == 0xf && (opcode & 0xff) == 0x55) {
+        *out_range = (range_t){i.lo, i.hi + x};
+    } else if (opcode >> 12 == 0xf && (opcode & 0xff) == 0x33) {
+        *out_range = (range_t){i.lo, i.hi + 2};
+    } else if (opcode >> 12 == 0x5 && (opcode & 0xf) == 0x2 && a->xochip) {
+        *out_range = (range_t){i.lo, i.hi + (x > y ? x - y : y - x)};
+    } else {
+        return false;
+    }
+    if (out_range->hi > MEMORY_SIZE - 1) {
+        out_range->hi = MEMORY_SIZE - 1;
+    }
+    return true;
+}
+
+// "code" if the range overlaps a reached instruction, "stack" if it
+// overlaps the stack and "data" otherwise
+static const char* store_target(analysis_t *a, range_t range) {
+    for (int i = range.lo; i <= range.hi; i++) {
+        if (a->flags[i] & BYTE_CODE) {
+            return "code";
+        }
+    }
+    if (!a->xochip && range.lo < STACK_OFFSET + STACK_SIZE && range.hi >= STACK_OFFSET) {
+        return "stack";
+    }
+    return "data";
+}
+
+static flow_t flow_of(analysis_t *a, int addr) {
+    uint16_t opcode = opcode_at(a, addr);
+    uint8_t n = opcode & 0xf;
+    uint8_t nn = opcode & 0xff;
+    switch (opcode >> 12) {
+        case 0x0: return opcode == 0x00ee ? FLOW_RETURN : FLOW_NEXT;
+        case 0x1: return FLOW_JUMP;
+        case 0x2: return FLOW_CALL;
+        case 0x3: return FLOW_SKIP;
+        case 0x4: return FLOW_SKIP;
+        case 0x5:
+            if (n == 0x0) {
+                return FLOW_SKIP;
+            }
+            return (n == 0x2 || n == 0x3) && a->xochip ? FLOW_NEXT : FLOW_STOP;
+        case 0x8: return n <= 0x7 || n == 0xe ? FLOW_NEXT : FLOW_STOP;
+        case 0x9: return n == 0x0 ? FLOW_SKIP : FLOW_STOP;
+        case 0xb: return FLOW_COMPUTED;
+        case 0xe: return nn == 0x9e || nn == 0xa1 ? FLOW_SKIP : FLOW_STOP;
+        case 0xf:
+            if (opcode == 0xf000) {
+                return a->xochip && in_program(a, addr + 2) ? FLOW_NEXT : FLOW_STOP;
+            }
+            if (opcode == 0xf002 || nn == 0x01 || nn == 0x3a) {
+                return a->xochip ? FLOW_NEXT : FLOW_STOP;
+            }
+            switch (nn) {
+                case 0x07: case 0x0a: case 0x15: case 0x18: case 0x1e:
+                case 0x29: case 0x30: case 0x33: case 0x55: case 0x65:
+                    return FLOW_NEXT;
+                default:
+                    return FLOW_STOP;
+            }
+        default: return FLOW_NEXT;
+    }
+}
+
+// Control flow successors, a call's are its target and return site.
+// 00EE has none, it continues at every return site.
+static int successors(analysis_t *a, int addr, int *out) {
+    int nnn = opcode_at(a, addr) & 0xfff;
+    switch (flow_of(a, addr)) {
+        case FLOW_NEXT:
+            out[0] = addr + instr_length(a, addr);
+            return 1;
+        case FLOW_JUMP:
+            out[0] = nnn;
+            return 1;
+        case FLOW_CALL:
+            out[0] = nnn;
+            out[1] = addr + 2;
+            return 2;
+        case FLOW_SKIP:
+            out[0] = addr + 2;
+            out[1] = skip_target(a, addr);
+            return 2;
+        case FLOW_COMPUTED:
+            // BNNN + V0 and BXNN + VX both land in NNN..NNN + 255
+            for (int v = 0; v < 256; v++) {
+                out[v] = nnn + v;
+            }
+            return 256;
+        default:
+            return 0;
+    }
+}
+
+static int instr_length(analysis_t *a, int addr) {
+    return a->xochip && opcode_at(a, addr) == 0xf000 ? 4 : 2;
+}
+
+// XO-CHIP skips step over F000 NNNN as a whole
+static int skip_target(analysis_t *a, int addr) {
+    int next = addr + 2;
+    if (a->xochip && in_program(a, next) && opcode_at(a, next) == 0xf000) {
+        return next + 4;
+    }
+    return next + 2;
+}
+
+// Same as chip8_in_program
+static bool in_program(analysis_t *a, int addr) {
+    return addr >= PROGRAM_OFFSET && addr + 1 < a->end;
+}
+
+static uint16_t opcode_at(analysis_t *a, int addr) {
+    const uint8_t *p = a->program + (addr - PROGRAM_OFFSET);
+    return (p[0] << 8) | p[1];
+}
+
+static bool join(range_t *dst, range_t src) {
+    if (dst->lo > dst->hi) {
+        *dst = src;
+        return true;
+    }
+    range_t old = *dst;
+    dst->lo = src.lo < dst->lo ? src.lo : dst->lo;
+    dst->hi = src.hi > dst->hi ? src.hi : dst->hi;
+    return dst->lo != old.lo || dst->hi != old.hi;
+}
+
+// Blocks start at the entry point and at every target of a jump, call,
+// return, skip or BNNN
+static void mark_leaders(analysis_t *a) {
+    a->flags[PROGRAM_OFFSET] |= BYTE_LEADER;
+    for (int addr = PROGRAM_OFFSET; addr < a->end; addr++) {
+        if (!(a->flags[addr] & BYTE_INSTR)) {
+            continue;
+        }
+        if (a->is_return_site[addr]) {
+            a->flags[addr] |= BYTE_LEADER;
+        }
+        if (flow_of(a, addr) == FLOW_NEXT) {
+            continue;
+        }
+        int succ[MAX_SUCCESSORS];
+        int num_succ = successors(a, addr, succ);
+        for (int s = 0; s < num_succ; s++) {
+            if (in_program(a, succ[s])) {
+                a->flags[succ[s]] |= BYTE_LEADER;
+            }
+        }
+    }
+}
+
+static bool write_sidecar(analysis_t *a, FILE *fp, size_t size) {
+    const uint8_t *program = a->program;
+    int num_instrs = 0;
+    int num_blocks = 0;
+    int num_stores = 0;
+    int num_unsafe = 0;
+    int num_sprites = 0;
+    int data_bytes = 0;
+    int num_exits = 0;
+    for (int addr = PROGRAM_OFFSET; addr < a->end; addr++) {
+        if (!(a->flags[addr] & BYTE_INSTR)) {
+            continue;
+        }
+        range_t range;
+        if (store_range(a, addr, &range)) {
+            num_stores++;
+            num_unsafe += strcmp(store_target(a, range), "data") != 0;
+        }
+        // the core stops when the program counter leaves the program
+        int succ[MAX_SUCCESSORS];
+        int num_succ = successors(a, addr, succ);
+        for (int s = 0; s < num_succ; s++) {
+            num_exits += !in_program(a, succ[s]);
+        }
+    }
+
+    fprintf(fp, "CH8A 1\n");
+    fprintf(fp, "program %d %zu %016llx\n", a->xochip ? CHIP8_VARIANT_XOCHIP : CHIP8_VARIANT_SCHIP,
+            size, (unsigned long long)fnv1a(program, size));
+    fprintf(fp, "clean %d\n", num_unsafe == 0);
+
+    fprintf(fp, "# block start end successors...\n");
+    for (int addr = PROGRAM_OFFSET; addr < a->end; addr++) {
+        if ((a->flags[addr] & (BYTE_INSTR | BYTE_LEADER)) != (BYTE_INSTR | BYTE_LEADER)) {
+            continue;
+        }
+        int last = addr;
+        int next = addr + instr_length(a, addr);
+        while (flow_of(a, last) == FLOW_NEXT && (a->flags[next] & BYTE_INSTR) && !(a->flags[next] & BYTE_LEADER)) {
+            last = next;
+            next += instr_length(a, next);
+        }
+        fprintf(fp, "block %04x %04x", addr, next);
+        int succ[MAX_SUCCESSORS];
+        int num_succ = successors(a, last, succ);
+        for (int s = 0; s < num_succ; s++) {
+            if (in_program(a, succ[s]) && (a->flags[succ[s]] & BYTE_INSTR)) {
+                fprintf(fp, " %04x", succ[s]);
+            }
+        }
+        fprintf(fp, "\n");
+        num_blocks++;
+    }
+
+    fprintf(fp, "# code addr opcode mnemonic\n");
+    for (int addr = PROGRAM_OFFSET; addr < a->end; addr++) {
+        if (!(a->flags[addr] & BYTE_INSTR)) {
+            continue;
+        }
+        char text[64];
+        chip8_disassemble(program + (addr - PROGRAM_OFFSET), a->end - addr, text, sizeof(text));
+        fprintf(fp, "code %04x %04x %s\n", addr, opcode_at(a, addr), text);
+        num_instrs++;
+    }
+
+    fprintf(fp, "# sprite addr length, data start end\n");
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (a->sprite_len[addr] != 0) {
+            fprintf(fp, "sprite %04x %d\n", addr, a->sprite_len[addr]);
+            num_sprites++;
+        }
+    }
+    for (int addr = PROGRAM_OFFSET; addr < a->end; addr++) {
+        if (a->flags[addr] & BYTE_CODE) {
+            continue;
+        }
+        int start = addr;
+        while (addr + 1 < a->end && !(a->flags[addr + 1] & BYTE_CODE)) {
+            addr++;
+        }
+        fprintf(fp, "data %04x %04x\n", start, addr + 1);
+        data_bytes += addr + 1 - start;
+    }
+
+    fprintf(fp, "# write pc lo hi code|stack|data\n");
+    for (int addr = PROGRAM_OFFSET; addr < a->end; addr++) {
+        range_t range;
+        if (!(a->flags[addr] & BYTE_INSTR) || !store_range(a, addr, &range)) {
+            continue;
+        }
+        fprintf(fp, "write %04x %04x %04x %s\n", addr, range.lo, range.hi, store_target(a, range));
+    }
+
+    printf("%d instructions in %d blocks, %d data bytes, %d sprites, %d stores, %d may hit code or the stack, %d exits from the program\n",
+           num_instrs, num_blocks, data_bytes, num_sprites, num_stores, num_unsafe, num_exits);
+    printf("%s\n", num_unsafe == 0 ? "clean" : "not clean");
+    return !ferror(fp);
+}
+
+static uint64_t fnv1a(const uint8_t *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static unsigned char* read_file(const char *filename, size_t *out_len) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0L, SEEK_END);
+    long pos = ftell(fp);
+    if (pos < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    size_t file_size = pos;
+    rewind(fp);
+    unsigned char *file_contents = malloc(file_size);
+    if (!file_contents) {
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(file_contents, file_size, 1, fp) < 1) {
+        if (ferror(fp)) {
+            fclose(fp);
+            free(file_contents);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    *out_len = file_size;
+    return file_contents;
+}
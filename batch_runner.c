@@ -0,0 +1,384 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Headless batch runner.
+
+    Usage: batch_runner [-j threads] manifest
+
+    Each manifest line describes one run:
+        rom_path input_script cycles [seed]
+    input_script is "-" for no input or a file of "cycle keymask" lines,
+    keymask being a hex bitmask of pressed keys that applies from that cycle on.
+    Blank lines and lines starting with # are ignored.
+
+    For every run, in manifest order, prints:
+        rom_path state_hash cycles_run status milliseconds
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+#define MAX_LINE 4096
+#define MAX_EVENTS 65536
+
+typedef struct input_event {
+    uint64_t cycle;
+    uint16_t keys;
+} input_event_t;
+
+typedef struct job {
+    char *rom_path;
+    char *input_path;
+    uint64_t cycles;
+    uint64_t seed;
+    // results
+    uint64_t hash;
+    uint64_t cycles_run;
+    const char *status;
+    double ms;
+} job_t;
+
+// Per-worker deque of job indices. The owner pops from the back, thieves take from the front.
+typedef struct deque {
+    pthread_mutex_t lock;
+    int *items;
+    int front;
+    int back;
+} deque_t;
+
+typedef struct pool {
+    job_t *jobs;
+    deque_t *deques;
+    int num_workers;
+} pool_t;
+
+typedef struct worker_arg {
+    pool_t *pool;
+    int index;
+} worker_arg_t;
+
+static bool parse_manifest(const char *path, job_t **out_jobs, int *out_count);
+static int read_input_script(const char *path, input_event_t *events, int max_events);
+static unsigned char* read_file(const char *filename, size_t *out_size);
+static void run_job(job_t *job);
+static bool deque_pop(deque_t *dq, int *out_item);
+static bool deque_steal(deque_t *dq, int *out_item);
+static void* worker_main(void *arg);
+static uint64_t hash_state(chip8_t *ch);
+static double now_ms(void);
+
+int main(int argc, char *argv[]) {
+    int num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *manifest = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            num_workers = atoi(argv[++i]);
+        } else {
+            manifest = argv[i];
+        }
+    }
+    if (manifest == NULL || num_workers < 1) {
+        printf("Usage: %s [-j threads] manifest\n", argv[0]);
+        return 1;
+    }
+
+    job_t *jobs = NULL;
+    int num_jobs = 0;
+    if (!parse_manifest(manifest, &jobs, &num_jobs)) {
+        printf("Loading %s failed\n", manifest);
+        return 1;
+    }
+
+    pool_t pool;
+    pool.jobs = jobs;
+    pool.num_workers = num_workers;
+    pool.deques = calloc(num_workers, sizeof(deque_t));
+    for (int w = 0; w < num_workers; w++) {
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+        pool.deques[w].items = malloc(sizeof(int) * (num_jobs + 1));
+    }
+    for (int i = 0; i < num_jobs; i++) {
+        deque_t *dq = &pool.deques[i % num_workers];
+        dq->items[dq->back++] = i;
+    }
+
+    double start = now_ms();
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_workers);
+    worker_arg_t *args = malloc(sizeof(worker_arg_t) * num_workers);
+    for (int w = 0; w < num_workers; w++) {
+        args[w].pool = &pool;
+        args[w].index = w;
+        pthread_create(&threads[w], NULL, worker_main, &args[w]);
+    }
+    for (int w = 0; w < num_workers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    double elapsed = now_ms() - start;
+
+    uint64_t total_cycles = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        job_t *job = &jobs[i];
+        printf("%s %016llx %llu %s %.3f\n", job->rom_path, (unsigned long long)job->hash,
+               (unsigned long long)job->cycles_run, job->status, job->ms);
+        total_cycles += job->cycles_run;
+    }
+    fprintf(stderr, "%d runs, %d threads, %.1f ms, %.1f Mcycles/s\n", num_jobs, num_workers,
+            elapsed, elapsed > 0 ? total_cycles / (elapsed * 1000.0) : 0.0);
+
+    for (int w = 0; w < num_workers; w++) {
+        pthread_mutex_destroy(&pool.deques[w].lock);
+        free(pool.deques[w].items);
+    }
+    for (int i = 0; i < num_jobs; i++) {
+        free(jobs[i].rom_path);
+        free(jobs[i].input_path);
+    }
+    free(pool.deques);
+    free(threads);
+    free(args);
+    free(jobs);
+    return 0;
+}
+
+static void* worker_main(void *arg) {
+    worker_arg_t *warg = arg;
+    pool_t *pool = warg->pool;
+    int job_index;
+    while (true) {
+        bool found = deque_pop(&pool->deques[warg->index], &job_index);
+        for (int i = 1; !found && i < pool->num_workers; i++) {
+            found = deque_steal(&pool->deques[(warg->index + i) % pool->num_workers], &job_index);
+        }
+        if (!found) {
+            // no job is ever added after start, so empty deques mean we're done
+            return NULL;
+        }
+        run_job(&pool->jobs[job_index]);
+    }
+}
+
+static bool deque_pop(deque_t *dq, int *out_item) {
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->back > dq->front) {
+        *out_item = dq->items[--dq->back];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool deque_steal(deque_t *dq, int *out_item) {
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->back > dq->front) {
+        *out_item = dq->items[dq->front++];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static void run_job(job_t *job) {
+    double start = now_ms();
+    job->status = "ok";
+    job->hash = 0;
+    job->cycles_run = 0;
+
+    input_event_t *events = malloc(sizeof(input_event_t) * MAX_EVENTS);
+    int num_events = 0;
+    if (strcmp(job->input_path, "-") != 0) {
+        num_events = read_input_script(job->input_path, events, MAX_EVENTS);
+        if (num_events < 0) {
+            job->status = "bad_input";
+            goto end;
+        }
+    }
+
+    size_t program_size;
+    unsigned char *program = read_file(job->rom_path, &program_size);
+    if (program == NULL) {
+        job->status = "bad_rom";
+        goto end;
+    }
+    chip8_t *ch = chip8_make();
+    if (ch == NULL || !chip8_load_program(ch, program, program_size)) {
+        job->status = "bad_rom";
+        chip8_destroy(ch);
+        free(program);
+        goto end;
+    }
+    free(program);
+    chip8_seed_rng(ch, job->seed);
+
+    chip8_keyboard_input_t input = {0};
+    int next_event = 0;
+    uint64_t cycle = 0;
+    while (cycle < job->cycles) {
+        while (next_event < num_events && events[next_event].cycle <= cycle) {
+            for (int k = 0; k < 16; k++) {
+                input.keys[k] = (events[next_event].keys >> k) & 1;
+            }
+            next_event++;
+        }
+        uint64_t until = job->cycles;
+        if (next_event < num_events && events[next_event].cycle < until) {
+            until = events[next_event].cycle;
+        }
+        uint64_t chunk = until - cycle;
+        if (chunk > 1000000) {
+            chunk = 1000000;
+        }
+        chip8_stop_reason_t reason;
+        cycle += chip8_run_cycles(ch, &input, (int)chunk, &reason);
+        if (reason == CHIP8_STOP_ERROR) {
+            job->status = "error";
+            break;
+        }
+    }
+    job->cycles_run = cycle;
+    job->hash = hash_state(ch);
+    chip8_destroy(ch);
+end:
+    free(events);
+    job->ms = now_ms() - start;
+}
+
+static uint64_t hash_state(chip8_t *ch) {
+    size_t size = chip8_save_state(ch, NULL, 0);
+    uint8_t *buf = malloc(size);
+    if (buf == NULL) {
+        return 0;
+    }
+    chip8_save_state(ch, buf, size);
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+    for (size_t i = 0; i < size; i++) {
+        hash ^= buf[i];
+        hash *= 0x100000001b3ull;
+    }
+    free(buf);
+    return hash;
+}
+
+static bool parse_manifest(const char *path, job_t **out_jobs, int *out_count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    int capacity = 64;
+    int count = 0;
+    job_t *jobs = malloc(sizeof(job_t) * capacity);
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), fp)) {
+        char rom[MAX_LINE], input[MAX_LINE];
+        unsigned long long cycles, seed = 0;
+        if (line[0] == '#') {
+            continue;
+        }
+        int fields = sscanf(line, "%s %s %llu %llu", rom, input, &cycles, &seed);
+        if (fields <= 0) {
+            continue;
+        }
+        if (fields < 3) {
+            fclose(fp);
+            free(jobs);
+            return false;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            jobs = realloc(jobs, sizeof(job_t) * capacity);
+        }
+        memset(&jobs[count], 0, sizeof(job_t));
+        jobs[count].rom_path = strdup(rom);
+        jobs[count].input_path = strdup(input);
+        jobs[count].cycles = cycles;
+        jobs[count].seed = seed;
+        count++;
+    }
+    fclose(fp);
+    *out_jobs = jobs;
+    *out_count = count;
+    return true;
+}
+
+static int read_input_script(const char *path, input_event_t *events, int max_events) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    int count = 0;
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), fp) && count < max_events) {
+        unsigned long long cycle;
+        unsigned int keys;
+        if (line[0] == '#' || sscanf(line, "%llu %x", &cycle, &keys) != 2) {
+            continue;
+        }
+        events[count].cycle = cycle;
+        events[count].keys = keys;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static unsigned char* read_file(const char *filename, size_t *out_len) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0L, SEEK_END);
+    long pos = ftell(fp);
+    if (pos < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    size_t file_size = pos;
+    rewind(fp);
+    unsigned char *file_contents = malloc(file_size);
+    if (!file_contents) {
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(file_contents, file_size, 1, fp) < 1) {
+        if (ferror(fp)) {
+            fclose(fp);
+            free(file_contents);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    *out_len = file_size;
+    return file_contents;
+}
@@ -0,0 +1,277 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Benchmarks for the core and the rendering path.
+
+    Usage: bench [-c cycles] [-r repeats] [-jit] [rom_path ...]
+
+    Runs a synthetic ROM per opcode group, every given ROM headless for
+    the same number of cycles, and chip8_render_rgba/chip8_render_8bit at
+    the scales example_sdl2.c uses. Idle loop skipping is off, so key waits
+    and timer polls count only the instructions actually executed. Each
+    benchmark is repeated and the fastest run is reported. Results are
+    printed as JSON.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+#define WINDOW_WIDTH 640
+#define RENDER_FRAMES 2000
+
+typedef struct synthetic_rom {
+    const char *name;
+    const uint16_t *ops;
+    int num_ops;
+} synthetic_rom_t;
+
+// Every program loops forever, the trailing jump is part of the measured mix.
+static const uint16_t alu_ops[] = {
+    0x6001, 0x6102, 0x7003, 0x8014, 0x8125, 0x8216, 0x8307, 0x840e,
+    0x8501, 0x8612, 0x8713, 0x8a34, 0x8b45, 0x8c50, 0x7d07, 0x1200,
+};
+static const uint16_t branch_ops[] = {
+    0x3000, 0x7001, 0x4001, 0x7101, 0x5010, 0x7201, 0x9010, 0x7301,
+    0x2214, 0x1200, 0x00ee,
+};
+static const uint16_t memory_ops[] = {
+    0xa300, 0xff55, 0xff65, 0xf333, 0xf41e, 0x1200,
+};
+static const uint16_t draw8_ops[] = {
+    0xa000, 0xd018, 0x7008, 0x7101, 0x1200,
+};
+static const uint16_t draw16_ops[] = {
+    0x00ff, 0xa050, 0xd010, 0x7010, 0x7103, 0x1202,
+};
+static const uint16_t scroll_ops[] = {
+    0x00ff, 0x00c1, 0x00fb, 0x00fc, 0x00c4, 0x1202,
+};
+
+static const synthetic_rom_t synthetic_roms[] = {
+    {"alu", alu_ops, sizeof(alu_ops) / sizeof(alu_ops[0])},
+    {"branch", branch_ops, sizeof(branch_ops) / sizeof(branch_ops[0])},
+    {"fx55_fx65", memory_ops, sizeof(memory_ops) / sizeof(memory_ops[0])},
+    {"dxyn_8x8", draw8_ops, sizeof(draw8_ops) / sizeof(draw8_ops[0])},
+    {"dxyn_16x16", draw16_ops, sizeof(draw16_ops) / sizeof(draw16_ops[0])},
+    {"scroll", scroll_ops, sizeof(scroll_ops) / sizeof(scroll_ops[0])},
+};
+
+static void run_core(const char *group, const char *name, unsigned char *program, size_t size, long cycles, int repeats, bool jit, bool *first);
+static void run_render(bool hires, bool rgba, int repeats, bool *first);
+static void print_separator(bool *first);
+static unsigned char* read_file(const char *filename, size_t *out_size);
+static double now_s(void);
+
+int main(int argc, char *argv[]) {
+    long cycles = 20000000;
+    int repeats = 3;
+    bool jit = false;
+    int first_rom = argc;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cycles = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-jit") == 0) {
+            jit = true;
+        } else if (argv[i][0] == '-') {
+            printf("Usage: %s [-c cycles] [-r repeats] [-jit] [rom_path ...]\n", argv[0]);
+            return 1;
+        } else {
+            first_rom = i;
+            break;
+        }
+    }
+    if (cycles < 1 || repeats < 1) {
+        printf("Usage: %s [-c cycles] [-r repeats] [-jit] [rom_path ...]\n", argv[0]);
+        return 1;
+    }
+
+    bool first = true;
+    printf("{\n  \"cycles\": %ld,\n  \"repeats\": %d,\n  \"jit\": %s,\n  \"benchmarks\": [", cycles, repeats, jit ? "true" : "false");
+    int num_synthetic = sizeof(synthetic_roms) / sizeof(synthetic_roms[0]);
+    for (int i = 0; i < num_synthetic; i++) {
+        const synthetic_rom_t *rom = &synthetic_roms[i];
+        unsigned char program[64];
+        for (int j = 0; j < rom->num_ops; j++) {
+            program[j * 2] = rom->ops[j] >> 8;
+            program[j * 2 + 1] = rom->ops[j] & 0xff;
+        }
+        run_core("opcodes", rom->name, program, rom->num_ops * 2, cycles, repeats, jit, &first);
+    }
+    for (int i = first_rom; i < argc; i++) {
+        size_t size;
+        unsigned char *program = read_file(argv[i], &size);
+        if (program == NULL) {
+            fprintf(stderr, "Loading %s failed\n", argv[i]);
+            continue;
+        }
+        run_core("rom", argv[i], program, size, cycles, repeats, jit, &first);
+        free(program);
+    }
+    run_render(false, true, repeats, &first);
+    run_render(true, true, repeats, &first);
+    run_render(false, false, repeats, &first);
+    run_render(true, false, repeats, &first);
+    printf("\n  ]\n}\n");
+    return 0;
+}
+
+static void run_core(const char *group, const char *name, unsigned char *program, size_t size, long cycles, int repeats, bool jit, bool *first) {
+    double best = 0.0;
+    long executed = 0;
+    bool failed = false;
+    chip8_keyboard_input_t input = {0};
+    for (int r = 0; r < repeats; r++) {
+        chip8_t *ch = chip8_make();
+        if (ch == NULL || !chip8_load_program(ch, program, size) || (jit && !chip8_set_jit(ch, CHIP8_JIT_ON))) {
+            chip8_destroy(ch);
+            return;
+        }
+        chip8_set_idle_skip(ch, false);
+        executed = 0;
+        double start = now_s();
+        while (executed < cycles) {
+            long chunk = cycles - executed < 1000000 ? cycles - executed : 1000000;
+            chip8_stop_reason_t reason;
+            executed += chip8_run_cycles(ch, &input, (int)chunk, &reason);
+            if (reason == CHIP8_STOP_ERROR) {
+                failed = true;
+                break;
+            }
+        }
+        double elapsed = now_s() - start;
+        if (r == 0 || elapsed < best) {
+            best = elapsed;
+        }
+        chip8_destroy(ch);
+        if (failed) {
+            break;
+        }
+    }
+    print_separator(first);
+    printf("    {\"group\": \"%s\", \"name\": \"%s\", \"instructions\": %ld, \"seconds\": %.6f, "
+           "\"mips\": %.2f, \"ns_per_op\": %.3f, \"error\": %s}",
+           group, name, executed, best, best > 0 ? executed / best / 1e6 : 0.0,
+           executed > 0 ? best * 1e9 / executed : 0.0, failed ? "true" : "false");
+}
+
+// Times the full-frame expansion example_sdl2.c does on every change
+static void run_render(bool hires, bool rgba, int repeats, bool *first) {
+    // fill the display with a checkerboard of 8x8 sprites
+    static const uint16_t fill_ops[] = {
+        0x00ff, 0x6000, 0x6100, 0xa000, 0xd018, 0x7010, 0x3080, 0x1208,
+        0x6000, 0x7110, 0x3140, 0x1208, 0x1218,
+    };
+    unsigned char program[64];
+    int num_ops = sizeof(fill_ops) / sizeof(fill_ops[0]);
+    for (int j = 0; j < num_ops; j++) {
+        program[j * 2] = fill_ops[j] >> 8;
+        program[j * 2 + 1] = fill_ops[j] & 0xff;
+    }
+    chip8_t *ch = chip8_make();
+    if (ch == NULL) {
+        return;
+    }
+    if (!hires) {
+        program[1] = 0xfe; // 00FE instead of 00FF
+    }
+    chip8_load_program(ch, program, num_ops * 2);
+    chip8_keyboard_input_t input = {0};
+    for (int i = 0; i < 10000; i++) {
+        chip8_cpu_tick(ch, &input);
+    }
+    int width = chip8_get_width(ch);
+    int height = chip8_get_height(ch);
+    int scale = WINDOW_WIDTH / width;
+    size_t pixel_size = rgba ? sizeof(uint32_t) : sizeof(uint8_t);
+    size_t pitch = width * scale * pixel_size;
+    void *pixels = malloc(pitch * height * scale);
+    double best = 0.0;
+    for (int r = 0; r < repeats; r++) {
+        double start = now_s();
+        for (int f = 0; f < RENDER_FRAMES; f++) {
+            if (rgba) {
+                chip8_render_rgba(ch, pixels, pitch, scale, 0xffffffff, 0xff000000);
+            } else {
+                chip8_render_8bit(ch, pixels, pitch, scale, 0xff, 0x00);
+            }
+        }
+        double elapsed = now_s() - start;
+        if (r == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    free(pixels);
+    chip8_destroy(ch);
+    double pixels_per_frame = (double)width * scale * height * scale;
+    print_separator(first);
+    printf("    {\"group\": \"render\", \"name\": \"%s_%s\", \"width\": %d, \"height\": %d, \"scale\": %d, "
+           "\"frames\": %d, \"seconds\": %.6f, \"us_per_frame\": %.3f, \"mpixels_per_s\": %.1f}",
+           rgba ? "rgba" : "8bit", hires ? "hires" : "lores", width, height, scale, RENDER_FRAMES, best,
+           best * 1e6 / RENDER_FRAMES, best > 0 ? pixels_per_frame * RENDER_FRAMES / best / 1e6 : 0.0);
+}
+
+static void print_separator(bool *first) {
+    printf(*first ? "\n" : ",\n");
+    *first = false;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char* read_file(const char *filename, size_t *out_len) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0L, SEEK_END);
+    long pos = ftell(fp);
+    if (pos < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    size_t file_size = pos;
+    rewind(fp);
+    unsigned char *file_contents = malloc(file_size);
+    if (!file_contents) {
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(file_contents, file_size, 1, fp) < 1) {
+        if (ferror(fp)) {
+            fclose(fp);
+            free(file_contents);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    *out_len = file_size;
+    return file_contents;
+}
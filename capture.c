@@ -0,0 +1,743 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Headless frame capture.
+
+    Usage: capture [-f frames] [-xo] [-q quirks] [-seed n] [-i input_script]
+                   [-scale n] (-gif out.gif | -png prefix) rom
+
+    Runs rom for a number of 60 Hz frames (600 by default) and writes the
+    frames that differ from the one before them, either as an animated GIF
+    or as prefix_NNNNNN.png files numbered by frame. input_script is a file
+    of "frame keymask" lines like client's, the hex key mask applies from
+    that frame on.
+
+    Images are encoded straight from chip8_get_frame with a 2 colour palette,
+    4 for -xo, and are 128 * scale by 64 * scale pixels (scale is 4 by
+    default), so lores pixels are 2 * scale wide. Both encoders write as
+    they go and only keep a few frames and one output block in memory. GIF
+    frames only cover the rectangle that changed, and frames that would be
+    shown for less than the 2 centiseconds most viewers can time are
+    replaced by the next one. PNGs are compressed with run-length matches
+    on the Up filter, which is where scaled and blank rows go.
+
+    Exits with 1 if the program failed or a file couldn't be written.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+#define MAX_LINE 4096
+#define MAX_EVENTS 65536
+#define MAX_SCALE 16
+#define MAX_IMAGE_WIDTH (128 * MAX_SCALE)
+#define ROW_BYTES (CHIP8_FRAME_SIZE / 2 / 64)
+#define IDAT_SIZE (32 * 1024)
+#define GIF_MIN_DELAY 2         // centiseconds
+#define GIF_MAX_CODES 4096
+
+typedef struct input_event {
+    uint64_t frame;
+    uint16_t keys;
+} input_event_t;
+
+// The display as chip8_get_frame lays it out and the mode it was drawn in
+typedef struct frame {
+    uint8_t bytes[CHIP8_FRAME_SIZE];
+    int width;
+    int planes;
+} frame_t;
+
+typedef struct png_writer {
+    FILE *fp;
+    bool ok;
+    uint8_t block[IDAT_SIZE];   // deflate output not written as an IDAT chunk yet
+    size_t block_len;
+    uint64_t bits;
+    int num_bits;
+    int last;                   // last literal, -1 at the start
+    int run;                    // repeats of last not written yet
+    uint32_t adler_a;
+    uint32_t adler_b;
+} png_writer_t;
+
+typedef struct gif_writer {
+    FILE *fp;
+    int width;
+    int height;
+    int depth;                  // bits per pixel of the colour table
+    bool has_pending;
+    frame_t pending;            // waiting for the frame after it to know its delay
+    int pending_start;          // in centiseconds
+    bool has_shown;
+    frame_t shown;              // the canvas after the last frame written
+    uint16_t codes[GIF_MAX_CODES][4];
+    uint8_t block[256];         // a length byte and up to 255 bytes of LZW codes
+    uint32_t bits;
+    int num_bits;
+    int frames_written;
+} gif_writer_t;
+
+static const uint8_t palette_rgb[4][3] = {
+    {0x00, 0x00, 0x00}, {0xff, 0xff, 0xff}, {0x00, 0x55, 0xaa}, {0x55, 0x55, 0x55},
+};
+
+static uint32_t crc_table[256];
+static uint16_t fixed_codes[288];       // bit-reversed fixed Huffman codes
+static uint8_t fixed_lengths[288];
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static void read_frame(chip8_t *ch, frame_t *out);
+static bool frames_equal(const frame_t *a, const frame_t *b);
+static void expand_row(const frame_t *f, int y, int scale, int x0, int x1, uint8_t *out);
+static int unit_size(const frame_t *f, int scale);
+static bool write_png(const char *path, const frame_t *f, int scale, int depth);
+static void png_init_tables(void);
+static void png_chunk(FILE *fp, const char *type, const uint8_t *data, size_t size);
+static void png_put_bits(png_writer_t *w, uint32_t value, int count);
+static void png_put_symbol(png_writer_t *w, int symbol);
+static void png_put_byte(png_writer_t *w, uint8_t byte);
+static void png_flush_run(png_writer_t *w);
+static void png_flush_block(png_writer_t *w);
+static bool gif_open(gif_writer_t *g, const char *path, int scale, int depth);
+static void gif_add(gif_writer_t *g, const frame_t *f, int frame_number, int scale);
+static bool gif_close(gif_writer_t *g, int frame_count, int scale);
+static void gif_write_frame(gif_writer_t *g, const frame_t *f, int delay, int scale);
+static void gif_put_code(gif_writer_t *g, int code, int size);
+static void gif_flush_block(gif_writer_t *g);
+static int centiseconds(int frames);
+static int read_input_script(const char *path, input_event_t *events, int max_events);
+static unsigned char* read_file(const char *filename, size_t *out_size);
+static void put_u16_le(uint8_t *p, uint16_t v);
+static void put_u32_be(uint8_t *p, uint32_t v);
+static double now_ms(void);
+
+int main(int argc, char *argv[]) {
+    const char *rom_path = NULL;
+    const char *input_path = NULL;
+    const char *gif_path = NULL;
+    const char *png_prefix = NULL;
+    int num_frames = 600;
+    int scale = 4;
+    uint64_t seed = 0;
+    chip8_variant_t variant = CHIP8_VARIANT_SCHIP;
+    chip8_quirks_t quirks = CHIP8_QUIRKS_DEFAULT;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            num_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            quirks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            input_path = argv[++i];
+        } else if (strcmp(argv[i], "-scale") == 0 && i + 1 < argc) {
+            scale = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-gif") == 0 && i + 1 < argc) {
+            gif_path = argv[++i];
+        } else if (strcmp(argv[i], "-png") == 0 && i + 1 < argc) {
+            png_prefix = argv[++i];
+        } else if (strcmp(argv[i], "-xo") == 0) {
+            variant = CHIP8_VARIANT_XOCHIP;
+        } else {
+            rom_path = argv[i];
+        }
+    }
+    if (rom_path == NULL || num_frames < 1 || scale < 1 || scale > MAX_SCALE ||
+        (gif_path == NULL) == (png_prefix == NULL)) {
+        printf("Usage: %s [-f frames] [-xo] [-q quirks] [-seed n] [-i input_script] [-scale n] (-gif out.gif | -png prefix) rom\n", argv[0]);
+        return 1;
+    }
+
+    size_t program_size;
+    unsigned char *program = read_file(rom_path, &program_size);
+    if (program == NULL) {
+        printf("Reading %s failed\n", rom_path);
+        return 1;
+    }
+    input_event_t *events = malloc(sizeof(input_event_t) * MAX_EVENTS);
+    int num_events = 0;
+    if (input_path != NULL) {
+        num_events = read_input_script(input_path, events, MAX_EVENTS);
+        if (num_events < 0) {
+            printf("Reading %s failed\n", input_path);
+            return 1;
+        }
+    }
+    chip8_t *ch = chip8_make();
+    chip8_set_variant(ch, variant);
+    chip8_set_quirks(ch, quirks);
+    if (!chip8_load_program(ch, program, program_size)) {
+        printf("Loading %s failed\n", rom_path);
+        return 1;
+    }
+    chip8_seed_rng(ch, seed);
+    png_init_tables();
+
+    int depth = variant == CHIP8_VARIANT_XOCHIP ? 2 : 1;
+    gif_writer_t *gif = NULL;
+    if (gif_path != NULL) {
+        gif = malloc(sizeof(gif_writer_t));
+        if (gif == NULL || !gif_open(gif, gif_path, scale, depth)) {
+            printf("Opening %s failed\n", gif_path);
+            return 1;
+        }
+    }
+
+    bool ok = true;
+    bool failed = false;
+    int frames_run = 0;
+    int images = 0;
+    frame_t *last = calloc(1, sizeof(frame_t));
+    frame_t *current = malloc(sizeof(frame_t));
+    uint32_t last_generation = 0;
+    chip8_keyboard_input_t input = {0};
+    int next_event = 0;
+    double start = now_ms();
+    for (int i = 0; i < num_frames && ok; i++) {
+        while (next_event < num_events && events[next_event].frame <= (uint64_t)i) {
+            for (int k = 0; k < 16; k++) {
+                input.keys[k] = (events[next_event].keys >> k) & 1;
+            }
+            next_event++;
+        }
+        if (!chip8_run_frame(ch, &input)) {
+            failed = true;
+            break;
+        }
+        frames_run++;
+        // the generation is bumped by every draw, even one that's undone before the frame ends
+        uint32_t generation = chip8_get_frame_generation(ch);
+        if (images > 0 && generation == last_generation) {
+            continue;
+        }
+        last_generation = generation;
+        read_frame(ch, current);
+        if (images > 0 && frames_equal(current, last)) {
+            continue;
+        }
+        if (gif != NULL) {
+            gif_add(gif, current, i, scale);
+        } else {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s_%06d.png", png_prefix, i);
+            if (!write_png(path, current, scale, depth)) {
+                printf("Writing %s failed\n", path);
+                ok = false;
+            }
+        }
+        frame_t *t = last;
+        last = current;
+        current = t;
+        images++;
+    }
+    if (gif != NULL && !gif_close(gif, frames_run, scale)) {
+        printf("Writing %s failed\n", gif_path);
+        ok = false;
+    }
+    double elapsed = now_ms() - start;
+    printf("%d frames, %d distinct written in %.1f ms (%.0f frames/s)", frames_run, images,
+           elapsed, frames_run * 1000.0 / (elapsed > 0 ? elapsed : 1));
+    if (gif != NULL) {
+        printf(", %d GIF frames", gif->frames_written);
+    }
+    printf("\n");
+    if (failed) {
+        printf("Program failed after %d frames\n", frames_run);
+    }
+    chip8_destroy(ch);
+    free(gif);
+    free(last);
+    free(current);
+    free(events);
+    free(program);
+    return ok && !failed ? 0 : 1;
+}
+
+static void read_frame(chip8_t *ch, frame_t *out) {
+    chip8_get_frame(ch, out->bytes);
+    out->width = chip8_get_width(ch);
+    out->planes = chip8_get_num_planes(ch);
+}
+
+static bool frames_equal(const frame_t *a, const frame_t *b) {
+    return a->width == b->width && a->planes == b->planes && memcmp(a->bytes, b->bytes, sizeof(a->bytes)) == 0;
+}
+
+// Output pixels per display pixel, lores pixels are twice as big
+static int unit_size(const frame_t *f, int scale) {
+    return f->width == 64 ? 2 * scale : scale;
+}
+
+// Palette indices of output pixels x0 to x1 (exclusive) of display row y
+static void expand_row(const frame_t *f, int y, int scale, int x0, int x1, uint8_t *out) {
+    int unit = unit_size(f, scale);
+    const uint8_t *row = f->bytes + y * ROW_BYTES;
+    for (int x = x0; x < x1; x++) {
+        int px = x / unit;
+        int shift = 7 - px % 8;
+        uint8_t index = (row[px / 8] >> shift) & 1;
+        if (f->planes > 1) {
+            index |= ((row[CHIP8_FRAME_SIZE / 2 + px / 8] >> shift) & 1) << 1;
+        }
+        *out++ = index;
+    }
+}
+
+static bool write_png(const char *path, const frame_t *f, int scale, int depth) {
+    png_writer_t *w = malloc(sizeof(png_writer_t));
+    FILE *fp = fopen(path, "wb");
+    if (w == NULL || fp == NULL) {
+        free(w);
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return false;
+    }
+    const int width = 128 * scale;
+    const int height = 64 * scale;
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 1, sizeof(signature), fp);
+    uint8_t ihdr[13] = {0};
+    put_u32_be(ihdr, width);
+    put_u32_be(ihdr + 4, height);
+    ihdr[8] = depth;
+    ihdr[9] = 3; // palette
+    png_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+    png_chunk(fp, "PLTE", palette_rgb[0], 3 << depth);
+
+    memset(w, 0, sizeof(*w));
+    w->fp = fp;
+    w->ok = true;
+    w->last = -1;
+    w->adler_a = 1;
+    png_put_bits(w, 0x78, 8); // deflate, 32 KB window
+    png_put_bits(w, 0x01, 8);
+    png_put_bits(w, 1, 1);    // final block
+    png_put_bits(w, 1, 2);    // fixed Huffman codes
+
+    uint8_t indices[MAX_IMAGE_WIDTH];
+    uint8_t rows[2][MAX_IMAGE_WIDTH / 4 + 1];
+    uint8_t *row = rows[0];
+    uint8_t *prev = rows[1];
+    const size_t row_size = (width * depth + 7) / 8;
+    const int unit = unit_size(f, scale);
+    memset(prev, 0, row_size);
+    for (int y = 0; y < height / unit; y++) {
+        expand_row(f, y, scale, 0, width, indices);
+        memset(row, 0, row_size);
+        for (int x = 0; x < width; x++) {
+            row[x * depth / 8] |= indices[x] << (8 - depth - x * depth % 8);
+        }
+        // Up filter: the first copy of a row is its difference from the one
+        // above, the copies made by scaling are all zeros
+        png_put_byte(w, 2);
+        for (size_t i = 0; i < row_size; i++) {
+            png_put_byte(w, row[i] - prev[i]);
+        }
+        for (int copy = 1; copy < unit; copy++) {
+            png_put_byte(w, 2);
+            for (size_t i = 0; i < row_size; i++) {
+                png_put_byte(w, 0);
+            }
+        }
+        uint8_t *t = prev;
+        prev = row;
+        row = t;
+    }
+    png_flush_run(w);
+    png_put_symbol(w, 256);
+    png_put_bits(w, 0, (8 - w->num_bits) & 7);
+    uint32_t adler = (w->adler_b << 16) | w->adler_a;
+    png_put_bits(w, adler >> 24, 8);
+    png_put_bits(w, (adler >> 16) & 0xff, 8);
+    png_put_bits(w, (adler >> 8) & 0xff, 8);
+    png_put_bits(w, adler & 0xff, 8);
+    png_flush_block(w);
+    png_chunk(fp, "IEND", NULL, 0);
+    bool ok = w->ok && !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    free(w);
+    return ok;
+}
+
+static void png_init_tables(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+    for (int symbol = 0; symbol < 288; symbol++) {
+        uint32_t code;
+        int length;
+        if (symbol < 144) {
+            code = 0x30 + symbol;
+            length = 8;
+        } else if (symbol < 256) {
+            code = 0x190 + symbol - 144;
+            length = 9;
+        } else if (symbol < 280) {
+            code = symbol - 256;
+            length = 7;
+        } else {
+            code = 0xc0 + symbol - 280;
+            length = 8;
+        }
+        // deflate writes Huffman codes starting from their top bit
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++) {
+            reversed |= ((code >> i) & 1) << (length - 1 - i);
+        }
+        fixed_codes[symbol] = reversed;
+        fixed_lengths[symbol] = length;
+    }
+}
+
+static void png_chunk(FILE *fp, const char *type, const uint8_t *data, size_t size) {
+    uint8_t header[8];
+    put_u32_be(header, (uint32_t)size);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 4; i < 8; i++) {
+        crc = crc_table[(crc ^ header[i]) & 0xff] ^ (crc >> 8);
+    }
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    uint8_t footer[4];
+    put_u32_be(footer, crc ^ 0xffffffffu);
+    fwrite(header, 1, sizeof(header), fp);
+    if (size > 0) {
+        fwrite(data, 1, size, fp);
+    }
+    fwrite(footer, 1, sizeof(footer), fp);
+}
+
+static void png_put_bits(png_writer_t *w, uint32_t value, int count) {
+    w->bits |= (uint64_t)value << w->num_bits;
+    w->num_bits += count;
+    while (w->num_bits >= 8) {
+        w->block[w->block_len++] = w->bits & 0xff;
+        w->bits >>= 8;
+        w->num_bits -= 8;
+        if (w->block_len == IDAT_SIZE) {
+            png_flush_block(w);
+        }
+    }
+}
+
+static void png_put_symbol(png_writer_t *w, int symbol) {
+    png_put_bits(w, fixed_codes[symbol], fixed_lengths[symbol]);
+}
+
+// Compresses one byte of filtered image data. Repeats of the previous byte
+// are collected into a match at distance 1.
+static void png_put_byte(png_writer_t *w, uint8_t byte) {
+    w->adler_a = (w->adler_a + byte) % 65521;
+    w->adler_b = (w->adler_b + w->adler_a) % 65521;
+    if (byte == w->last) {
+        if (++w->run == 258) {
+            png_flush_run(w);
+        }
+        return;
+    }
+    png_flush_run(w);
+    png_put_symbol(w, byte);
+    w->last = byte;
+}
+
+static void png_flush_run(png_writer_t *w) {
+    if (w->run < 3) {
+        for (int i = 0; i < w->run; i++) {
+            png_put_symbol(w, w->last);
+        }
+        w->run = 0;
+        return;
+    }
+    int code = 28;
+    while (length_base[code] > w->run) {
+        code--;
+    }
+    png_put_symbol(w, 257 + code);
+    png_put_bits(w, w->run - length_base[code], length_extra[code]);
+    png_put_bits(w, 0, 5); // distance code 0, distance 1
+    w->run = 0;
+}
+
+static void png_flush_block(png_writer_t *w) {
+    if (w->block_len > 0) {
+        png_chunk(w->fp, "IDAT", w->block, w->block_len);
+        w->block_len = 0;
+    }
+}
+
+static bool gif_open(gif_writer_t *g, const char *path, int scale, int depth) {
+    memset(g, 0, sizeof(*g));
+    g->fp = fopen(path, "wb");
+    if (g->fp == NULL) {
+        return false;
+    }
+    g->width = 128 * scale;
+    g->height = 64 * scale;
+    g->depth = depth;
+    uint8_t header[13] = {'G', 'I', 'F', '8', '9', 'a'};
+    put_u16_le(header + 6, g->width);
+    put_u16_le(header + 8, g->height);
+    header[10] = 0x80 | ((depth - 1) << 4) | (depth - 1); // global colour table of 2^depth entries
+    fwrite(header, 1, sizeof(header), g->fp);
+    fwrite(palette_rgb, 1, 3 << depth, g->fp);
+    static const uint8_t loop[19] = {
+        0x21, 0xff, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1, 0, 0, 0,
+    };
+    fwrite(loop, 1, sizeof(loop), g->fp);
+    return true;
+}
+
+// Frames are written once the next one shows how long they last
+static void gif_add(gif_writer_t *g, const frame_t *f, int frame_number, int scale) {
+    int start = centiseconds(frame_number);
+    if (g->has_pending && start - g->pending_start >= GIF_MIN_DELAY) {
+        gif_write_frame(g, &g->pending, start - g->pending_start, scale);
+        g->has_pending = false;
+    }
+    if (!g->has_pending) {
+        g->pending_start = start;
+        g->has_pending = true;
+    }
+    g->pending = *f;
+}
+
+static bool gif_close(gif_writer_t *g, int frame_count, int scale) {
+    if (g->has_pending) {
+        int delay = centiseconds(frame_count) - g->pending_start;
+        gif_write_frame(g, &g->pending, delay > GIF_MIN_DELAY ? delay : GIF_MIN_DELAY, scale);
+    }
+    fputc(0x3b, g->fp);
+    bool ok = !ferror(g->fp);
+    return fclose(g->fp) == 0 && ok;
+}
+
+static void gif_write_frame(gif_writer_t *g, const frame_t *f, int delay, int scale) {
+    // the rectangle of display bytes that changed, the whole canvas for a
+    // first frame or a mode change
+    int unit = unit_size(f, scale);
+    int rows = g->height / unit;
+    int x0 = 0, x1 = g->width, y0 = 0, y1 = g->height;
+    if (g->has_shown && g->shown.width == f->width && g->shown.planes == f->planes) {
+        int min_byte = ROW_BYTES, max_byte = -1, min_row = rows, max_row = -1;
+        for (int y = 0; y < rows; y++) {
+            for (int p = 0; p < f->planes; p++) {
+                const uint8_t *a = f->bytes + p * CHIP8_FRAME_SIZE / 2 + y * ROW_BYTES;
+                const uint8_t *b = g->shown.bytes + p * CHIP8_FRAME_SIZE / 2 + y * ROW_BYTES;
+                for (int i = 0; i < ROW_BYTES; i++) {
+                    if (a[i] != b[i]) {
+                        min_byte = i < min_byte ? i : min_byte;
+                        max_byte = i > max_byte ? i : max_byte;
+                        min_row = y < min_row ? y : min_row;
+                        max_row = y > max_row ? y : max_row;
+                    }
+                }
+            }
+        }
+        if (max_row < 0) {
+            // replaced by a frame equal to the canvas, one unchanged pixel holds the delay
+            min_byte = max_byte = min_row = max_row = 0;
+        }
+        x0 = min_byte * 8 * unit;
+        x1 = (max_byte + 1) * 8 * unit;
+        x1 = x1 < g->width ? x1 : g->width;
+        y0 = min_row * unit;
+        y1 = (max_row + 1) * unit;
+    }
+
+    uint8_t control[8] = {0x21, 0xf9, 4, 0x04}; // graphic control, don't dispose
+    put_u16_le(control + 4, delay);
+    fwrite(control, 1, sizeof(control), g->fp);
+    uint8_t descriptor[11] = {0x2c};
+    put_u16_le(descriptor + 1, x0);
+    put_u16_le(descriptor + 3, y0);
+    put_u16_le(descriptor + 5, x1 - x0);
+    put_u16_le(descriptor + 7, y1 - y0);
+    fwrite(descriptor, 1, 10, g->fp);
+
+    // LZW with a code tree indexed by [prefix][pixel], restarted with a
+    // clear code whenever the 12-bit codes run out
+    const int min_code_size = 2;
+    const int clear_code = 1 << min_code_size;
+    fputc(min_code_size, g->fp);
+    memset(g->codes, 0, sizeof(g->codes));
+    g->block[0] = 0;
+    g->bits = 0;
+    g->num_bits = 0;
+    int code_size = min_code_size + 1;
+    int max_code = clear_code + 1;
+    int prefix = -1;
+    gif_put_code(g, clear_code, code_size);
+    uint8_t indices[MAX_IMAGE_WIDTH];
+    for (int y = y0; y < y1; y++) {
+        if (y == y0 || y % unit == 0) {
+            expand_row(f, y / unit, scale, x0, x1, indices);
+        }
+        for (int x = 0; x < x1 - x0; x++) {
+            int pixel = indices[x];
+            if (prefix < 0) {
+                prefix = pixel;
+                continue;
+            }
+            if (g->codes[prefix][pixel] != 0) {
+                prefix = g->codes[prefix][pixel];
+                continue;
+            }
+            gif_put_code(g, prefix, code_size);
+            g->codes[prefix][pixel] = ++max_code;
+            if (max_code >= (1 << code_size)) {
+                code_size++;
+            }
+            if (max_code == GIF_MAX_CODES - 1) {
+                gif_put_code(g, clear_code, code_size);
+                memset(g->codes, 0, sizeof(g->codes));
+                code_size = min_code_size + 1;
+                max_code = clear_code + 1;
+            }
+            prefix = pixel;
+        }
+    }
+    gif_put_code(g, prefix, code_size);
+    gif_put_code(g, clear_code + 1, code_size);
+    if (g->num_bits > 0) {
+        g->block[++g->block[0]] = g->bits & 0xff;
+        g->num_bits = 0;
+    }
+    gif_flush_block(g);
+    fputc(0, g->fp);
+
+    g->shown = *f;
+    g->has_shown = true;
+    g->frames_written++;
+}
+
+static void gif_put_code(gif_writer_t *g, int code, int size) {
+    g->bits |= (uint32_t)code << g->num_bits;
+    g->num_bits += size;
+    while (g->num_bits >= 8) {
+        g->block[++g->block[0]] = g->bits & 0xff;
+        g->bits >>= 8;
+        g->num_bits -= 8;
+        if (g->block[0] == 255) {
+            gif_flush_block(g);
+        }
+    }
+}
+
+static void gif_flush_block(gif_writer_t *g) {
+    if (g->block[0] > 0) {
+        fwrite(g->block, 1, g->block[0] + 1, g->fp);
+        g->block[0] = 0;
+    }
+}
+
+// Start of a 60 Hz frame, rounded to the centiseconds GIF delays are in
+static int centiseconds(int frames) {
+    return (frames * 100 + 30) / 60;
+}
+
+static int read_input_script(const char *path, input_event_t *events, int max_events) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    int count = 0;
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), fp) && count < max_events) {
+        unsigned long long frame;
+        unsigned int keys;
+        if (line[0] == '#' || sscanf(line, "%llu %x", &frame, &keys) != 2) {
+            continue;
+        }
+        events[count].frame = frame;
+        events[count].keys = keys;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+static void put_u16_le(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put_u32_be(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static unsigned char* read_file(const char *filename, size_t *out_len) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0L, SEEK_END);
+    long pos = ftell(fp);
+    if (pos < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    size_t file_size = pos;
+    rewind(fp);
+    unsigned char *file_contents = malloc(file_size);
+    if (!file_contents) {
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(file_contents, file_size, 1, fp) < 1) {
+        if (ferror(fp)) {
+            fclose(fp);
+            free(file_contents);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    *out_len = file_size;
+    return file_contents;
+}
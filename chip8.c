@@ -22,27 +22,358 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdatomic.h>
+
+#if defined(CHIP8_JIT) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CHIP8_JIT_ENABLED
+#include <sys/mman.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define DISPLAY_WIDTH 64
 #define DISPLAY_HEIGHT 32
 #define SDISPLAY_WIDTH 128
 #define SDISPLAY_HEIGHT 64
-#define DISPLAY_SIZE ((SDISPLAY_WIDTH * SDISPLAY_HEIGHT) / 8)
-#define MEMORY_SIZE 4096
+#define DISPLAY_ROW_WORDS (SDISPLAY_WIDTH / 64)
+#define NUM_PLANES 2
+#define RENDER_MAX_LUT_SCALE 16
+#define STATE_MAGIC "CH8S"
+#define STATE_VERSION 5
+#define STATE_FIXED_SIZE (4 + 2 + 1 + NUM_REGS + 2 + 2 + 1 + 1 + 1 + 2 + 1 + 4 + 8 + 8 + 1 + 1 + AUDIO_PATTERN_SIZE + 1)
+#define STATE_PLANE_SIZE (SDISPLAY_HEIGHT * DISPLAY_ROW_WORDS * 8)
+#define STATE_MAX_SIZE (STATE_FIXED_SIZE + MEMORY_SIZE + STACK_SIZE + NUM_PLANES * STATE_PLANE_SIZE)
+#define STATE_FLAG_INCREMENT_IREG 0x1
+#define STATE_FLAG_SCHIP_MODE 0x2
+#define STATE_FLAG_AUDIO_PATTERN 0x4
+#define RECORDING_MAGIC "CH8R"
+#define RECORDING_VERSION 1
+#define RECORD_INPUT 0x1
+#define RECORD_HASH 0x2
+#define RECORD_END 0x3
+#define ANALYSIS_HEADER "CH8A 1"
+#define TRACE_MAGIC "CH8T"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_SIZE 16
+#define TRACE_WRITE_RECORDS 256
+#define AUDIO_AMPLITUDE 0x2000
+#define AUDIO_CACHE_LINE 64
+#define AUDIO_PATTERN_SIZE 16
+#define MEMORY_SIZE 0x10000
+#define CHIP8_MEMORY_SIZE 0x1000
 #define NUM_REGS 16
 #define PROGRAM_OFFSET 0x200
 #define STACK_OFFSET 0xea0
+#define STACK_SIZE 512
+#define STACK_DEPTH (STACK_SIZE / 2 - 1)
+#define CHIP8_STACK_DEPTH ((CHIP8_MEMORY_SIZE - STACK_OFFSET) / 2 - 1)
+#define XO_STACK_OFFSET MEMORY_SIZE
+#define XO_TIMER_PERIOD 960
 #define SUPER_DIGITS_OFFSET 0x50
+#define XO_STORAGE_NONE 0           // chip8_init instance without room for XO-CHIP
+#define XO_STORAGE_INLINE 1         // chip8_init instance with the extension after it
+#define XO_STORAGE_HEAP 2           // chip8_make instance, allocates the extension
+#define FORK_PAGE_SIZE 256
+#define FORK_MEMORY_PAGES ((MEMORY_SIZE + STACK_SIZE) / FORK_PAGE_SIZE)
+#define FORK_DISPLAY_PAGE_ROWS (FORK_PAGE_SIZE / (DISPLAY_ROW_WORDS * 8))
+#define FORK_PLANE_PAGES (SDISPLAY_HEIGHT / FORK_DISPLAY_PAGE_ROWS)
+#define FORK_NUM_PAGES (FORK_MEMORY_PAGES + NUM_PLANES * FORK_PLANE_PAGES)
+
+// returned by chip8_execute when an instruction raised no event
+#define CHIP8_STOP_NONE CHIP8_STOP_BUDGET
+// returned when 00FA switched to another interpreter, which the running
+// loop can't continue with, never seen outside chip8_run
+#define CHIP8_STOP_RESELECT (CHIP8_STOP_ERROR + 1)
+#define CHIP8_STOP_ALL 0xffffffffu
+
+#define QUIRK_SHIFT_VY 0x1          // 8XY6/8XYE shift VY into VX
+#define QUIRK_INCREMENT_I 0x2       // FX55/FX65 leave I past the last register
+#define QUIRK_RESET_VF 0x4          // 8XY1/8XY2/8XY3 set VF to 0
+#define QUIRK_JUMP_VX 0x8           // BXNN jumps to XNN + VX instead of NNN + V0
+#define QUIRK_CLIP 0x10             // sprites are cut off at the edges instead of wrapping
+#define QUIRK_DISPLAY_WAIT 0x20     // DXYN waits for the start of a timer period
+#define QUIRK_TRACE 0x40            // adds every instruction to the trace, not a quirk
+#define QUIRK_XO_MEMORY 0x80        // runs in the XO-CHIP extension's memory, not a quirk
+
+// Interpreter instances: name, quirks profile and quirk flags. Each row
+// expands chip8_execute_instr with its flags as constants, so the checks
+// fold away. 00FA toggles the default profile's I increment, which gets an
+// instance for either setting.
+#define CHIP8_PROFILES(X, suffix, memory) \
+    X(default##suffix, CHIP8_QUIRKS_DEFAULT, (memory)) \
+    X(default_increment##suffix, CHIP8_QUIRKS_DEFAULT, (memory) | QUIRK_INCREMENT_I) \
+    X(chip8##suffix, CHIP8_QUIRKS_CHIP8, (memory) | QUIRK_SHIFT_VY | QUIRK_INCREMENT_I | QUIRK_RESET_VF | QUIRK_CLIP | QUIRK_DISPLAY_WAIT) \
+    X(schip##suffix, CHIP8_QUIRKS_SCHIP, (memory) | QUIRK_JUMP_VX | QUIRK_CLIP) \
+    X(xochip##suffix, CHIP8_QUIRKS_XOCHIP, (memory) | QUIRK_SHIFT_VY | QUIRK_INCREMENT_I)
+
+// Every profile for programs in the 4 KB memory, then again for XO-CHIP
+// programs in the extension, so the former never check which one is in use
+#define CHIP8_INTERPRETERS(X) CHIP8_PROFILES(X, , 0) CHIP8_PROFILES(X, _xo, QUIRK_XO_MEMORY)
+
+// Traced copies of the same rows, selected while a trace is running, so
+// the others never check for one.
+#ifdef CHIP8_TRACE
+#define CHIP8_TRACED_INTERPRETERS(X) CHIP8_INTERPRETERS(X)
+#else
+#define CHIP8_TRACED_INTERPRETERS(X)
+#endif
+
+#if defined(__GNUC__)
+#define CHIP8_ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define CHIP8_ALWAYS_INLINE __forceinline
+#else
+#define CHIP8_ALWAYS_INLINE inline
+#endif
+
+enum {
+    CHIP8_OP_UNDECODED = 0,
+    CHIP8_OP_00CN, CHIP8_OP_00E0, CHIP8_OP_00EE, CHIP8_OP_00FA, CHIP8_OP_00FB,
+    CHIP8_OP_00FC, CHIP8_OP_00FD, CHIP8_OP_00FE, CHIP8_OP_00FF, CHIP8_OP_0NNN,
+    CHIP8_OP_1NNN, CHIP8_OP_2NNN, CHIP8_OP_3XNN, CHIP8_OP_4XNN, CHIP8_OP_5XY0,
+    CHIP8_OP_6XNN, CHIP8_OP_7XNN, CHIP8_OP_8XY0, CHIP8_OP_8XY1, CHIP8_OP_8XY2,
+    CHIP8_OP_8XY3, CHIP8_OP_8XY4, CHIP8_OP_8XY5, CHIP8_OP_8XY6, CHIP8_OP_8XY7,
+    CHIP8_OP_8XYE, CHIP8_OP_9XY0, CHIP8_OP_ANNN, CHIP8_OP_BNNN, CHIP8_OP_CXNN,
+    CHIP8_OP_DXYN, CHIP8_OP_EX9E, CHIP8_OP_EXA1, CHIP8_OP_FX07, CHIP8_OP_FX0A,
+    CHIP8_OP_FX15, CHIP8_OP_FX18, CHIP8_OP_FX1E, CHIP8_OP_FX29, CHIP8_OP_FX30,
+    CHIP8_OP_FX33, CHIP8_OP_FX55, CHIP8_OP_FX65, CHIP8_OP_00DN, CHIP8_OP_5XY2,
+    CHIP8_OP_5XY3, CHIP8_OP_F000, CHIP8_OP_FN01, CHIP8_OP_F002, CHIP8_OP_FX3A,
+    CHIP8_OP_INVALID
+};
+
+// Pre-decoded instruction, cached per memory address.
+// y, n and nn are the low bits of nnn.
+typedef struct chip8_instr {
+    uint8_t op;
+    uint8_t x;
+    uint16_t nnn;
+} chip8_instr_t;
+
+// Selected by chip8_load_program from the quirks profile.
+typedef struct chip8_interpreter {
+    chip8_quirks_t quirks;
+    unsigned flags;
+    chip8_stop_reason_t (*execute)(chip8_t *ch, const chip8_keyboard_input_t *input);  // without the cycle count and timers
+    int (*run)(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason);
+} chip8_interpreter_t;
+
+// Index of each untraced interpreter in chip8_interpreters, the traced ones follow
+enum {
+#define CHIP8_INTERPRETER_INDEX(name, profile, flags) CHIP8_INTERPRETER_##name,
+    CHIP8_INTERPRETERS(CHIP8_INTERPRETER_INDEX)
+#undef CHIP8_INTERPRETER_INDEX
+};
+
+// Loop polling the delay timer: FX07, then 3XNN or 4XNN on the same
+// register, then 1NNN back to the FX07.
+typedef struct chip8_timer_loop {
+    uint16_t addr;
+    uint8_t x;
+    uint8_t nn;
+    bool exit_if_equal; // 3XNN
+} chip8_timer_loop_t;
+
+// Sound output state. Samples are generated lazily from the cycle count,
+// so the interpreter loop never touches them. One 60 Hz timer period is
+// 960 units of time, 16 cycles in lores, 8 in schip and XO_TIMER_PERIOD
+// in XO-CHIP mode.
+typedef struct chip8_audio {
+    chip8_audio_ring_t *ring;
+    uint32_t sample_rate;
+    uint32_t tone_hz;
+    uint32_t phase;
+    bool use_pattern;           // XO-CHIP pattern, copied from the machine by chip8_audio_update
+    uint8_t pattern[AUDIO_PATTERN_SIZE];
+    uint32_t pattern_step;      // pattern bits per sample, 16.16 fixed point
+    uint32_t pattern_pos;       // bit of the pattern, 16.16 fixed point
+    uint64_t cycle_time;        // units of time per cycle, 960 / timer period
+    uint64_t time_fraction;     // units of time not yet turned into a sample
+    uint64_t last_cycle;        // samples exist up to and including this cycle
+    uint64_t sound_end_cycle;   // first cycle with the sound timer at 0
+} chip8_audio_t;
 
-static void chip8_set_pixel(chip8_t *ch, int x, int y, bool val);
-static bool chip8_get_bit(uint8_t *bytes, int ix);
-static void chip8_set_bit(uint8_t *bytes, int ix, bool val);
-static void chip8_draw_sprite(chip8_t *ch, uint8_t *sprite, int n, int x, int y, uint8_t *vf);
+typedef char chip8_op_classes_check[CHIP8_OP_INVALID + 1 == CHIP8_NUM_OP_CLASSES ? 1 : -1];
+typedef char chip8_frame_size_check[NUM_PLANES * SDISPLAY_HEIGHT * DISPLAY_ROW_WORDS * 8 == CHIP8_FRAME_SIZE ? 1 : -1];
+
+#ifdef CHIP8_PROFILE
+typedef struct chip8_profile {
+    uint64_t instructions;
+    uint64_t op_counts[CHIP8_NUM_OP_CLASSES];
+    uint64_t pc_counts[MEMORY_SIZE];
+    int max_stack_depth;
+    uint64_t sprites_drawn;
+    uint64_t pixels_drawn;
+    uint64_t collisions;
+} chip8_profile_t;
+#endif
+
+// One register of CHIP8_VEC_WIDTH batch lanes
+#if defined(__AVX2__)
+#define CHIP8_VEC_WIDTH 32
+typedef __m256i chip8_vec_t;
+#elif defined(__SSE2__)
+#define CHIP8_VEC_WIDTH 16
+typedef __m128i chip8_vec_t;
+#else
+#define CHIP8_VEC_WIDTH 16
+typedef struct {
+    uint8_t b[CHIP8_VEC_WIDTH];
+} chip8_vec_t;
+#endif
+
+static uint64_t chip8_rotr64(uint64_t v, int n);
+static void chip8_scroll_down(chip8_t *ch, int n);
+static void chip8_scroll_up(chip8_t *ch, int n);
+static void chip8_scroll_right(chip8_t *ch);
+static void chip8_scroll_left(chip8_t *ch);
+static uint8_t chip8_word_columns(uint64_t word);
+#ifdef CHIP8_PROFILE
+static int chip8_popcount64(uint64_t word);
+#endif
+static void chip8_mark_dirty(chip8_t *ch, uint64_t rows, uint16_t columns);
+static void chip8_mark_all_dirty(chip8_t *ch);
+static void chip8_render(chip8_t *ch, void *pixels, size_t pitch, int scale, const void *palette, size_t pixel_size, int x, int y, int width, int height);
+static void chip8_render_planes(chip8_t *ch, void *pixels, size_t pitch, int scale, const void *palette, size_t pixel_size, int x, int y, int width, int height);
+static bool chip8_clip_rect(chip8_t *ch, int *x, int *y, int *width, int *height);
+static void chip8_draw_sprite(chip8_t *ch, uint8_t *sprite, int n, int x, int y, bool clip, uint8_t *vf);
+static bool chip8_draw_plane(chip8_t *ch, uint64_t (*display)[DISPLAY_ROW_WORDS], const uint8_t *sprite, int rows, int cols, int x, int y, bool clip, uint64_t *rows_changed, uint16_t *columns_changed);
+static uint8_t chip8_rand(chip8_t *ch);
+static void chip8_tick_timers(chip8_t *ch);
+static void chip8_advance_timers(chip8_t *ch, uint64_t num_ticks);
+static int chip8_delay_timer_after(chip8_t *ch, uint64_t num_ticks);
+static void chip8_update_timer_period(chip8_t *ch);
+static bool chip8_in_program(chip8_t *ch, uint16_t addr);
+static CHIP8_ALWAYS_INLINE uint16_t* chip8_stack(chip8_t *ch, unsigned quirks);
+static CHIP8_ALWAYS_INLINE struct chip8_xo* chip8_xo(chip8_t *ch);
+static CHIP8_ALWAYS_INLINE uint8_t* chip8_memory(chip8_t *ch);
+static CHIP8_ALWAYS_INLINE chip8_instr_t* chip8_decoded(chip8_t *ch);
+static CHIP8_ALWAYS_INLINE uint8_t* chip8_interpreter_memory(chip8_t *ch, unsigned quirks);
+static CHIP8_ALWAYS_INLINE chip8_instr_t* chip8_interpreter_decoded(chip8_t *ch, unsigned quirks);
+static uint32_t chip8_memory_end(chip8_t *ch);
+static bool chip8_reserve_xo(chip8_t *ch);
+static CHIP8_ALWAYS_INLINE const chip8_instr_t* chip8_fetch(chip8_t *ch, uint16_t addr);
+static CHIP8_ALWAYS_INLINE const chip8_instr_t* chip8_interpreter_fetch(chip8_t *ch, uint16_t addr, unsigned quirks);
+static CHIP8_ALWAYS_INLINE chip8_stop_reason_t chip8_execute(chip8_t *ch, const chip8_keyboard_input_t *input);
+static CHIP8_ALWAYS_INLINE chip8_stop_reason_t chip8_execute_instr(chip8_t *ch, const chip8_keyboard_input_t *input, unsigned quirks);
+static CHIP8_ALWAYS_INLINE chip8_stop_reason_t chip8_step(chip8_t *ch, const chip8_keyboard_input_t *input, unsigned quirks);
+static CHIP8_ALWAYS_INLINE int chip8_run_loop(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason, unsigned quirks);
+#define CHIP8_INTERPRETER_PROTOTYPE(name, profile, flags) \
+    static chip8_stop_reason_t chip8_execute_instr_##name(chip8_t *ch, const chip8_keyboard_input_t *input); \
+    static int chip8_run_##name(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason);
+CHIP8_INTERPRETERS(CHIP8_INTERPRETER_PROTOTYPE)
+#undef CHIP8_INTERPRETER_PROTOTYPE
+#define CHIP8_TRACED_INTERPRETER_PROTOTYPE(name, profile, flags) \
+    static chip8_stop_reason_t chip8_trace_instr_##name(chip8_t *ch, const chip8_keyboard_input_t *input); \
+    static int chip8_trace_run_##name(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason);
+CHIP8_TRACED_INTERPRETERS(CHIP8_TRACED_INTERPRETER_PROTOTYPE)
+#undef CHIP8_TRACED_INTERPRETER_PROTOTYPE
+static void chip8_select_interpreter(chip8_t *ch, chip8_quirks_t quirks);
+static bool chip8_is_tracing(chip8_t *ch);
+static int chip8_run(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason);
+static int chip8_skip_idle(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles);
+static int chip8_display_wait_cycles(chip8_t *ch);
+static bool chip8_match_timer_loop(chip8_t *ch, uint16_t addr, chip8_timer_loop_t *out_loop);
+static uint64_t chip8_timer_loop_iterations(chip8_t *ch, const chip8_timer_loop_t *loop, uint64_t max_iterations, uint8_t *out_value);
+#ifdef CHIP8_PROFILE
+static void chip8_profile_skipped(chip8_t *ch, uint16_t addr, uint64_t count);
+#endif
+static void chip8_skip_next(chip8_t *ch);
+#ifdef CHIP8_TRACE
+static CHIP8_ALWAYS_INLINE chip8_stop_reason_t chip8_trace_instr(chip8_t *ch, const chip8_keyboard_input_t *input, unsigned quirks);
+static uint8_t chip8_trace_reg(uint8_t op, uint8_t x);
+static void chip8_trace_write(chip8_t *ch, size_t first, size_t count);
+#endif
+static uint8_t chip8_decode(uint16_t opcode);
+static void chip8_setup(chip8_t *ch);
+static bool chip8_set_xochip(chip8_t *ch, bool xochip);
+static void chip8_write_image(chip8_t *ch, int start, int end, const uint8_t *program, size_t size);
+static void chip8_restore_pages(chip8_t *ch, const uint8_t *program, size_t size);
+static size_t chip8_snapshot_size(bool xochip);
+static void chip8_invalidate_code(chip8_t *ch, int addr, int len, unsigned quirks);
+static void chip8_mark_written(chip8_t *ch, int addr, int len);
+static void chip8_stamp_display(chip8_t *ch);
+static void chip8_fork_reset(chip8_t *ch);
+static void chip8_copy_machine(chip8_t *dst, const chip8_t *src);
+static void chip8_fork_copy_page(chip8_t *parent, chip8_t *child, int page);
+static uint8_t* chip8_put_u16(uint8_t *p, uint16_t v);
+static uint8_t* chip8_put_u32(uint8_t *p, uint32_t v);
+static uint8_t* chip8_put_u64(uint8_t *p, uint64_t v);
+static uint16_t chip8_get_u16(const uint8_t *p);
+static uint32_t chip8_get_u32(const uint8_t *p);
+static uint64_t chip8_get_u64(const uint8_t *p);
+static size_t chip8_put_varint(uint8_t *p, size_t v);
+static size_t chip8_get_varint(const uint8_t *p, size_t size, size_t *out_v);
+static size_t chip8_xor_rle_encode(const uint8_t *a, const uint8_t *b, size_t len, uint8_t *out);
+static bool chip8_xor_rle_apply(uint8_t *target, size_t len, const uint8_t *delta, size_t delta_size);
+static void chip8_ring_write(chip8_rewind_t *rw, size_t offset, const uint8_t *src, size_t len);
+static void chip8_ring_read(chip8_rewind_t *rw, size_t offset, uint8_t *dst, size_t len);
+static uint64_t chip8_fnv1a(const uint8_t *data, size_t size);
+static uint64_t chip8_state_hash(chip8_t *ch);
+static uint16_t chip8_key_mask(const chip8_keyboard_input_t *input);
+static void chip8_record(chip8_t *ch, uint8_t tag, const uint8_t *payload, size_t payload_size);
+static void chip8_record_input(chip8_t *ch, const chip8_keyboard_input_t *input);
+static void chip8_record_checkpoint(chip8_t *ch);
+static void chip8_audio_restart(chip8_t *ch);
+static void chip8_audio_update(chip8_t *ch, uint64_t until_cycle);
+static void chip8_audio_flush(chip8_t *ch, uint64_t until_cycle);
+static void chip8_audio_emit(chip8_t *ch, uint64_t time, bool on);
+static void chip8_batch_gather(chip8_batch_t *b, int lane);
+static void chip8_batch_scatter(chip8_batch_t *b, int lane);
+static void chip8_batch_sync_touched(chip8_batch_t *b);
+static void chip8_batch_tick_timers(chip8_batch_t *b);
+static int chip8_batch_next_pending(chip8_batch_t *b, int from);
+static void chip8_batch_step_group(chip8_batch_t *b, int first, const chip8_keyboard_input_t *inputs);
+static bool chip8_batch_can_vectorize(uint8_t op);
+static void chip8_batch_execute_chunk(chip8_batch_t *b, const chip8_instr_t *ins, int start, const chip8_keyboard_input_t *inputs);
+static void chip8_batch_execute_lane(chip8_batch_t *b, int lane, const chip8_keyboard_input_t *inputs);
+#ifdef CHIP8_JIT_ENABLED
+static struct chip8_jit* chip8_jit_make(chip8_jit_mode_t mode);
+static void chip8_jit_destroy(struct chip8_jit *jit);
+static void chip8_jit_flush(struct chip8_jit *jit);
+static bool chip8_jit_protect(struct chip8_jit *jit, bool writable);
+static void chip8_jit_invalidate(struct chip8_jit *jit, int start, int end);
+static int chip8_jit_run_block(chip8_t *ch, int max_cycles);
+#endif
+
+// XO-CHIP's address space and decode cache. An XO-CHIP chip8_init instance
+// holds it right after the chip8_t, a chip8_make instance allocates it when
+// it first switches to XO-CHIP.
+typedef struct chip8_xo {
+    // the XO-CHIP stack lives past the 64 KB address space
+    uint8_t memory[MEMORY_SIZE + STACK_SIZE];
+    chip8_instr_t decoded[MEMORY_SIZE];
+} chip8_xo_t;
 
 struct chip8 {
-    uint8_t memory[MEMORY_SIZE];
-    uint16_t *stack;
-    uint8_t display[DISPLAY_SIZE];
+    // CHIP-8 and SCHIP memory, stack included. XO-CHIP programs run in the
+    // extension instead, chip8_memory and chip8_decoded pick the one in use.
+    uint8_t memory[CHIP8_MEMORY_SIZE];
+    uint32_t stack_offset;      // offsets and indices instead of pointers keep instances relocatable
+    // bitplanes of one row per entry, bit 63 of word 0 is the leftmost pixel.
+    // lores mode only uses word 0 of the first DISPLAY_HEIGHT rows and
+    // only XO-CHIP programs use plane 1.
+    uint64_t display[NUM_PLANES][SDISPLAY_HEIGHT][DISPLAY_ROW_WORDS];
+    // chip8_fork and chip8_load_program bookkeeping. Writes stamp their page
+    // of memory or the display with fork_clock, which every fork and load
+    // advances. Display rows are collected in fork_rows and stamped when the
+    // clock advances.
+    uint64_t fork_clock;
+    uint64_t page_clock[FORK_NUM_PAGES];
+    uint64_t fork_rows;
+    uint64_t fork_id;           // replaced whenever the whole state is
+    uint64_t fork_parent_id;    // fork_id of the last chip8_fork parent
+    const chip8_t *fork_parent; // and its address, a memcpy clone has the same fork_id; only compared
+    uint64_t fork_parent_clock; // the parent's fork_clock after that fork
+    uint64_t fork_own_clock;    // fork_clock after that fork
+    uint64_t load_clock;        // fork_clock after the last load, 0 if memory was replaced since
+    uint8_t planes;             // bit p is set if plane p is drawn to, FN01
+    uint64_t dirty_rows;
+    uint16_t dirty_columns;
+    uint32_t frame_generation;
     uint8_t regs[NUM_REGS];
     uint16_t i_reg;
     uint16_t program_counter;
@@ -50,9 +381,117 @@ struct chip8 {
     uint8_t delay_timer;
     uint8_t sound_timer;
     size_t program_size;
+    bool code_verified;         // chip8_load_analysis proved stores never reach code
     bool increment_ireg;
     bool schip_mode;
+    bool xochip;
+    chip8_variant_t variant;    // used by the next chip8_load_program
+    chip8_quirks_t quirks;      // used by the next chip8_load_program
+    uint8_t interpreter;        // index into chip8_interpreters
+    uint32_t memory_size;
     int timer_counter;
+    int timer_period;           // cycles per timer decrement
+    uint8_t pitch;
+    bool has_audio_pattern;
+    uint8_t audio_pattern[AUDIO_PATTERN_SIZE];
+    uint64_t rng_state;
+    uint64_t cycle_count;
+    struct chip8_recording *recording;
+    chip8_audio_t audio;
+    chip8_instr_t decoded[CHIP8_MEMORY_SIZE];
+    uint8_t xo_storage;         // XO_STORAGE_*
+    chip8_xo_t *xo;             // allocated extension of XO_STORAGE_HEAP instances, NULL until needed
+    bool idle_skip;             // chip8_set_idle_skip
+#ifdef CHIP8_JIT_ENABLED
+    struct chip8_jit *jit;
+#endif
+#ifdef CHIP8_TRACE
+    struct chip8_trace *trace;
+#endif
+#ifdef CHIP8_PROFILE
+    chip8_profile_t profile;
+#endif
+};
+
+// History of snapshots, stored as the newest full snapshot plus a ring of
+// backward deltas. Each delta is the XOR of a snapshot with the one pushed
+// before it, run-length encoded, and framed by its length on both sides
+// so it can be dropped from the old end or popped from the new end.
+struct chip8_rewind {
+    uint8_t *ring;
+    size_t capacity;
+    size_t start;
+    size_t used;
+    size_t num_deltas;
+    bool has_latest;
+    size_t state_size;
+    uint8_t latest[STATE_MAX_SIZE];
+    uint8_t current[STATE_MAX_SIZE];
+    uint8_t delta[STATE_MAX_SIZE * 2 + 16];
+};
+
+// Recordings are a header and a snapshot of the starting state followed by
+// records of a tag byte, a varint cycle delta from the previous record and
+// the tag's payload: the new key mask for RECORD_INPUT, the state hash
+// for RECORD_HASH and RECORD_END.
+struct chip8_recording {
+    FILE *fp;
+    bool failed;
+    uint16_t keys;
+    uint64_t last_cycle;
+    uint64_t next_hash_cycle;
+    uint64_t hash_interval;
+};
+
+struct chip8_trace {
+    FILE *fp;
+    bool failed;
+    uint64_t count;             // records ever added, the ring holds the latest
+    chip8_trace_record_t records[CHIP8_TRACE_RING_SIZE];
+};
+
+// Single producer, single consumer sample queue. head and tail only ever
+// grow and are masked on access. Each side's index and counter share a
+// cache line of their own.
+struct chip8_audio_ring {
+    atomic_size_t head;
+    atomic_uint_fast64_t overrun_samples;
+    char producer_pad[AUDIO_CACHE_LINE];
+    atomic_size_t tail;
+    atomic_uint_fast64_t underrun_samples;
+    char consumer_pad[AUDIO_CACHE_LINE];
+    size_t mask;
+    int16_t *samples;
+};
+
+// Lockstep lanes. Registers, PC, I and timers live here in struct-of-arrays
+// form, one byte or word per lane, padded to a multiple of CHIP8_VEC_WIDTH.
+// Memory, stack, display and rng stay in the lanes' chip8_t, which is only
+// brought up to date when an instruction has to run through chip8_execute_instr.
+struct chip8_batch {
+    int num_lanes;
+    int stride;
+    chip8_t **lanes;
+    uint8_t *regs;              // regs[r * stride + lane]
+    uint8_t *pc_lo;             // PC and I are split in bytes to keep all lanes 8-bit
+    uint8_t *pc_hi;
+    uint8_t *i_lo;
+    uint8_t *i_hi;
+    uint8_t *delay_timer;
+    uint8_t *sound_timer;
+    uint8_t *timer_counter;
+    uint8_t *timer_period;
+    uint8_t *active;            // 0xff until the lane fails
+    uint8_t *pending;           // 0xff if the lane hasn't run the current cycle yet
+    uint8_t *mask;              // 0xff if the lane is in the group being executed
+    bool *touched;              // handed out by chip8_batch_get_lane since the last run
+    bool any_touched;
+    bool sizes_differ;
+    int cycle;                  // index of the cycle being run by chip8_batch_run_cycles
+    size_t program_size;
+    uint8_t image[CHIP8_MEMORY_SIZE];     // memory as loaded by chip8_batch_load_program
+    uint8_t modified[CHIP8_MEMORY_SIZE];  // non-zero if a lane may differ from image here
+    uint8_t *arena;
 };
 
 static uint8_t digits[] = {
@@ -74,6 +513,43 @@ static uint8_t digits[] = {
     0xf0, 0x80, 0xf0, 0x80, 0x80  // F
 };
 
+static const char *op_class_names[CHIP8_NUM_OP_CLASSES] = {
+    "undecoded",
+    "00CN", "00E0", "00EE", "00FA", "00FB", "00FC", "00FD", "00FE", "00FF", "0NNN",
+    "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN", "8XY0", "8XY1", "8XY2",
+    "8XY3", "8XY4", "8XY5", "8XY6", "8XY7", "8XYE", "9XY0", "ANNN", "BNNN", "CXNN",
+    "DXYN", "EX9E", "EXA1", "FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX30",
+    "FX33", "FX55", "FX65", "00DN", "5XY2", "5XY3", "F000", "FN01", "F002", "FX3A",
+    "invalid",
+};
+
+// %x, %y and %n are nibbles of the opcode, %b is NN, %a is NNN, %w the
+// whole opcode and %l the word after it.
+static const char *op_mnemonics[CHIP8_NUM_OP_CLASSES] = {
+    "DW 0x%w",
+    "SCD %n", "CLS", "RET", "INCI", "SCR", "SCL", "EXIT", "LOW", "HIGH", "SYS 0x%a",
+    "JP 0x%a", "CALL 0x%a", "SE V%x, 0x%b", "SNE V%x, 0x%b", "SE V%x, V%y", "LD V%x, 0x%b",
+    "ADD V%x, 0x%b", "LD V%x, V%y", "OR V%x, V%y", "AND V%x, V%y", "XOR V%x, V%y",
+    "ADD V%x, V%y", "SUB V%x, V%y", "SHR V%x, V%y", "SUBN V%x, V%y", "SHL V%x, V%y",
+    "SNE V%x, V%y", "LD I, 0x%a", "JP V0, 0x%a", "RND V%x, 0x%b", "DRW V%x, V%y, %n",
+    "SKP V%x", "SKNP V%x", "LD V%x, DT", "LD V%x, K", "LD DT, V%x", "LD ST, V%x",
+    "ADD I, V%x", "LD F, V%x", "LD HF, V%x", "LD B, V%x", "LD [I], V%x", "LD V%x, [I]",
+    "SCU %n", "SAVE V%x, V%y", "LOAD V%x, V%y", "LD I, 0x%l", "PLANE %x", "AUDIO",
+    "PITCH V%x",
+    "DW 0x%w",
+};
+
+static const chip8_interpreter_t chip8_interpreters[] = {
+#define CHIP8_INTERPRETER_ENTRY(name, profile, flags) \
+    {profile, flags, chip8_execute_instr_##name, chip8_run_##name},
+    CHIP8_INTERPRETERS(CHIP8_INTERPRETER_ENTRY)
+#undef CHIP8_INTERPRETER_ENTRY
+#define CHIP8_TRACED_INTERPRETER_ENTRY(name, profile, flags) \
+    {profile, (flags) | QUIRK_TRACE, chip8_trace_instr_##name, chip8_trace_run_##name},
+    CHIP8_TRACED_INTERPRETERS(CHIP8_TRACED_INTERPRETER_ENTRY)
+#undef CHIP8_TRACED_INTERPRETER_ENTRY
+};
+
 static uint8_t super_digits[] = {
     0xff, 0xff, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xff, 0xff, // 0
     0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xff, 0xff, // 1
@@ -94,293 +570,3610 @@ static uint8_t super_digits[] = {
 };
 
 chip8_t* chip8_make(void) {
-    chip8_t *ch = malloc(sizeof(chip8_t));
+    chip8_t *ch = calloc(1, sizeof(chip8_t));
     if (ch == NULL) {
         return NULL;
     }
+    chip8_setup(ch);
+    ch->xo_storage = XO_STORAGE_HEAP;
+    return ch;
+}
+
+size_t chip8_state_size(chip8_variant_t variant) {
+    // XO-CHIP instances keep the extension right after the chip8_t
+    return sizeof(chip8_t) + (variant == CHIP8_VARIANT_XOCHIP ? sizeof(chip8_xo_t) : 0);
+}
+
+chip8_t* chip8_init(void *buf, chip8_variant_t variant) {
+    if (variant != CHIP8_VARIANT_SCHIP && variant != CHIP8_VARIANT_XOCHIP) {
+        return NULL;
+    }
+    chip8_t *ch = buf;
+    // the extension is zeroed by chip8_set_xochip when a program needs it
     memset(ch, 0, sizeof(chip8_t));
-    ch->stack = (uint16_t*)(ch->memory + STACK_OFFSET);
-    memcpy(ch->memory, digits, sizeof(digits));
-    memcpy(ch->memory + SUPER_DIGITS_OFFSET, super_digits, sizeof(super_digits));
+    chip8_setup(ch);
+    ch->xo_storage = variant == CHIP8_VARIANT_XOCHIP ? XO_STORAGE_INLINE : XO_STORAGE_NONE;
+    ch->variant = variant;
     return ch;
 }
 
+void chip8_deinit(chip8_t *ch) {
+    free(ch->recording);
+    ch->recording = NULL;
+    free(ch->xo);
+    ch->xo = NULL;
+#ifdef CHIP8_TRACE
+    free(ch->trace);
+    ch->trace = NULL;
+#endif
+#ifdef CHIP8_JIT_ENABLED
+    chip8_jit_destroy(ch->jit);
+    ch->jit = NULL;
+#endif
+}
+
 void chip8_destroy(chip8_t *ch) {
+    if (ch == NULL) {
+        return;
+    }
+    chip8_deinit(ch);
     free(ch);
 }
 
+bool chip8_fork(chip8_t *parent, chip8_t *child) {
+    if (parent == child || child->recording != NULL) {
+        return false;
+    }
+    chip8_stamp_display(parent);
+    chip8_stamp_display(child);
+    if (child->fork_parent_id == parent->fork_id && child->fork_parent == parent) {
+        for (int page = 0; page < FORK_NUM_PAGES; page++) {
+            if (parent->page_clock[page] >= child->fork_parent_clock || child->page_clock[page] >= child->fork_own_clock) {
+                chip8_fork_copy_page(parent, child, page);
+                child->page_clock[page] = child->fork_clock;
+            }
+        }
+    } else {
+        if (parent->xochip && !chip8_reserve_xo(child)) {
+            return false;
+        }
+        child->xochip = parent->xochip;
+        memcpy(chip8_memory(child), chip8_memory(parent), chip8_memory_end(parent));
+        memcpy(chip8_decoded(child), chip8_decoded(parent), parent->memory_size * sizeof(chip8_instr_t));
+        memcpy(child->display, parent->display, sizeof(child->display));
+        for (int page = 0; page < FORK_NUM_PAGES; page++) {
+            child->page_clock[page] = child->fork_clock;
+        }
+#ifdef CHIP8_JIT_ENABLED
+        if (child->jit != NULL) {
+            chip8_jit_flush(child->jit);
+        }
+#endif
+    }
+#ifdef CHIP8_JIT_ENABLED
+    if (child->jit != NULL && child->interpreter != parent->interpreter) {
+        chip8_jit_flush(child->jit);
+    }
+#endif
+    // calls don't stamp their pages, the stack is always copied
+    memcpy(chip8_memory(child) + parent->stack_offset, chip8_memory(parent) + parent->stack_offset,
+           chip8_memory_end(parent) - parent->stack_offset);
+    chip8_copy_machine(child, parent);
+    if (child->audio.ring != NULL) {
+        chip8_audio_restart(child);
+    }
+    // later writes to either side are newer than the fork
+    parent->fork_clock++;
+    child->fork_clock++;
+    chip8_fork_reset(child);
+    child->fork_parent_id = parent->fork_id;
+    child->fork_parent = parent;
+    child->fork_parent_clock = parent->fork_clock;
+    child->fork_own_clock = child->fork_clock;
+    return true;
+}
+
 bool chip8_load_program(chip8_t *ch, unsigned char *program, size_t size) {
-    if (PROGRAM_OFFSET + size >= STACK_OFFSET) {
+    bool xochip = ch->variant == CHIP8_VARIANT_XOCHIP;
+    if (xochip ? PROGRAM_OFFSET + size > MEMORY_SIZE : PROGRAM_OFFSET + size >= STACK_OFFSET) {
         return false;
     }
-    memcpy(ch->memory + PROGRAM_OFFSET, program, size);
+    if (xochip == ch->xochip && ch->load_clock != 0) {
+        chip8_restore_pages(ch, program, size);
+    } else {
+        if (!chip8_set_xochip(ch, xochip)) {
+            return false;
+        }
+        chip8_write_image(ch, 0, chip8_memory_end(ch), program, size);
+        memset(ch->display, 0, sizeof(ch->display));
+        ch->fork_rows = 0;
+    }
+    ch->fork_clock++;
+    ch->load_clock = ch->fork_clock;
     ch->program_size = size;
+    memset(ch->regs, 0, sizeof(ch->regs));
     ch->i_reg = 0;
     ch->program_counter = PROGRAM_OFFSET;
     ch->stack_pointer = 0;
     ch->delay_timer = 0;
     ch->sound_timer = 0;
     ch->increment_ireg = false;
+    chip8_select_interpreter(ch, ch->quirks);
     ch->schip_mode = false;
     ch->timer_counter = 0;
+    chip8_update_timer_period(ch);
+    ch->planes = 0x1;
+    ch->pitch = 64;
+    ch->has_audio_pattern = false;
+    memset(ch->audio_pattern, 0, sizeof(ch->audio_pattern));
+    ch->cycle_count = 0;
+    chip8_audio_restart(ch);
+    chip8_mark_all_dirty(ch);
     return true;
 }
 
 bool chip8_cpu_tick(chip8_t *ch, const chip8_keyboard_input_t *input) {
-    ch->timer_counter++;
-    if (ch->timer_counter >= 16 || (ch->schip_mode && ch->timer_counter >= 8)) {
-        if (ch->delay_timer > 0) {
-            ch->delay_timer--;
-        }
-        if (ch->sound_timer > 0) {
-            ch->sound_timer--;
-        }
-        ch->timer_counter = 0;
+    if (ch->recording != NULL) {
+        chip8_record_input(ch, input);
+    }
+    bool ok = chip8_execute(ch, input) != CHIP8_STOP_ERROR;
+    if (ch->recording != NULL) {
+        chip8_record_checkpoint(ch);
+    }
+    if (ch->audio.ring != NULL) {
+        chip8_audio_flush(ch, ch->cycle_count);
+    }
+    return ok;
+}
+
+int chip8_run_cycles(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, chip8_stop_reason_t *out_reason) {
+    if (ch->recording != NULL) {
+        chip8_record_input(ch, input);
     }
-    if ((ch->program_counter - PROGRAM_OFFSET + 1) >= ch->program_size) {
+    int cycles = chip8_run(ch, input, max_cycles, CHIP8_STOP_ALL, out_reason);
+    if (ch->recording != NULL) {
+        chip8_record_checkpoint(ch);
+    }
+    if (ch->audio.ring != NULL) {
+        chip8_audio_flush(ch, ch->cycle_count);
+    }
+    return cycles;
+}
+
+bool chip8_set_variant(chip8_t *ch, chip8_variant_t variant) {
+    if (variant != CHIP8_VARIANT_SCHIP && variant != CHIP8_VARIANT_XOCHIP) {
         return false;
     }
-    uint8_t bytes[2] = {
-        ch->memory[ch->program_counter],
-        ch->memory[ch->program_counter + 1]
-    };
-    uint16_t opcode = bytes[1] | (bytes[0] << 8);
-    uint8_t nibs[4] = {
-        (bytes[0] & 0xf0) >> 4, bytes[0] & 0x0f,
-        (bytes[1] & 0xf0) >> 4, bytes[1] & 0x0f
-    };
-    uint16_t nnn = opcode & 0xfff;
-    uint8_t nn = opcode & 0xff;
-    uint8_t n = nibs[3];
-    uint8_t x = nibs[1];
-    uint8_t y = nibs[2];
-    if (nibs[0] == 0x0 && nibs[1] == 0x0 && nibs[2] == 0xc) { // 00CN schip
-        int rem_lines = chip8_get_height(ch) - n;
-        int width = chip8_get_width(ch);
-        memmove(ch->display + (width / 8) * n, ch->display, rem_lines * (width / 8));
-        memset(ch->display, 0, (width / 8) * n);
-    } else if (opcode == 0x00e0) { // 00E0
-        memset(ch->display, 0x0, DISPLAY_SIZE);
-    } else if (opcode == 0x00ee) { // 00EE
-        ch->program_counter = ch->stack[ch->stack_pointer];
-        ch->stack_pointer--;
-    } else if (opcode == 0x00fa) { // 00FA non-standard
-        ch->increment_ireg = !ch->increment_ireg;
-    } else if (opcode == 0x00fb) { // 00FB schip
-        int row_len = chip8_get_width(ch) / 8;
-        uint8_t byte = 0;
-        for (int row = 0; row < chip8_get_height(ch); row++) {
-            uint8_t *row_ptr = ch->display + (row_len * row);
-            for (int i = 0; i < row_len; i++) {
-                uint8_t current_byte = row_ptr[i];
-                row_ptr[i] = (current_byte >> 4) | (byte << 4);
-                byte = current_byte;
-            }
-        }
-    } else if (opcode == 0x00fc) { // 00FC schip
-        int row_len = chip8_get_width(ch) / 8;
-        for (int row = 0; row < chip8_get_height(ch); row++) {
-            uint8_t byte = 0;
-            uint8_t *row_ptr = ch->display + (row_len * row);
-            for (int i = row_len - 1; i >= 0; i--) {
-                uint8_t current_byte = row_ptr[i];
-                row_ptr[i] = ((current_byte << 4) & 0xf0) | ((byte >> 4) & 0xf);
-                byte = current_byte;
-            }
-        }
-    } else if (opcode == 0x00fd) { // 00FD
-        // exit
-    } else if (opcode == 0x00fe) { // 00FE schip
-        ch->schip_mode = false;
-    } else if (opcode == 0x00ff) { // 00FF schip
-        ch->schip_mode = true;
-    } else if (nibs[0] == 0x0) { // 0NNN
-        // jump to sys addr
-    } else if (nibs[0] == 0x1) { // 1NNN
-        ch->program_counter = nnn - 2;
-    } else if (nibs[0] == 0x2) { // 2NNN
-        ch->stack_pointer++;
-        ch->stack[ch->stack_pointer] = ch->program_counter;
-        ch->program_counter = nnn - 2;
-    } else if (nibs[0] == 0x3) { // 3XNN
-        if (ch->regs[x] == nn) {
-            ch->program_counter += 2;
-        }
-    } else if (nibs[0] == 0x4) { // 4XNN
-        if (ch->regs[x] != nn) {
-            ch->program_counter += 2;
+    if (variant == CHIP8_VARIANT_XOCHIP && ch->xo_storage == XO_STORAGE_NONE) {
+        return false;
+    }
+    ch->variant = variant;
+    return true;
+}
+
+chip8_variant_t chip8_get_variant(chip8_t *ch) {
+    return ch->xochip ? CHIP8_VARIANT_XOCHIP : CHIP8_VARIANT_SCHIP;
+}
+
+bool chip8_set_quirks(chip8_t *ch, chip8_quirks_t quirks) {
+    if ((unsigned)quirks > CHIP8_QUIRKS_XOCHIP) {
+        return false;
+    }
+    ch->quirks = quirks;
+    return true;
+}
+
+chip8_quirks_t chip8_get_quirks(chip8_t *ch) {
+    return chip8_interpreters[ch->interpreter].quirks;
+}
+
+bool chip8_run_frame(chip8_t *ch, const chip8_keyboard_input_t *input) {
+    int num_cycles = ch->timer_period;
+    chip8_stop_reason_t reason;
+    if (ch->recording != NULL) {
+        chip8_record_input(ch, input);
+    }
+    chip8_run(ch, input, num_cycles, 1 << CHIP8_STOP_ERROR, &reason);
+    if (ch->recording != NULL) {
+        chip8_record_checkpoint(ch);
+    }
+    if (ch->audio.ring != NULL) {
+        chip8_audio_flush(ch, ch->cycle_count);
+    }
+    return reason != CHIP8_STOP_ERROR;
+}
+
+uint64_t chip8_get_cycle_count(chip8_t *ch) {
+    return ch->cycle_count;
+}
+
+int chip8_get_timer_period(chip8_t *ch) {
+    return ch->timer_period;
+}
+
+chip8_idle_state_t chip8_get_idle_state(chip8_t *ch, uint64_t *out_cycles) {
+    uint64_t cycles = UINT64_MAX;
+    chip8_idle_state_t state = CHIP8_IDLE_NONE;
+    uint16_t pc = ch->program_counter;
+    chip8_timer_loop_t loop;
+    if (!chip8_in_program(ch, pc)) {
+        cycles = 0;
+    } else if (chip8_fetch(ch, pc)->op == CHIP8_OP_FX0A) {
+        state = CHIP8_IDLE_WAIT_KEY;
+    } else if (chip8_fetch(ch, pc)->op == CHIP8_OP_1NNN && chip8_fetch(ch, pc)->nnn == pc) {
+        state = CHIP8_IDLE_HALTED;
+    } else if (chip8_fetch(ch, pc)->op == CHIP8_OP_DXYN && chip8_display_wait_cycles(ch) > 0) {
+        state = CHIP8_IDLE_WAIT_TIMER;
+        cycles = chip8_display_wait_cycles(ch);
+    } else if (chip8_match_timer_loop(ch, pc, &loop) || chip8_match_timer_loop(ch, pc - 2, &loop) ||
+               chip8_match_timer_loop(ch, pc - 4, &loop)) {
+        uint8_t value;
+        uint64_t max_iterations = UINT64_MAX / 4;
+        uint64_t iterations = chip8_timer_loop_iterations(ch, &loop, max_iterations, &value);
+        state = iterations == max_iterations ? CHIP8_IDLE_HALTED : CHIP8_IDLE_WAIT_TIMER;
+        if (state == CHIP8_IDLE_WAIT_TIMER) {
+            cycles = iterations * 3;
         }
-    } else if (nibs[0] == 0x5 && nibs[3] == 0x0) { // 5XY0
-        if (ch->regs[x] == ch->regs[y]) {
-            ch->program_counter += 2;
+    } else {
+        cycles = 0;
+    }
+    if (out_cycles != NULL) {
+        *out_cycles = cycles;
+    }
+    return state;
+}
+
+void chip8_set_idle_skip(chip8_t *ch, bool enabled) {
+    ch->idle_skip = enabled;
+}
+
+void chip8_seed_rng(chip8_t *ch, uint64_t seed) {
+    // splitmix64 so that nearby seeds give unrelated xorshift states
+    uint64_t z = seed + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    ch->rng_state = z != 0 ? z : 0x9e3779b97f4a7c15ull;
+}
+
+bool chip8_set_jit(chip8_t *ch, chip8_jit_mode_t mode) {
+#ifdef CHIP8_JIT_ENABLED
+    chip8_jit_destroy(ch->jit);
+    ch->jit = NULL;
+    if (mode == CHIP8_JIT_OFF) {
+        return true;
+    }
+#ifdef CHIP8_PROFILE
+    // compiled blocks would bypass the profiler's counters
+    return false;
+#endif
+    ch->jit = chip8_jit_make(mode);
+    return ch->jit != NULL;
+#else
+    return mode == CHIP8_JIT_OFF;
+#endif
+}
+
+size_t chip8_save_state(chip8_t *ch, void *buf, size_t size) {
+    size_t state_size = chip8_snapshot_size(ch->xochip);
+    if (buf == NULL) {
+        return state_size;
+    }
+    if (size < state_size) {
+        return 0;
+    }
+    uint8_t *p = buf;
+    memcpy(p, STATE_MAGIC, 4);
+    p += 4;
+    p = chip8_put_u16(p, STATE_VERSION);
+    *p++ = ch->xochip ? CHIP8_VARIANT_XOCHIP : CHIP8_VARIANT_SCHIP;
+    memcpy(p, chip8_memory(ch), chip8_memory_end(ch));
+    p += chip8_memory_end(ch);
+    for (int plane = 0; plane < (ch->xochip ? NUM_PLANES : 1); plane++) {
+        for (int row = 0; row < SDISPLAY_HEIGHT; row++) {
+            for (int w = 0; w < DISPLAY_ROW_WORDS; w++) {
+                p = chip8_put_u64(p, ch->display[plane][row][w]);
+            }
         }
-    } else if (nibs[0] == 0x6) { // 6XNN
-        ch->regs[x] = nn;
-    } else if (nibs[0] == 0x7) { // 7XNN
-        ch->regs[x] = ch->regs[x] + nn;
-    } else if (nibs[0] == 0x8 && nibs[3] == 0x0) { // 8XY0
-        ch->regs[x] = ch->regs[y];
-    } else if (nibs[0] == 0x8 && nibs[3] == 0x1) { // 8XY1
-        ch->regs[x] = ch->regs[x] | ch->regs[y];
-    } else if (nibs[0] == 0x8 && nibs[3] == 0x2) { // 8XY2
-        ch->regs[x] = ch->regs[x] & ch->regs[y];
-    } else if (nibs[0] == 0x8 && nibs[3] == 0x3) { // 8XY3
-        ch->regs[x] = ch->regs[x] ^ ch->regs[y];
-    } else if (nibs[0] == 0x8 && nibs[3] == 0x4) { // 8XY4
-        uint16_t r = ch->regs[x] + ch->regs[y];
-        ch->regs[x] = r;
-        ch->regs[0xf] = r > 0xff ? 0x1 : 0x0;
-    } else if (nibs[0] == 0x8 && nibs[3] == 0x5) {  // 8XY5
-        ch->regs[0xf] = ch->regs[x] > ch->regs[y] ? 0x1 : 0x0;
-        ch->regs[x] = ch->regs[x] - ch->regs[y];
-    } else if (nibs[0] == 0x8 && nibs[3] == 0x6) {  // 8XY6
-        ch->regs[0xf] = ch->regs[x] & 0x1;
-        ch->regs[x] = ch->regs[x] >> 1;
-    } else if (nibs[0] == 0x8 && nibs[3] == 0x7) {  // 8XY7
-        ch->regs[0xf] = ch->regs[y] > ch->regs[x] ? 0x1 : 0x0;
-        ch->regs[x] = ch->regs[y] - ch->regs[x];
-    } else if (nibs[0] == 0x8 && nibs[3] == 0xe) {  // 8XYE
-        ch->regs[0xf] = (ch->regs[x] >> 7) & 0x1;
-        ch->regs[x] = ch->regs[x] << 1;
-    } else if (nibs[0] == 0x9 && nibs[3] == 0x0) {  // 9XY0
-        if (ch->regs[x] != ch->regs[y]) {
-            ch->program_counter += 2;
+    }
+    memcpy(p, ch->regs, NUM_REGS);
+    p += NUM_REGS;
+    p = chip8_put_u16(p, ch->i_reg);
+    p = chip8_put_u16(p, ch->program_counter);
+    *p++ = ch->stack_pointer;
+    *p++ = ch->delay_timer;
+    *p++ = ch->sound_timer;
+    p = chip8_put_u16(p, (uint16_t)ch->timer_counter);
+    *p++ = (ch->increment_ireg ? STATE_FLAG_INCREMENT_IREG : 0) | (ch->schip_mode ? STATE_FLAG_SCHIP_MODE : 0) |
+        (ch->has_audio_pattern ? STATE_FLAG_AUDIO_PATTERN : 0);
+    p = chip8_put_u32(p, (uint32_t)ch->program_size);
+    p = chip8_put_u64(p, ch->rng_state);
+    p = chip8_put_u64(p, ch->cycle_count);
+    *p++ = ch->planes;
+    *p++ = ch->pitch;
+    memcpy(p, ch->audio_pattern, AUDIO_PATTERN_SIZE);
+    p += AUDIO_PATTERN_SIZE;
+    *p++ = chip8_interpreters[ch->interpreter].quirks;
+    return p - (uint8_t*)buf;
+}
+
+bool chip8_load_state(chip8_t *ch, const void *buf, size_t size) {
+    const uint8_t *p = buf;
+    if (size < 7 || memcmp(p, STATE_MAGIC, 4) != 0 || chip8_get_u16(p + 4) != STATE_VERSION || p[6] > CHIP8_VARIANT_XOCHIP) {
+        return false;
+    }
+    bool xochip = p[6] == CHIP8_VARIANT_XOCHIP;
+    if (size < chip8_snapshot_size(xochip)) {
+        return false;
+    }
+    p += 7;
+    size_t memory_size = xochip ? MEMORY_SIZE + STACK_SIZE : CHIP8_MEMORY_SIZE;
+    int num_planes = xochip ? NUM_PLANES : 1;
+    const uint8_t *regs = p + memory_size + num_planes * STATE_PLANE_SIZE;
+    uint32_t program_size = chip8_get_u32(regs + NUM_REGS + 10);
+    if (xochip ? PROGRAM_OFFSET + program_size > MEMORY_SIZE : PROGRAM_OFFSET + program_size >= STACK_OFFSET) {
+        return false;
+    }
+    if (regs[NUM_REGS + 4] > (xochip ? STACK_DEPTH : CHIP8_STACK_DEPTH)) {
+        return false;
+    }
+    chip8_quirks_t quirks = regs[NUM_REGS + 32 + AUDIO_PATTERN_SIZE];
+    if (quirks > CHIP8_QUIRKS_XOCHIP) {
+        return false;
+    }
+    if (!chip8_set_xochip(ch, xochip)) {
+        return false;
+    }
+    memcpy(chip8_memory(ch), p, memory_size);
+    p += memory_size;
+    for (int plane = 0; plane < num_planes; plane++) {
+        for (int row = 0; row < SDISPLAY_HEIGHT; row++) {
+            for (int w = 0; w < DISPLAY_ROW_WORDS; w++) {
+                ch->display[plane][row][w] = chip8_get_u64(p);
+                p += 8;
+            }
         }
-    } else if (nibs[0] == 0xa) { // ANNN
-        ch->i_reg = nnn;
-    } else if (nibs[0] == 0xb) { // BNNN
-        ch->program_counter = nnn + ch->regs[0] - 2;
-    } else if (nibs[0] == 0xc) {  // CXNN
-        ch->regs[x] = rand() & nn;
-    } else if (nibs[0] == 0xd) { // DXYN
-        if ((ch->i_reg + (16 * 16)) >= MEMORY_SIZE) {
-            return false;
+    }
+    memcpy(ch->regs, p, NUM_REGS);
+    p += NUM_REGS;
+    ch->i_reg = chip8_get_u16(p);
+    ch->program_counter = chip8_get_u16(p + 2);
+    ch->stack_pointer = p[4];
+    ch->delay_timer = p[5];
+    ch->sound_timer = p[6];
+    ch->timer_counter = chip8_get_u16(p + 7);
+    ch->increment_ireg = (p[9] & STATE_FLAG_INCREMENT_IREG) != 0;
+    ch->schip_mode = (p[9] & STATE_FLAG_SCHIP_MODE) != 0;
+    ch->has_audio_pattern = (p[9] & STATE_FLAG_AUDIO_PATTERN) != 0;
+    ch->program_size = program_size;
+    ch->rng_state = chip8_get_u64(p + 14);
+    ch->cycle_count = chip8_get_u64(p + 22);
+    ch->planes = xochip ? p[30] & 0x3 : 0x1;
+    ch->pitch = p[31];
+    memcpy(ch->audio_pattern, p + 32, AUDIO_PATTERN_SIZE);
+    chip8_select_interpreter(ch, quirks);
+    chip8_update_timer_period(ch);
+    chip8_audio_restart(ch);
+    chip8_mark_all_dirty(ch);
+    return true;
+}
+
+bool chip8_start_recording(chip8_t *ch, FILE *fp, uint64_t hash_interval) {
+    chip8_stop_recording(ch);
+    struct chip8_recording *rec = malloc(sizeof(struct chip8_recording));
+    if (rec == NULL) {
+        return false;
+    }
+    uint8_t header[10 + STATE_MAX_SIZE];
+    size_t state_size = chip8_save_state(ch, header + 10, STATE_MAX_SIZE);
+    memcpy(header, RECORDING_MAGIC, 4);
+    chip8_put_u16(header + 4, RECORDING_VERSION);
+    chip8_put_u32(header + 6, (uint32_t)state_size);
+    if (fwrite(header, 10 + state_size, 1, fp) != 1) {
+        free(rec);
+        return false;
+    }
+    rec->fp = fp;
+    rec->failed = false;
+    rec->keys = 0;
+    rec->last_cycle = ch->cycle_count;
+    rec->hash_interval = hash_interval;
+    rec->next_hash_cycle = hash_interval > 0 ? ch->cycle_count + hash_interval : UINT64_MAX;
+    ch->recording = rec;
+    return true;
+}
+
+bool chip8_stop_recording(chip8_t *ch) {
+    struct chip8_recording *rec = ch->recording;
+    if (rec == NULL) {
+        return false;
+    }
+    uint8_t hash[8];
+    chip8_put_u64(hash, chip8_state_hash(ch));
+    chip8_record(ch, RECORD_END, hash, sizeof(hash));
+    bool ok = !rec->failed && fflush(rec->fp) == 0;
+    free(rec);
+    ch->recording = NULL;
+    return ok;
+}
+
+bool chip8_replay(const void *data, size_t size, chip8_jit_mode_t jit_mode, chip8_replay_result_t *out_result) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + size;
+    memset(out_result, 0, sizeof(chip8_replay_result_t));
+    if (size < 10 || memcmp(p, RECORDING_MAGIC, 4) != 0 || chip8_get_u16(p + 4) != RECORDING_VERSION) {
+        out_result->error = true;
+        return false;
+    }
+    uint32_t state_size = chip8_get_u32(p + 6);
+    p += 10;
+    chip8_t *ch = chip8_make();
+    if (ch == NULL || state_size > (size_t)(end - p) || !chip8_load_state(ch, p, state_size) || !chip8_set_jit(ch, jit_mode)) {
+        chip8_destroy(ch);
+        out_result->error = true;
+        return false;
+    }
+    p += state_size;
+    uint64_t start_cycle = ch->cycle_count;
+    uint64_t cycle = start_cycle;
+    chip8_keyboard_input_t input = {0};
+    while (true) {
+        size_t delta;
+        size_t varint_size = p < end ? chip8_get_varint(p + 1, end - p - 1, &delta) : 0;
+        if (varint_size == 0) {
+            out_result->error = true;
+            break;
         }
-        uint8_t *sprite = ch->memory + ch->i_reg;
-        chip8_draw_sprite(ch, sprite, n, ch->regs[x], ch->regs[y], &ch->regs[0xf]);
-    } else if (nibs[0] == 0xe && nibs[2] == 0x9 && nibs[3] == 0xe) { // EX9E
-        if (input->keys[ch->regs[x]]) {
-            ch->program_counter += 2;
+        uint8_t tag = *p;
+        p += 1 + varint_size;
+        size_t payload_size = tag == RECORD_INPUT ? 2 : 8;
+        if ((size_t)(end - p) < payload_size) {
+            out_result->error = true;
+            break;
         }
-    } else if (nibs[0] == 0xe && nibs[2] == 0xa && nibs[3] == 0x1) { // EXA1
-        if (!input->keys[ch->regs[x]]) {
-            ch->program_counter += 2;
+        uint64_t target = cycle + delta;
+        // failing instructions still take a cycle, like they did while recording
+        while (ch->cycle_count < target) {
+            uint64_t remaining = target - ch->cycle_count;
+            chip8_stop_reason_t reason;
+            chip8_run(ch, &input, remaining > 1000000 ? 1000000 : (int)remaining, 1 << CHIP8_STOP_ERROR, &reason);
         }
-    } else if (nibs[0] == 0xf && nibs[2] == 0x0 && nibs[3] == 0x7) { // FX07
-        ch->regs[x] = ch->delay_timer;
-    } else if (nibs[0] == 0xf && nibs[2] == 0x0 && nibs[3] == 0xa) { // FX0A
-        bool key_pressed = false;
-        for (int i = 0; i < sizeof(input->keys); i++) {
-            if (input->keys[i]) {
-                key_pressed = true;
+        cycle = target;
+        if (tag == RECORD_INPUT) {
+            uint16_t keys = chip8_get_u16(p);
+            for (int i = 0; i < 16; i++) {
+                input.keys[i] = (keys >> i) & 1;
+            }
+        } else if (tag == RECORD_HASH || tag == RECORD_END) {
+            out_result->checkpoints++;
+            if (chip8_state_hash(ch) != chip8_get_u64(p)) {
+                out_result->diverged_cycle = cycle;
                 break;
             }
+            out_result->last_good_cycle = cycle;
+            if (tag == RECORD_END) {
+                out_result->ok = true;
+                break;
+            }
+        } else {
+            out_result->error = true;
+            break;
         }
-        if (!key_pressed) {
-            return true;
-        }
-    } else if (nibs[0] == 0xf && nibs[2] == 0x1 && nibs[3] == 0x5) { // FX15
-        ch->delay_timer = ch->regs[x];
-    } else if (nibs[0] == 0xf && nibs[2] == 0x1 && nibs[3] == 0x8) { // FX18
-        ch->sound_timer = ch->regs[x];
-    } else if (nibs[0] == 0xf && nibs[2] == 0x1 && nibs[3] == 0xe) { // FX1E
-        ch->i_reg += ch->regs[x];
-    } else if (nibs[0] == 0xf && nibs[2] == 0x2 && nibs[3] == 0x9) { // FX29
-        ch->i_reg = ch->regs[x] * 5;
-    } else if (nibs[0] == 0xf && nibs[2] == 0x3 && nibs[3] == 0x0) { // FX30
-        ch->i_reg = SUPER_DIGITS_OFFSET + ch->regs[x] * 10;
-    } else if (nibs[0] == 0xf && nibs[2] == 0x3 && nibs[3] == 0x3) { // FX33
-        uint8_t val = ch->regs[x];
-        uint8_t bcd100 = val / 100;
-        uint8_t bcd10 = (val - (bcd100 * 100)) / 10;
-        uint8_t bcd1 = val - (bcd100 * 100) - (bcd10 * 10);
-        if ((ch->i_reg + 2) >= MEMORY_SIZE) {
-            return false;
-        }
-        ch->memory[ch->i_reg] = bcd100;
-        ch->memory[ch->i_reg + 1] = bcd10;
-        ch->memory[ch->i_reg + 2] = bcd1;
-    } else if (nibs[0] == 0xf && nibs[2] == 0x5 && nibs[3] == 0x5) { // FX55
-        for (int i = 0; i <= x; i++) {
-            ch->memory[ch->i_reg + i] = ch->regs[i];
-        }
-        if (ch->increment_ireg) {
-            ch->i_reg += x + 1;
-        }
-    } else if (nibs[0] == 0xf && nibs[2] == 0x6 && nibs[3] == 0x5) { // FX65
-        for (int i = 0; i <= x; i++) {
-            ch->regs[i] = ch->memory[ch->i_reg + i];
-        }
-        if (ch->increment_ireg) {
-            ch->i_reg += x + 1;
-        }
-    } else { // opcode not found
+        p += payload_size;
+    }
+    out_result->cycles = ch->cycle_count - start_cycle;
+    chip8_destroy(ch);
+    return out_result->ok;
+}
+
+chip8_rewind_t* chip8_rewind_make(size_t capacity) {
+    chip8_rewind_t *rw = malloc(sizeof(chip8_rewind_t));
+    if (rw == NULL) {
+        return NULL;
+    }
+    memset(rw, 0, sizeof(chip8_rewind_t));
+    rw->ring = malloc(capacity);
+    if (rw->ring == NULL) {
+        free(rw);
+        return NULL;
+    }
+    rw->capacity = capacity;
+    return rw;
+}
+
+void chip8_rewind_destroy(chip8_rewind_t *rw) {
+    if (rw == NULL) {
+        return;
+    }
+    free(rw->ring);
+    free(rw);
+}
+
+bool chip8_rewind_push(chip8_rewind_t *rw, chip8_t *ch) {
+    size_t state_size = chip8_save_state(ch, rw->current, sizeof(rw->current));
+    if (rw->has_latest && state_size != rw->state_size) {
+        // deltas only work between snapshots of one variant
+        rw->has_latest = false;
+        rw->start = 0;
+        rw->used = 0;
+        rw->num_deltas = 0;
+    }
+    if (!rw->has_latest) {
+        memcpy(rw->latest, rw->current, state_size);
+        rw->state_size = state_size;
+        rw->has_latest = true;
+        return true;
+    }
+    size_t delta_size = chip8_xor_rle_encode(rw->latest, rw->current, state_size, rw->delta);
+    size_t record_size = delta_size + 8;
+    if (record_size > rw->capacity) {
         return false;
     }
-    ch->program_counter += 2;
+    while (rw->capacity - rw->used < record_size) {
+        uint8_t len_bytes[4];
+        chip8_ring_read(rw, rw->start, len_bytes, 4);
+        size_t oldest_size = chip8_get_u32(len_bytes) + 8;
+        rw->start = (rw->start + oldest_size) % rw->capacity;
+        rw->used -= oldest_size;
+        rw->num_deltas--;
+    }
+    uint8_t len_bytes[4];
+    chip8_put_u32(len_bytes, (uint32_t)delta_size);
+    size_t end = rw->start + rw->used;
+    chip8_ring_write(rw, end, len_bytes, 4);
+    chip8_ring_write(rw, end + 4, rw->delta, delta_size);
+    chip8_ring_write(rw, end + 4 + delta_size, len_bytes, 4);
+    rw->used += record_size;
+    rw->num_deltas++;
+    memcpy(rw->latest, rw->current, state_size);
     return true;
 }
 
-bool chip8_should_beep(chip8_t *ch) {
-    return ch->sound_timer > 0;
+bool chip8_rewind_pop(chip8_rewind_t *rw, chip8_t *ch) {
+    if (!rw->has_latest) {
+        return false;
+    }
+    if (!chip8_load_state(ch, rw->latest, rw->state_size)) {
+        return false;
+    }
+    if (rw->num_deltas == 0) {
+        rw->has_latest = false;
+        return true;
+    }
+    uint8_t len_bytes[4];
+    size_t end = rw->start + rw->used;
+    chip8_ring_read(rw, end - 4, len_bytes, 4);
+    size_t delta_size = chip8_get_u32(len_bytes);
+    chip8_ring_read(rw, end - 4 - delta_size, rw->delta, delta_size);
+    chip8_xor_rle_apply(rw->latest, rw->state_size, rw->delta, delta_size);
+    rw->used -= delta_size + 8;
+    rw->num_deltas--;
+    return true;
 }
 
-int chip8_get_width(chip8_t *ch) {
-    return ch->schip_mode ? SDISPLAY_WIDTH : DISPLAY_WIDTH;
+size_t chip8_rewind_count(chip8_rewind_t *rw) {
+    return rw->has_latest ? rw->num_deltas + 1 : 0;
 }
 
-int chip8_get_height(chip8_t *ch) {
-    return ch->schip_mode ? SDISPLAY_HEIGHT : DISPLAY_HEIGHT;
+chip8_audio_ring_t* chip8_audio_ring_make(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    chip8_audio_ring_t *ring = malloc(sizeof(chip8_audio_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->samples = malloc(size * sizeof(int16_t));
+    if (ring->samples == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->overrun_samples, 0);
+    atomic_init(&ring->underrun_samples, 0);
+    return ring;
 }
 
-bool chip8_get_pixel(chip8_t *ch, int x, int y) {
-    int width = chip8_get_width(ch);
-    int height = chip8_get_height(ch);
-    int ix = ((y % height) * width) + (x % width);
-    return chip8_get_bit(ch->display, ix);
+void chip8_audio_ring_destroy(chip8_audio_ring_t *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    free(ring->samples);
+    free(ring);
 }
 
-int chip8_is_super(chip8_t *ch) {
-    return ch->schip_mode;
+size_t chip8_audio_ring_read(chip8_audio_ring_t *ring, int16_t *out, size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t available = head - tail;
+    size_t n = count < available ? count : available;
+    size_t start = tail & ring->mask;
+    size_t first = ring->mask + 1 - start;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(out, ring->samples + start, first * sizeof(int16_t));
+    memcpy(out + first, ring->samples, (n - first) * sizeof(int16_t));
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    if (n < count) {
+        memset(out + n, 0, (count - n) * sizeof(int16_t));
+        atomic_fetch_add_explicit(&ring->underrun_samples, count - n, memory_order_relaxed);
+    }
+    return n;
 }
 
-// Internal
-static void chip8_draw_sprite(chip8_t *ch, uint8_t *sprite, int n, int x, int y, uint8_t *vf) {
-    int cols = 8;
-    int rows = n;
-    if (n == 0) {
-        cols = 16;
-        rows = 16;
+size_t chip8_audio_ring_buffered(chip8_audio_ring_t *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head - tail;
+}
+
+void chip8_audio_ring_get_stats(chip8_audio_ring_t *ring, chip8_audio_stats_t *out_stats) {
+    out_stats->buffered_samples = chip8_audio_ring_buffered(ring);
+    out_stats->underrun_samples = atomic_load_explicit(&ring->underrun_samples, memory_order_relaxed);
+    out_stats->overrun_samples = atomic_load_explicit(&ring->overrun_samples, memory_order_relaxed);
+}
+
+bool chip8_set_audio(chip8_t *ch, chip8_audio_ring_t *ring, int sample_rate, int tone_hz) {
+    if (ring != NULL && (sample_rate <= 0 || tone_hz <= 0 || tone_hz > sample_rate / 2)) {
+        return false;
     }
-    *vf = 0;
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            int pixel_ix = (row * cols) + col;
-            bool display_pixel = chip8_get_pixel(ch, x + col, y + row);
-            bool sprite_pixel = chip8_get_bit(sprite, pixel_ix);
-            if (display_pixel && sprite_pixel) {
-                *vf = 1;
-            }
-            chip8_set_pixel(ch, x + col, y + row, display_pixel ^ sprite_pixel);
+    if (ch->audio.ring != NULL) {
+        chip8_audio_flush(ch, ch->cycle_count);
+    }
+    memset(&ch->audio, 0, sizeof(ch->audio));
+    ch->audio.ring = ring;
+    ch->audio.sample_rate = sample_rate;
+    ch->audio.tone_hz = tone_hz;
+    chip8_audio_restart(ch);
+    return true;
+}
+
+bool chip8_get_stats(chip8_t *ch, chip8_stats_t *out_stats) {
+    memset(out_stats, 0, sizeof(chip8_stats_t));
+#ifdef CHIP8_PROFILE
+    chip8_profile_t *p = &ch->profile;
+    out_stats->instructions = p->instructions;
+    memcpy(out_stats->op_counts, p->op_counts, sizeof(p->op_counts));
+    out_stats->max_stack_depth = p->max_stack_depth;
+    out_stats->sprites_drawn = p->sprites_drawn;
+    out_stats->pixels_drawn = p->pixels_drawn;
+    out_stats->collisions = p->collisions;
+    // insertion into a sorted top list, hottest first
+    int num_hot = 0;
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        uint64_t count = p->pc_counts[addr];
+        if (count == 0 || (num_hot == CHIP8_STATS_HOT_PCS && count <= out_stats->hot_pc_counts[num_hot - 1])) {
+            continue;
         }
+        int pos = num_hot < CHIP8_STATS_HOT_PCS ? num_hot++ : num_hot - 1;
+        while (pos > 0 && out_stats->hot_pc_counts[pos - 1] < count) {
+            out_stats->hot_pcs[pos] = out_stats->hot_pcs[pos - 1];
+            out_stats->hot_pc_counts[pos] = out_stats->hot_pc_counts[pos - 1];
+            pos--;
+        }
+        out_stats->hot_pcs[pos] = addr;
+        out_stats->hot_pc_counts[pos] = count;
+    }
+    out_stats->num_hot_pcs = num_hot;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void chip8_reset_stats(chip8_t *ch) {
+#ifdef CHIP8_PROFILE
+    memset(&ch->profile, 0, sizeof(ch->profile));
+    ch->profile.max_stack_depth = ch->stack_pointer;
+#endif
+}
+
+bool chip8_start_trace(chip8_t *ch, FILE *fp) {
+#ifdef CHIP8_TRACE
+    chip8_stop_trace(ch);
+    struct chip8_trace *trace = malloc(sizeof(struct chip8_trace));
+    if (trace == NULL) {
+        return false;
+    }
+    uint8_t header[8];
+    memcpy(header, TRACE_MAGIC, 4);
+    chip8_put_u16(header + 4, TRACE_VERSION);
+    header[6] = ch->xochip ? CHIP8_VARIANT_XOCHIP : CHIP8_VARIANT_SCHIP;
+    header[7] = chip8_interpreters[ch->interpreter].quirks;
+    if (fp != NULL && fwrite(header, sizeof(header), 1, fp) != 1) {
+        free(trace);
+        return false;
     }
+    trace->fp = fp;
+    trace->failed = false;
+    trace->count = 0;
+    ch->trace = trace;
+    chip8_select_interpreter(ch, chip8_interpreters[ch->interpreter].quirks);
+    return true;
+#else
+    return false;
+#endif
 }
 
-static bool chip8_get_bit(uint8_t *bytes, int ix) {
-    return (bytes[ix / 8] >> (7 - (ix % 8))) & 1;
+size_t chip8_get_trace(chip8_t *ch, chip8_trace_record_t *out_records, size_t max_records) {
+#ifdef CHIP8_TRACE
+    struct chip8_trace *trace = ch->trace;
+    if (trace == NULL) {
+        return 0;
+    }
+    size_t count = trace->count < CHIP8_TRACE_RING_SIZE ? trace->count : CHIP8_TRACE_RING_SIZE;
+    if (count > max_records) {
+        count = max_records;
+    }
+    for (size_t i = 0; i < count; i++) {
+        out_records[i] = trace->records[(trace->count - count + i) % CHIP8_TRACE_RING_SIZE];
+    }
+    return count;
+#else
+    return 0;
+#endif
 }
 
-static void chip8_set_bit(uint8_t *bytes, int ix, bool val) {
-    unsigned int byte_ix = ix / 8;
-    unsigned int bit_ix = 7 - (ix % 8);
-    uint8_t byte = bytes[byte_ix];
-    byte = (byte & ~(1 << bit_ix)) | (-(unsigned int)val & (1 << bit_ix));
-    bytes[byte_ix]= byte;
+bool chip8_stop_trace(chip8_t *ch) {
+#ifdef CHIP8_TRACE
+    struct chip8_trace *trace = ch->trace;
+    if (trace == NULL) {
+        return false;
+    }
+    bool ok = true;
+    if (trace->fp != NULL) {
+        size_t pending = trace->count % CHIP8_TRACE_RING_SIZE;
+        chip8_trace_write(ch, 0, pending);
+        ok = !trace->failed && fflush(trace->fp) == 0;
+    }
+    free(trace);
+    ch->trace = NULL;
+    chip8_select_interpreter(ch, chip8_interpreters[ch->interpreter].quirks);
+    return ok;
+#else
+    return false;
+#endif
 }
 
-static void chip8_set_pixel(chip8_t *ch, int x, int y, bool val) {
-    int width = chip8_get_width(ch);
-    int height = chip8_get_height(ch);
-    int ix = ((y % height) * width) + (x % width);
-    chip8_set_bit(ch->display, ix, val);
+const char* chip8_op_class_name(int op_class) {
+    if (op_class < 0 || op_class >= CHIP8_NUM_OP_CLASSES) {
+        return NULL;
+    }
+    return op_class_names[op_class];
+}
+
+size_t chip8_disassemble(const uint8_t *code, size_t size, char *buf, size_t buf_size) {
+    if (size < 2 || buf_size == 0) {
+        return 0;
+    }
+    uint16_t opcode = code[1] | (code[0] << 8);
+    uint8_t op = chip8_decode(opcode);
+    size_t length = 2;
+    uint16_t next = 0;
+    if (op == CHIP8_OP_F000) {
+        if (size < 4) {
+            return 0;
+        }
+        length = 4;
+        next = code[3] | (code[2] << 8);
+    }
+    static const char hex[] = "0123456789ABCDEF";
+    const char *fmt = op_mnemonics[op];
+    size_t len = 0;
+    for (; *fmt != '\0' && len + 4 < buf_size; fmt++) {
+        if (*fmt != '%') {
+            buf[len++] = *fmt;
+            continue;
+        }
+        fmt++;
+        uint16_t value = opcode;
+        int digits = 4;
+        switch (*fmt) {
+            case 'x': value = opcode >> 8; digits = 1; break;
+            case 'y': value = opcode >> 4; digits = 1; break;
+            case 'n': digits = 1; break;
+            case 'b': digits = 2; break;
+            case 'a': digits = 3; break;
+            case 'l': value = next; break;
+        }
+        for (int d = digits - 1; d >= 0; d--) {
+            buf[len++] = hex[(value >> (d * 4)) & 0xf];
+        }
+    }
+    buf[len] = '\0';
+    return length;
+}
+
+// The sidecar is text, one record per line: the ANALYSIS_HEADER, then
+// "program <variant> <size> <hash>" and "clean <0|1>" before any
+// "block <start> <end> <successors...>" lines. Other records are for
+// people and tools and are ignored here.
+bool chip8_load_analysis(chip8_t *ch, const char *text, size_t size) {
+    bool matched = false;
+    bool clean = false;
+    size_t pos = 0;
+    for (int line_index = 0; pos < size; line_index++) {
+        char line[128];
+        const char *eol = memchr(text + pos, '\n', size - pos);
+        size_t line_len = eol != NULL ? (size_t)(eol - (text + pos)) : size - pos;
+        size_t copy_len = line_len < sizeof(line) - 1 ? line_len : sizeof(line) - 1;
+        memcpy(line, text + pos, copy_len);
+        line[copy_len] = '\0';
+        pos += line_len + 1;
+
+        unsigned variant, start, end;
+        unsigned long program_size;
+        unsigned long long hash;
+        if (line_index == 0) {
+            if (strcmp(line, ANALYSIS_HEADER) != 0) {
+                return false;
+            }
+        } else if (sscanf(line, "program %u %lu %llx", &variant, &program_size, &hash) == 3) {
+            bool xochip = variant == CHIP8_VARIANT_XOCHIP;
+            if (xochip != ch->xochip || program_size != ch->program_size ||
+                hash != chip8_fnv1a(chip8_memory(ch) + PROGRAM_OFFSET, ch->program_size)) {
+                return false;
+            }
+            matched = true;
+        } else if (sscanf(line, "clean %u", &start) == 1) {
+            clean = start == 1;
+        } else if (sscanf(line, "block %x %x", &start, &end) == 2) {
+            if (!matched) {
+                return false;
+            }
+            uint16_t addr = start;
+            while (addr < end && chip8_in_program(ch, addr)) {
+                addr += chip8_fetch(ch, addr)->op == CHIP8_OP_F000 ? 4 : 2;
+            }
+        }
+    }
+    ch->code_verified = matched && clean;
+    return matched;
+}
+
+bool chip8_should_beep(chip8_t *ch) {
+    return ch->sound_timer > 0;
+}
+
+int chip8_get_width(chip8_t *ch) {
+    return ch->schip_mode ? SDISPLAY_WIDTH : DISPLAY_WIDTH;
+}
+
+int chip8_get_height(chip8_t *ch) {
+    return ch->schip_mode ? SDISPLAY_HEIGHT : DISPLAY_HEIGHT;
+}
+
+bool chip8_get_pixel(chip8_t *ch, int x, int y) {
+    int width = chip8_get_width(ch);
+    int height = chip8_get_height(ch);
+    x %= width;
+    y %= height;
+    return ((ch->display[0][y][x / 64] | ch->display[1][y][x / 64]) >> (63 - (x % 64))) & 1;
+}
+
+int chip8_is_super(chip8_t *ch) {
+    return ch->schip_mode;
+}
+
+uint32_t chip8_get_frame_generation(chip8_t *ch) {
+    return ch->frame_generation;
+}
+
+bool chip8_get_dirty_region(chip8_t *ch, chip8_dirty_region_t *out_region) {
+    out_region->rows = ch->dirty_rows;
+    out_region->columns = ch->dirty_columns;
+    return ch->dirty_rows != 0;
+}
+
+bool chip8_get_dirty_rect(chip8_t *ch, int *out_x, int *out_y, int *out_width, int *out_height) {
+    if (ch->dirty_rows == 0) {
+        return false;
+    }
+    int first_row = 0;
+    while (!((ch->dirty_rows >> first_row) & 1)) {
+        first_row++;
+    }
+    int last_row = 63;
+    while (!((ch->dirty_rows >> last_row) & 1)) {
+        last_row--;
+    }
+    int first_col = 0;
+    while (first_col < 15 && !((ch->dirty_columns >> first_col) & 1)) {
+        first_col++;
+    }
+    int last_col = 15;
+    while (last_col > first_col && !((ch->dirty_columns >> last_col) & 1)) {
+        last_col--;
+    }
+    *out_x = first_col * 8;
+    *out_y = first_row;
+    *out_width = (last_col - first_col + 1) * 8;
+    *out_height = last_row - first_row + 1;
+    return true;
+}
+
+void chip8_acknowledge_dirty(chip8_t *ch) {
+    ch->dirty_rows = 0;
+    ch->dirty_columns = 0;
+}
+
+const uint64_t* chip8_get_framebuffer(chip8_t *ch, size_t *out_row_stride) {
+    *out_row_stride = DISPLAY_ROW_WORDS;
+    return ch->display[0][0];
+}
+
+int chip8_get_num_planes(chip8_t *ch) {
+    return ch->xochip ? NUM_PLANES : 1;
+}
+
+const uint64_t* chip8_get_plane(chip8_t *ch, int plane, size_t *out_row_stride) {
+    if (plane < 0 || plane >= chip8_get_num_planes(ch)) {
+        return NULL;
+    }
+    *out_row_stride = DISPLAY_ROW_WORDS;
+    return ch->display[plane][0];
+}
+
+void chip8_get_frame(chip8_t *ch, uint8_t *out_frame) {
+    const uint64_t *words = ch->display[0][0];
+    for (size_t i = 0; i < CHIP8_FRAME_SIZE / 8; i++) {
+        for (int b = 0; b < 8; b++) {
+            *out_frame++ = (uint8_t)(words[i] >> (56 - b * 8));
+        }
+    }
+}
+
+size_t chip8_encode_frame_delta(const uint8_t *prev_frame, const uint8_t *frame, uint8_t *out_delta) {
+    return chip8_xor_rle_encode(prev_frame, frame, CHIP8_FRAME_SIZE, out_delta);
+}
+
+bool chip8_apply_frame_delta(uint8_t *frame, const uint8_t *delta, size_t size) {
+    return chip8_xor_rle_apply(frame, CHIP8_FRAME_SIZE, delta, size);
+}
+
+void chip8_render_rgba(chip8_t *ch, uint32_t *pixels, size_t pitch, int scale, uint32_t on_color, uint32_t off_color) {
+    uint32_t palette[4] = {off_color, on_color, on_color, on_color};
+    chip8_render(ch, pixels, pitch, scale, palette, sizeof(uint32_t), 0, 0, chip8_get_width(ch), chip8_get_height(ch));
+}
+
+void chip8_render_8bit(chip8_t *ch, uint8_t *pixels, size_t pitch, int scale, uint8_t on_value, uint8_t off_value) {
+    uint8_t palette[4] = {off_value, on_value, on_value, on_value};
+    chip8_render(ch, pixels, pitch, scale, palette, sizeof(uint8_t), 0, 0, chip8_get_width(ch), chip8_get_height(ch));
+}
+
+void chip8_render_planes_rgba(chip8_t *ch, uint32_t *pixels, size_t pitch, int scale, const uint32_t palette[4]) {
+    chip8_render(ch, pixels, pitch, scale, palette, sizeof(uint32_t), 0, 0, chip8_get_width(ch), chip8_get_height(ch));
+}
+
+void chip8_render_planes_8bit(chip8_t *ch, uint8_t *pixels, size_t pitch, int scale, const uint8_t palette[4]) {
+    chip8_render(ch, pixels, pitch, scale, palette, sizeof(uint8_t), 0, 0, chip8_get_width(ch), chip8_get_height(ch));
+}
+
+void chip8_render_planes_rect_rgba(chip8_t *ch, uint32_t *pixels, size_t pitch, int scale, const uint32_t palette[4], int x, int y, int width, int height) {
+    chip8_render(ch, pixels, pitch, scale, palette, sizeof(uint32_t), x, y, width, height);
+}
+
+void chip8_render_planes_rect_8bit(chip8_t *ch, uint8_t *pixels, size_t pitch, int scale, const uint8_t palette[4], int x, int y, int width, int height) {
+    chip8_render(ch, pixels, pitch, scale, palette, sizeof(uint8_t), x, y, width, height);
+}
+
+chip8_batch_t* chip8_batch_make(int num_lanes) {
+    if (num_lanes < 1) {
+        return NULL;
+    }
+    chip8_batch_t *b = malloc(sizeof(chip8_batch_t));
+    if (b == NULL) {
+        return NULL;
+    }
+    memset(b, 0, sizeof(chip8_batch_t));
+    b->num_lanes = num_lanes;
+    b->stride = (num_lanes + CHIP8_VEC_WIDTH - 1) / CHIP8_VEC_WIDTH * CHIP8_VEC_WIDTH;
+    size_t stride = b->stride;
+    b->arena = calloc(stride, NUM_REGS + 11 + sizeof(bool));
+    b->lanes = calloc(num_lanes, sizeof(chip8_t*));
+    if (b->arena == NULL || b->lanes == NULL) {
+        chip8_batch_destroy(b);
+        return NULL;
+    }
+    b->regs = b->arena;
+    b->pc_lo = b->regs + NUM_REGS * stride;
+    b->pc_hi = b->pc_lo + stride;
+    b->i_lo = b->pc_hi + stride;
+    b->i_hi = b->i_lo + stride;
+    b->delay_timer = b->i_hi + stride;
+    b->sound_timer = b->delay_timer + stride;
+    b->timer_counter = b->sound_timer + stride;
+    b->timer_period = b->timer_counter + stride;
+    b->active = b->timer_period + stride;
+    b->pending = b->active + stride;
+    b->mask = b->pending + stride;
+    b->touched = (bool*)(b->mask + stride);
+    for (int lane = 0; lane < num_lanes; lane++) {
+        b->lanes[lane] = chip8_make();
+        if (b->lanes[lane] == NULL) {
+            chip8_batch_destroy(b);
+            return NULL;
+        }
+        chip8_batch_gather(b, lane);
+    }
+    return b;
+}
+
+void chip8_batch_destroy(chip8_batch_t *b) {
+    if (b == NULL) {
+        return;
+    }
+    if (b->lanes != NULL) {
+        for (int lane = 0; lane < b->num_lanes; lane++) {
+            if (b->lanes[lane] != NULL) {
+                chip8_destroy(b->lanes[lane]);
+            }
+        }
+    }
+    free(b->lanes);
+    free(b->arena);
+    free(b);
+}
+
+bool chip8_batch_load_program(chip8_batch_t *b, unsigned char *program, size_t size) {
+    chip8_batch_sync_touched(b);
+    for (int lane = 0; lane < b->num_lanes; lane++) {
+        chip8_batch_scatter(b, lane);
+        chip8_set_variant(b->lanes[lane], CHIP8_VARIANT_SCHIP);
+        chip8_set_quirks(b->lanes[lane], CHIP8_QUIRKS_DEFAULT);
+        if (!chip8_load_program(b->lanes[lane], program, size)) {
+            return false;
+        }
+        chip8_batch_gather(b, lane);
+        b->active[lane] = 0xff;
+    }
+    memcpy(b->image, b->lanes[0]->memory, CHIP8_MEMORY_SIZE);
+    memset(b->modified, 0, sizeof(b->modified));
+    b->program_size = size;
+    b->sizes_differ = false;
+    return true;
+}
+
+int chip8_batch_run_cycles(chip8_batch_t *b, const chip8_keyboard_input_t *inputs, int num_cycles) {
+    chip8_batch_sync_touched(b);
+    for (int cycle = 0; cycle < num_cycles; cycle++) {
+        b->cycle = cycle;
+        chip8_batch_tick_timers(b);
+        memcpy(b->pending, b->active, b->stride);
+        int lane = 0;
+        while ((lane = chip8_batch_next_pending(b, lane)) < b->num_lanes) {
+            chip8_batch_step_group(b, lane, inputs);
+        }
+    }
+    int num_running = 0;
+    for (int lane = 0; lane < b->num_lanes; lane++) {
+        if (b->active[lane]) {
+            b->lanes[lane]->cycle_count += num_cycles;
+            num_running++;
+        }
+    }
+    return num_running;
+}
+
+int chip8_batch_get_num_lanes(chip8_batch_t *b) {
+    return b->num_lanes;
+}
+
+bool chip8_batch_lane_failed(chip8_batch_t *b, int lane) {
+    return !b->active[lane];
+}
+
+chip8_t* chip8_batch_get_lane(chip8_batch_t *b, int lane) {
+    if (!b->touched[lane]) {
+        chip8_batch_scatter(b, lane);
+        b->touched[lane] = true;
+        b->any_touched = true;
+    }
+    return b->lanes[lane];
+}
+
+void chip8_batch_get_framebuffers(chip8_batch_t *b, uint64_t *out) {
+    for (int lane = 0; lane < b->num_lanes; lane++) {
+        memcpy(out, b->lanes[lane]->display[0], sizeof(b->lanes[lane]->display[0]));
+        out += SDISPLAY_HEIGHT * DISPLAY_ROW_WORDS;
+    }
+}
+
+size_t chip8_batch_save_states(chip8_batch_t *b, void *buf, size_t size) {
+    size_t state_size = chip8_snapshot_size(false);
+    size_t total = state_size * b->num_lanes;
+    if (buf == NULL) {
+        return total;
+    }
+    if (size < total) {
+        return 0;
+    }
+    uint8_t *p = buf;
+    for (int lane = 0; lane < b->num_lanes; lane++) {
+        if (!b->touched[lane]) {
+            chip8_batch_scatter(b, lane);
+        }
+        p += chip8_save_state(b->lanes[lane], p, state_size);
+    }
+    return total;
+}
+
+// Internal
+static void chip8_draw_sprite(chip8_t *ch, uint8_t *sprite, int n, int x, int y, bool clip, uint8_t *vf) {
+    int cols = 8;
+    int rows = n;
+    if (n == 0) {
+        cols = 16;
+        rows = 16;
+    }
+    uint64_t rows_changed = 0;
+    uint16_t columns_changed = 0;
+    bool collision = false;
+    // with both XO-CHIP planes selected, plane 1's rows follow plane 0's
+    uint64_t (*display)[DISPLAY_ROW_WORDS] = ch->display[0];
+    for (uint8_t planes = ch->planes; planes != 0; planes >>= 1) {
+        if (planes & 1) {
+            collision |= chip8_draw_plane(ch, display, sprite, rows, cols, x, y, clip, &rows_changed, &columns_changed);
+            sprite += rows * cols / 8;
+        }
+        display += SDISPLAY_HEIGHT;
+    }
+    *vf = collision ? 1 : 0;
+    chip8_mark_dirty(ch, rows_changed, columns_changed);
+}
+
+// XORs the sprite into one plane, returns true if it erased a pixel. The
+// position wraps, the parts past the edges wrap too unless clip is set.
+// Profiling builds count the pixels that end up on the plane.
+static bool chip8_draw_plane(chip8_t *ch, uint64_t (*display)[DISPLAY_ROW_WORDS], const uint8_t *sprite, int rows, int cols, int x, int y, bool clip, uint64_t *rows_changed, uint16_t *columns_changed) {
+    int height = chip8_get_height(ch);
+    bool collision = false;
+    if (clip) {
+        y %= height;
+        rows = rows < height - y ? rows : height - y;
+    }
+    if (!ch->schip_mode) {
+        int shift = x % DISPLAY_WIDTH;
+        for (int row = 0; row < rows; row++) {
+            uint64_t bits = cols == 16 ? (sprite[row * 2] << 8) | sprite[row * 2 + 1] : sprite[row];
+            uint64_t mask = clip ? (bits << (64 - cols)) >> shift : chip8_rotr64(bits << (64 - cols), shift);
+            uint64_t *word = &display[(y + row) % height][0];
+            if (*word & mask) {
+                collision = true;
+            }
+            *word ^= mask;
+            if (mask) {
+                *rows_changed |= 1ull << ((y + row) % height);
+                *columns_changed |= chip8_word_columns(mask);
+            }
+#ifdef CHIP8_PROFILE
+            ch->profile.pixels_drawn += chip8_popcount64(mask);
+#endif
+        }
+        return collision;
+    }
+    // 128 pixel rows are rotated as a hi:lo pair of words
+    int shift = x % SDISPLAY_WIDTH;
+    for (int row = 0; row < rows; row++) {
+        uint64_t bits = cols == 16 ? (sprite[row * 2] << 8) | sprite[row * 2 + 1] : sprite[row];
+        uint64_t hi = bits << (64 - cols);
+        uint64_t lo = 0;
+        int rot = shift;
+        if (rot >= 64) {
+            lo = hi;
+            hi = 0;
+            rot -= 64;
+        }
+        if (rot > 0) {
+            uint64_t new_hi = (hi >> rot) | (clip ? 0 : lo << (64 - rot));
+            lo = (lo >> rot) | (hi << (64 - rot));
+            hi = new_hi;
+        }
+        uint64_t *words = display[(y + row) % height];
+        if ((words[0] & hi) || (words[1] & lo)) {
+            collision = true;
+        }
+        words[0] ^= hi;
+        words[1] ^= lo;
+        if (hi | lo) {
+            *rows_changed |= 1ull << ((y + row) % height);
+            *columns_changed |= chip8_word_columns(hi) | (chip8_word_columns(lo) << 8);
+        }
+#ifdef CHIP8_PROFILE
+        ch->profile.pixels_drawn += chip8_popcount64(hi) + chip8_popcount64(lo);
+#endif
+    }
+    return collision;
+}
+
+// Bit c of the result is set if pixels c * 8 to c * 8 + 7 of the word are non-zero
+static uint8_t chip8_word_columns(uint64_t word) {
+    word |= word >> 4;
+    word |= word >> 2;
+    word |= word >> 1;
+    word &= 0x0101010101010101ull;
+    return (word * 0x8040201008040201ull) >> 56;
+}
+
+#ifdef CHIP8_PROFILE
+static int chip8_popcount64(uint64_t word) {
+    word -= (word >> 1) & 0x5555555555555555ull;
+    word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (word * 0x0101010101010101ull) >> 56;
+}
+#endif
+
+static void chip8_mark_dirty(chip8_t *ch, uint64_t rows, uint16_t columns) {
+    if (rows == 0) {
+        return;
+    }
+    ch->fork_rows |= rows;
+    ch->dirty_rows |= rows;
+    ch->dirty_columns |= columns;
+    ch->frame_generation++;
+}
+
+static void chip8_mark_all_dirty(chip8_t *ch) {
+    // rows past the lores height are cleared and scrolled too
+    ch->fork_rows = ~0ull;
+    int height = chip8_get_height(ch);
+    int width = chip8_get_width(ch);
+    uint64_t rows = height == 64 ? ~0ull : (1ull << height) - 1;
+    uint16_t columns = (1u << (width / 8)) - 1;
+    chip8_mark_dirty(ch, rows, columns);
+}
+
+// Expands the display a nibble at a time from a table of pre-scaled 4 pixel
+// runs, then duplicates each finished line scale - 1 times. palette holds
+// pixel_size byte colours indexed by the pixel's plane bits. Only the rect
+// at x, y is drawn, at its scaled position in pixels.
+static void chip8_render(chip8_t *ch, void *pixels, size_t pitch, int scale, const void *palette, size_t pixel_size, int x, int y, int width, int height) {
+    if (!chip8_clip_rect(ch, &x, &y, &width, &height)) {
+        return;
+    }
+    if (ch->xochip) {
+        chip8_render_planes(ch, pixels, pitch, scale, palette, pixel_size, x, y, width, height);
+        return;
+    }
+    uint8_t lut[16][4 * RENDER_MAX_LUT_SCALE * sizeof(uint32_t)];
+    const uint8_t *off = palette;
+    const uint8_t *on = off + pixel_size;
+    size_t run_size = scale * pixel_size;
+    size_t nibble_size = 4 * run_size;
+    size_t line_size = width * run_size;
+    bool use_lut = scale <= RENDER_MAX_LUT_SCALE && x % 4 == 0 && width % 4 == 0;
+    if (use_lut) {
+        for (int nibble = 0; nibble < 16; nibble++) {
+            for (int px = 0; px < 4 * scale; px++) {
+                const void *color = (nibble >> (3 - px / scale)) & 1 ? on : off;
+                memcpy(lut[nibble] + px * pixel_size, color, pixel_size);
+            }
+        }
+    }
+    for (int row = y; row < y + height; row++) {
+        uint8_t *line = (uint8_t*)pixels + (size_t)row * scale * pitch + x * run_size;
+        uint8_t *dst = line;
+        for (int px = x; px < x + width;) {
+            uint64_t word = ch->display[0][row][px / 64];
+            int word_end = (px / 64 + 1) * 64 < x + width ? (px / 64 + 1) * 64 : x + width;
+            if (use_lut) {
+                for (; px < word_end; px += 4) {
+                    memcpy(dst, lut[(word >> (60 - px % 64)) & 0xf], nibble_size);
+                    dst += nibble_size;
+                }
+                continue;
+            }
+            for (; px < word_end; px++) {
+                const void *color = (word >> (63 - px % 64)) & 1 ? on : off;
+                for (int i = 0; i < scale; i++) {
+                    memcpy(dst, color, pixel_size);
+                    dst += pixel_size;
+                }
+            }
+        }
+        for (int i = 1; i < scale; i++) {
+            memcpy(line + i * pitch, line, line_size);
+        }
+    }
+}
+
+// Same as chip8_render for two planes, with a table of 2 pixel runs indexed
+// by the pair's plane 0 bits and plane 1 bits.
+static void chip8_render_planes(chip8_t *ch, void *pixels, size_t pitch, int scale, const void *palette, size_t pixel_size, int x, int y, int width, int height) {
+    uint8_t lut[16][2 * RENDER_MAX_LUT_SCALE * sizeof(uint32_t)];
+    const uint8_t *colors = palette;
+    size_t run_size = scale * pixel_size;
+    size_t pair_size = 2 * run_size;
+    size_t line_size = width * run_size;
+    bool use_lut = scale <= RENDER_MAX_LUT_SCALE && x % 2 == 0 && width % 2 == 0;
+    if (use_lut) {
+        for (int pair = 0; pair < 16; pair++) {
+            for (int px = 0; px < 2 * scale; px++) {
+                int bit = 1 - px / scale;
+                int color = ((pair >> bit) & 1) | (((pair >> (bit + 2)) & 1) << 1);
+                memcpy(lut[pair] + px * pixel_size, colors + color * pixel_size, pixel_size);
+            }
+        }
+    }
+    for (int row = y; row < y + height; row++) {
+        uint8_t *line = (uint8_t*)pixels + (size_t)row * scale * pitch + x * run_size;
+        uint8_t *dst = line;
+        for (int px = x; px < x + width;) {
+            uint64_t p0 = ch->display[0][row][px / 64];
+            uint64_t p1 = ch->display[1][row][px / 64];
+            int word_end = (px / 64 + 1) * 64 < x + width ? (px / 64 + 1) * 64 : x + width;
+            if (use_lut) {
+                for (; px < word_end; px += 2) {
+                    int shift = 62 - px % 64;
+                    memcpy(dst, lut[((p0 >> shift) & 0x3) | (((p1 >> shift) & 0x3) << 2)], pair_size);
+                    dst += pair_size;
+                }
+                continue;
+            }
+            for (; px < word_end; px++) {
+                int bit = 63 - px % 64;
+                int color = ((p0 >> bit) & 1) | (((p1 >> bit) & 1) << 1);
+                for (int i = 0; i < scale; i++) {
+                    memcpy(dst, colors + color * pixel_size, pixel_size);
+                    dst += pixel_size;
+                }
+            }
+        }
+        for (int i = 1; i < scale; i++) {
+            memcpy(line + i * pitch, line, line_size);
+        }
+    }
+}
+
+// Cuts the rect down to the display, false if nothing is left
+static bool chip8_clip_rect(chip8_t *ch, int *x, int *y, int *width, int *height) {
+    int display_width = chip8_get_width(ch);
+    int display_height = chip8_get_height(ch);
+    if (*x < 0) {
+        *width += *x;
+        *x = 0;
+    }
+    if (*y < 0) {
+        *height += *y;
+        *y = 0;
+    }
+    if (*x + *width > display_width) {
+        *width = display_width - *x;
+    }
+    if (*y + *height > display_height) {
+        *height = display_height - *y;
+    }
+    return *width > 0 && *height > 0;
+}
+
+static uint64_t chip8_rotr64(uint64_t v, int n) {
+    return n == 0 ? v : (v >> n) | (v << (64 - n));
+}
+
+// Scrolls act on the selected planes only
+static void chip8_scroll_down(chip8_t *ch, int n) {
+    int height = chip8_get_height(ch);
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (!(ch->planes & (1 << plane))) {
+            continue;
+        }
+        uint64_t (*display)[DISPLAY_ROW_WORDS] = ch->display[plane];
+        memmove(display[n], display[0], (height - n) * sizeof(display[0]));
+        memset(display[0], 0, n * sizeof(display[0]));
+    }
+}
+
+static void chip8_scroll_up(chip8_t *ch, int n) {
+    int height = chip8_get_height(ch);
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (!(ch->planes & (1 << plane))) {
+            continue;
+        }
+        uint64_t (*display)[DISPLAY_ROW_WORDS] = ch->display[plane];
+        memmove(display[0], display[n], (height - n) * sizeof(display[0]));
+        memset(display[height - n], 0, n * sizeof(display[0]));
+    }
+}
+
+static void chip8_scroll_right(chip8_t *ch) {
+    int height = chip8_get_height(ch);
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (!(ch->planes & (1 << plane))) {
+            continue;
+        }
+        for (int row = 0; row < height; row++) {
+            uint64_t *words = ch->display[plane][row];
+            if (ch->schip_mode) {
+                words[1] = (words[1] >> 4) | (words[0] << 60);
+            }
+            words[0] >>= 4;
+        }
+    }
+}
+
+static void chip8_scroll_left(chip8_t *ch) {
+    int height = chip8_get_height(ch);
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        if (!(ch->planes & (1 << plane))) {
+            continue;
+        }
+        for (int row = 0; row < height; row++) {
+            uint64_t *words = ch->display[plane][row];
+            words[0] <<= 4;
+            if (ch->schip_mode) {
+                words[0] |= words[1] >> 60;
+                words[1] <<= 4;
+            }
+        }
+    }
+}
+
+static uint8_t chip8_rand(chip8_t *ch) {
+    // xorshift64*
+    uint64_t x = ch->rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    ch->rng_state = x;
+    return (x * 0x2545f4914f6cdd1dull) >> 56;
+}
+
+static void chip8_tick_timers(chip8_t *ch) {
+    ch->timer_counter++;
+    if (ch->timer_counter >= ch->timer_period) {
+        if (ch->delay_timer > 0) {
+            ch->delay_timer--;
+        }
+        if (ch->sound_timer > 0) {
+            ch->sound_timer--;
+        }
+        ch->timer_counter = 0;
+    }
+}
+
+// Same as calling chip8_tick_timers num_ticks times.
+static void chip8_advance_timers(chip8_t *ch, uint64_t num_ticks) {
+    uint64_t period = ch->timer_period;
+    uint64_t until_decrement = ch->timer_counter < period ? period - ch->timer_counter : 1;
+    if (num_ticks < until_decrement) {
+        ch->timer_counter += num_ticks;
+        return;
+    }
+    uint64_t decrements = 1 + (num_ticks - until_decrement) / period;
+    ch->delay_timer = decrements < ch->delay_timer ? ch->delay_timer - decrements : 0;
+    ch->sound_timer = decrements < ch->sound_timer ? ch->sound_timer - decrements : 0;
+    ch->timer_counter = (num_ticks - until_decrement) % period;
+}
+
+// Delay timer value after num_ticks calls to chip8_tick_timers.
+static int chip8_delay_timer_after(chip8_t *ch, uint64_t num_ticks) {
+    uint64_t period = ch->timer_period;
+    uint64_t until_decrement = ch->timer_counter < period ? period - ch->timer_counter : 1;
+    if (num_ticks < until_decrement) {
+        return ch->delay_timer;
+    }
+    uint64_t decrements = 1 + (num_ticks - until_decrement) / period;
+    return decrements < ch->delay_timer ? ch->delay_timer - decrements : 0;
+}
+
+// Timers run at 60 Hz of emulated time, which is 16 cycles in lores, 8 in
+// schip mode and XO_TIMER_PERIOD for XO-CHIP programs in either mode
+static void chip8_update_timer_period(chip8_t *ch) {
+    ch->timer_period = ch->xochip ? XO_TIMER_PERIOD : ch->schip_mode ? 8 : 16;
+}
+
+static bool chip8_in_program(chip8_t *ch, uint16_t addr) {
+    return (addr - PROGRAM_OFFSET + 1) < ch->program_size;
+}
+
+static CHIP8_ALWAYS_INLINE uint16_t* chip8_stack(chip8_t *ch, unsigned quirks) {
+    return (uint16_t*)(chip8_interpreter_memory(ch, quirks) + ch->stack_offset);
+}
+
+static CHIP8_ALWAYS_INLINE chip8_xo_t* chip8_xo(chip8_t *ch) {
+    return ch->xo_storage == XO_STORAGE_INLINE ? (chip8_xo_t*)(ch + 1) : ch->xo;
+}
+
+static CHIP8_ALWAYS_INLINE uint8_t* chip8_memory(chip8_t *ch) {
+    return chip8_interpreter_memory(ch, ch->xochip ? QUIRK_XO_MEMORY : 0);
+}
+
+static CHIP8_ALWAYS_INLINE chip8_instr_t* chip8_decoded(chip8_t *ch) {
+    return chip8_interpreter_decoded(ch, ch->xochip ? QUIRK_XO_MEMORY : 0);
+}
+
+// Memory of an interpreter instance, its flags are constants there
+static CHIP8_ALWAYS_INLINE uint8_t* chip8_interpreter_memory(chip8_t *ch, unsigned quirks) {
+    return (quirks & QUIRK_XO_MEMORY) ? chip8_xo(ch)->memory : ch->memory;
+}
+
+static CHIP8_ALWAYS_INLINE chip8_instr_t* chip8_interpreter_decoded(chip8_t *ch, unsigned quirks) {
+    return (quirks & QUIRK_XO_MEMORY) ? chip8_xo(ch)->decoded : ch->decoded;
+}
+
+// Size of memory in use, the stack at its end included
+static uint32_t chip8_memory_end(chip8_t *ch) {
+    return ch->xochip ? MEMORY_SIZE + STACK_SIZE : CHIP8_MEMORY_SIZE;
+}
+
+// Makes sure the instance has an XO-CHIP extension, fails for chip8_init
+// instances without room for one
+static bool chip8_reserve_xo(chip8_t *ch) {
+    if (ch->xo_storage == XO_STORAGE_NONE) {
+        return false;
+    }
+    if (ch->xo_storage == XO_STORAGE_HEAP && ch->xo == NULL) {
+        ch->xo = calloc(1, sizeof(chip8_xo_t));
+    }
+    return chip8_xo(ch) != NULL;
+}
+
+static CHIP8_ALWAYS_INLINE const chip8_instr_t* chip8_fetch(chip8_t *ch, uint16_t addr) {
+    return chip8_interpreter_fetch(ch, addr, ch->xochip ? QUIRK_XO_MEMORY : 0);
+}
+
+static CHIP8_ALWAYS_INLINE const chip8_instr_t* chip8_interpreter_fetch(chip8_t *ch, uint16_t addr, unsigned quirks) {
+    chip8_instr_t *ins = &chip8_interpreter_decoded(ch, quirks)[addr];
+    if (ins->op == CHIP8_OP_UNDECODED) {
+        uint8_t *memory = chip8_interpreter_memory(ch, quirks);
+        uint16_t opcode = memory[addr + 1] | (memory[addr] << 8);
+        ins->op = chip8_decode(opcode);
+        ins->x = (opcode >> 8) & 0xf;
+        ins->nnn = opcode & 0xfff;
+    }
+    return ins;
+}
+
+// One cycle through the selected interpreter, with the step inlined for
+// every profile instead of called through chip8_interpreters. XO-CHIP and
+// traced instances take the call.
+static CHIP8_ALWAYS_INLINE chip8_stop_reason_t chip8_execute(chip8_t *ch, const chip8_keyboard_input_t *input) {
+    switch (ch->interpreter) {
+#define CHIP8_INTERPRETER_CASE(name, profile, flags) \
+        case CHIP8_INTERPRETER_##name: return chip8_step(ch, input, flags);
+        CHIP8_PROFILES(CHIP8_INTERPRETER_CASE, , 0)
+#undef CHIP8_INTERPRETER_CASE
+        default:
+            ch->cycle_count++;
+            chip8_tick_timers(ch);
+            return chip8_interpreters[ch->interpreter].execute(ch, input);
+    }
+}
+
+// One cycle: the count, the timers and the instruction at the PC
+static CHIP8_ALWAYS_INLINE chip8_stop_reason_t chip8_step(chip8_t *ch, const chip8_keyboard_input_t *input, unsigned quirks) {
+    ch->cycle_count++;
+    chip8_tick_timers(ch);
+#ifdef CHIP8_TRACE
+    if (quirks & QUIRK_TRACE) {
+        return chip8_trace_instr(ch, input, quirks);
+    }
+#endif
+    return chip8_execute_instr(ch, input, quirks);
+}
+
+#ifdef CHIP8_TRACE
+// Runs the instruction at the PC and adds it to the trace
+static CHIP8_ALWAYS_INLINE chip8_stop_reason_t chip8_trace_instr(chip8_t *ch, const chip8_keyboard_input_t *input, unsigned quirks) {
+    struct chip8_trace *trace = ch->trace;
+    uint16_t pc = ch->program_counter;
+    uint8_t *memory = chip8_interpreter_memory(ch, quirks);
+    uint16_t opcode = (memory[pc] << 8) | memory[pc + 1];
+    chip8_stop_reason_t reason = chip8_execute_instr(ch, input, quirks);
+    // only stores invalidate the decode cache, and they don't set registers
+    const chip8_instr_t *ins = &chip8_interpreter_decoded(ch, quirks)[pc];
+    chip8_trace_record_t *rec = &trace->records[trace->count % CHIP8_TRACE_RING_SIZE];
+    rec->cycle = ch->cycle_count;
+    rec->pc = pc;
+    rec->opcode = opcode;
+    rec->i_reg = ch->i_reg;
+    rec->reg = reason != CHIP8_STOP_ERROR ? chip8_trace_reg(ins->op, ins->x) : CHIP8_TRACE_NO_REG;
+    rec->value = rec->reg != CHIP8_TRACE_NO_REG ? ch->regs[rec->reg & 0xf] : 0;
+    trace->count++;
+    if (trace->fp != NULL && trace->count % CHIP8_TRACE_RING_SIZE == 0) {
+        chip8_trace_write(ch, 0, CHIP8_TRACE_RING_SIZE);
+    }
+    return reason;
+}
+
+// The register worth recording, VX for everything that sets it and VF for DXYN.
+// FX0A only waits for a key here and never writes VX.
+static uint8_t chip8_trace_reg(uint8_t op, uint8_t x) {
+    // a bit per op instead of a switch, which would be one more indirect branch per instruction
+    const uint64_t vx_ops = 1ull << CHIP8_OP_5XY3 | 1ull << CHIP8_OP_6XNN | 1ull << CHIP8_OP_7XNN |
+        1ull << CHIP8_OP_8XY0 | 1ull << CHIP8_OP_8XY1 | 1ull << CHIP8_OP_8XY2 | 1ull << CHIP8_OP_8XY3 |
+        1ull << CHIP8_OP_8XY4 | 1ull << CHIP8_OP_8XY5 | 1ull << CHIP8_OP_8XY6 | 1ull << CHIP8_OP_8XY7 |
+        1ull << CHIP8_OP_8XYE | 1ull << CHIP8_OP_CXNN | 1ull << CHIP8_OP_FX07 | 1ull << CHIP8_OP_FX65;
+    if ((vx_ops >> op) & 1) {
+        return x;
+    }
+    return op == CHIP8_OP_DXYN ? 0xf : CHIP8_TRACE_NO_REG;
+}
+
+// Writes count records of the ring from first on, little-endian
+static void chip8_trace_write(chip8_t *ch, size_t first, size_t count) {
+    struct chip8_trace *trace = ch->trace;
+    uint8_t buf[TRACE_WRITE_RECORDS * TRACE_RECORD_SIZE];
+    while (count > 0 && !trace->failed) {
+        size_t n = count < TRACE_WRITE_RECORDS ? count : TRACE_WRITE_RECORDS;
+        uint8_t *p = buf;
+        for (size_t i = 0; i < n; i++) {
+            const chip8_trace_record_t *rec = &trace->records[first + i];
+            p = chip8_put_u64(p, rec->cycle);
+            p = chip8_put_u16(p, rec->pc);
+            p = chip8_put_u16(p, rec->opcode);
+            p = chip8_put_u16(p, rec->i_reg);
+            *p++ = rec->reg;
+            *p++ = rec->value;
+        }
+        if (fwrite(buf, n * TRACE_RECORD_SIZE, 1, trace->fp) != 1) {
+            trace->failed = true;
+        }
+        first += n;
+        count -= n;
+    }
+}
+#endif
+
+// quirks is a combination of QUIRK_* flags, constant in every instance
+static CHIP8_ALWAYS_INLINE chip8_stop_reason_t chip8_execute_instr(chip8_t *ch, const chip8_keyboard_input_t *input, unsigned quirks) {
+    if (!chip8_in_program(ch, ch->program_counter)) {
+        return CHIP8_STOP_ERROR;
+    }
+    const chip8_instr_t *ins = chip8_interpreter_fetch(ch, ch->program_counter, quirks);
+    uint16_t nnn = ins->nnn;
+    uint8_t nn = nnn & 0xff;
+    uint8_t n = nnn & 0xf;
+    uint8_t x = ins->x;
+    uint8_t y = (nnn >> 4) & 0xf;
+    chip8_stop_reason_t reason = CHIP8_STOP_NONE;
+#ifdef CHIP8_PROFILE
+    ch->profile.instructions++;
+    ch->profile.op_counts[ins->op]++;
+    ch->profile.pc_counts[ch->program_counter]++;
+#endif
+    switch (ins->op) {
+        case CHIP8_OP_00CN: // 00CN schip
+            chip8_scroll_down(ch, n);
+            chip8_mark_all_dirty(ch);
+            reason = CHIP8_STOP_DISPLAY;
+            break;
+        case CHIP8_OP_00DN: // 00DN xo-chip
+            if (!(quirks & QUIRK_XO_MEMORY)) {
+                // 0NNN everywhere else
+                break;
+            }
+            chip8_scroll_up(ch, n);
+            chip8_mark_all_dirty(ch);
+            reason = CHIP8_STOP_DISPLAY;
+            break;
+        case CHIP8_OP_00E0: // 00E0
+            for (int plane = 0; plane < NUM_PLANES; plane++) {
+                if (ch->planes & (1 << plane)) {
+                    memset(ch->display[plane], 0x0, sizeof(ch->display[plane]));
+                }
+            }
+            chip8_mark_all_dirty(ch);
+            reason = CHIP8_STOP_DISPLAY;
+            break;
+        case CHIP8_OP_00EE: // 00EE
+            if (ch->stack_pointer == 0) {
+                return CHIP8_STOP_ERROR;
+            }
+            ch->program_counter = chip8_stack(ch, quirks)[ch->stack_pointer];
+            ch->stack_pointer--;
+            break;
+        case CHIP8_OP_00FA: { // 00FA non-standard
+            uint8_t interpreter = ch->interpreter;
+            ch->increment_ireg = !ch->increment_ireg;
+            chip8_select_interpreter(ch, chip8_interpreters[interpreter].quirks);
+            if (ch->interpreter != interpreter) {
+                reason = CHIP8_STOP_RESELECT;
+            }
+            break;
+        }
+        case CHIP8_OP_00FB: // 00FB schip
+            chip8_scroll_right(ch);
+            chip8_mark_all_dirty(ch);
+            reason = CHIP8_STOP_DISPLAY;
+            break;
+        case CHIP8_OP_00FC: // 00FC schip
+            chip8_scroll_left(ch);
+            chip8_mark_all_dirty(ch);
+            reason = CHIP8_STOP_DISPLAY;
+            break;
+        case CHIP8_OP_00FD: // 00FD
+            // exit
+            break;
+        case CHIP8_OP_00FE: // 00FE schip
+            ch->schip_mode = false;
+            chip8_update_timer_period(ch);
+            if (ch->audio.ring != NULL) {
+                chip8_audio_update(ch, ch->cycle_count - 1);
+            }
+            chip8_mark_all_dirty(ch);
+            reason = CHIP8_STOP_DISPLAY;
+            break;
+        case CHIP8_OP_00FF: // 00FF schip
+            ch->schip_mode = true;
+            chip8_update_timer_period(ch);
+            if (ch->audio.ring != NULL) {
+                chip8_audio_update(ch, ch->cycle_count - 1);
+            }
+            chip8_mark_all_dirty(ch);
+            reason = CHIP8_STOP_DISPLAY;
+            break;
+        case CHIP8_OP_0NNN: // 0NNN
+            // jump to sys addr
+            break;
+        case CHIP8_OP_1NNN: // 1NNN
+            ch->program_counter = nnn - 2;
+            break;
+        case CHIP8_OP_2NNN: // 2NNN
+            if (ch->stack_pointer >= ((quirks & QUIRK_XO_MEMORY) ? STACK_DEPTH : CHIP8_STACK_DEPTH)) {
+                return CHIP8_STOP_ERROR;
+            }
+            ch->stack_pointer++;
+            chip8_stack(ch, quirks)[ch->stack_pointer] = ch->program_counter;
+            ch->program_counter = nnn - 2;
+#ifdef CHIP8_PROFILE
+            if (ch->stack_pointer > ch->profile.max_stack_depth) {
+                ch->profile.max_stack_depth = ch->stack_pointer;
+            }
+#endif
+            break;
+        case CHIP8_OP_3XNN: // 3XNN
+            if (ch->regs[x] == nn) {
+                chip8_skip_next(ch);
+            }
+            break;
+        case CHIP8_OP_4XNN: // 4XNN
+            if (ch->regs[x] != nn) {
+                chip8_skip_next(ch);
+            }
+            break;
+        case CHIP8_OP_5XY0: // 5XY0
+            if (ch->regs[x] == ch->regs[y]) {
+                chip8_skip_next(ch);
+            }
+            break;
+        case CHIP8_OP_5XY2: { // 5XY2 xo-chip
+            int count = (x > y ? x - y : y - x) + 1;
+            if (!(quirks & QUIRK_XO_MEMORY) || ch->i_reg + count > ch->memory_size) {
+                return CHIP8_STOP_ERROR;
+            }
+            uint8_t *memory = chip8_interpreter_memory(ch, quirks);
+            for (int i = 0; i < count; i++) {
+                memory[ch->i_reg + i] = ch->regs[x > y ? x - i : x + i];
+            }
+            chip8_mark_written(ch, ch->i_reg, count);
+            chip8_invalidate_code(ch, ch->i_reg, count, quirks);
+            break;
+        }
+        case CHIP8_OP_5XY3: { // 5XY3 xo-chip
+            int count = (x > y ? x - y : y - x) + 1;
+            if (!(quirks & QUIRK_XO_MEMORY) || ch->i_reg + count > ch->memory_size) {
+                return CHIP8_STOP_ERROR;
+            }
+            const uint8_t *memory = chip8_interpreter_memory(ch, quirks);
+            for (int i = 0; i < count; i++) {
+                ch->regs[x > y ? x - i : x + i] = memory[ch->i_reg + i];
+            }
+            break;
+        }
+        case CHIP8_OP_6XNN: // 6XNN
+            ch->regs[x] = nn;
+            break;
+        case CHIP8_OP_7XNN: // 7XNN
+            ch->regs[x] = ch->regs[x] + nn;
+            break;
+        case CHIP8_OP_8XY0: // 8XY0
+            ch->regs[x] = ch->regs[y];
+            break;
+        case CHIP8_OP_8XY1: // 8XY1
+            ch->regs[x] = ch->regs[x] | ch->regs[y];
+            if (quirks & QUIRK_RESET_VF) {
+                ch->regs[0xf] = 0;
+            }
+            break;
+        case CHIP8_OP_8XY2: // 8XY2
+            ch->regs[x] = ch->regs[x] & ch->regs[y];
+            if (quirks & QUIRK_RESET_VF) {
+                ch->regs[0xf] = 0;
+            }
+            break;
+        case CHIP8_OP_8XY3: // 8XY3
+            ch->regs[x] = ch->regs[x] ^ ch->regs[y];
+            if (quirks & QUIRK_RESET_VF) {
+                ch->regs[0xf] = 0;
+            }
+            break;
+        case CHIP8_OP_8XY4: { // 8XY4
+            uint16_t r = ch->regs[x] + ch->regs[y];
+            ch->regs[x] = r;
+            ch->regs[0xf] = r > 0xff ? 0x1 : 0x0;
+            break;
+        }
+        case CHIP8_OP_8XY5: // 8XY5
+            ch->regs[0xf] = ch->regs[x] > ch->regs[y] ? 0x1 : 0x0;
+            ch->regs[x] = ch->regs[x] - ch->regs[y];
+            break;
+        case CHIP8_OP_8XY6: { // 8XY6
+            uint8_t src = quirks & QUIRK_SHIFT_VY ? y : x;
+            ch->regs[0xf] = ch->regs[src] & 0x1;
+            ch->regs[x] = ch->regs[src] >> 1;
+            break;
+        }
+        case CHIP8_OP_8XY7: // 8XY7
+            ch->regs[0xf] = ch->regs[y] > ch->regs[x] ? 0x1 : 0x0;
+            ch->regs[x] = ch->regs[y] - ch->regs[x];
+            break;
+        case CHIP8_OP_8XYE: { // 8XYE
+            uint8_t src = quirks & QUIRK_SHIFT_VY ? y : x;
+            ch->regs[0xf] = (ch->regs[src] >> 7) & 0x1;
+            ch->regs[x] = ch->regs[src] << 1;
+            break;
+        }
+        case CHIP8_OP_9XY0: // 9XY0
+            if (ch->regs[x] != ch->regs[y]) {
+                chip8_skip_next(ch);
+            }
+            break;
+        case CHIP8_OP_ANNN: // ANNN
+            ch->i_reg = nnn;
+            break;
+        case CHIP8_OP_BNNN: // BNNN, BXNN with QUIRK_JUMP_VX
+            ch->program_counter = nnn + ch->regs[quirks & QUIRK_JUMP_VX ? x : 0] - 2;
+            break;
+        case CHIP8_OP_CXNN: // CXNN
+            ch->regs[x] = chip8_rand(ch) & nn;
+            break;
+        case CHIP8_OP_DXYN: { // DXYN
+            if ((quirks & QUIRK_DISPLAY_WAIT) && ch->timer_counter != 0) {
+                // retried every cycle until a timer period starts, like the VIP waiting for vertical blank
+                return CHIP8_STOP_NONE;
+            }
+            // n rows, 16 of two bytes for n == 0, for each selected plane
+            int sprite_size = (n == 0 ? 32 : n) * ((ch->planes & 1) + (ch->planes >> 1));
+            if (ch->i_reg + sprite_size > ch->memory_size) {
+                return CHIP8_STOP_ERROR;
+            }
+            uint8_t *sprite = chip8_interpreter_memory(ch, quirks) + ch->i_reg;
+            chip8_draw_sprite(ch, sprite, n, ch->regs[x], ch->regs[y], quirks & QUIRK_CLIP, &ch->regs[0xf]);
+            reason = CHIP8_STOP_DISPLAY;
+#ifdef CHIP8_PROFILE
+            ch->profile.sprites_drawn++;
+            ch->profile.collisions += ch->regs[0xf];
+#endif
+            break;
+        }
+        case CHIP8_OP_EX9E: // EX9E
+            if (input->keys[ch->regs[x] & 0xf]) {
+                chip8_skip_next(ch);
+            }
+            break;
+        case CHIP8_OP_EXA1: // EXA1
+            if (!input->keys[ch->regs[x] & 0xf]) {
+                chip8_skip_next(ch);
+            }
+            break;
+        case CHIP8_OP_F000: { // F000 NNNN xo-chip
+            if (!(quirks & QUIRK_XO_MEMORY) || !chip8_in_program(ch, ch->program_counter + 2)) {
+                return CHIP8_STOP_ERROR;
+            }
+            const uint8_t *memory = chip8_interpreter_memory(ch, quirks);
+            ch->i_reg = (memory[ch->program_counter + 2] << 8) | memory[ch->program_counter + 3];
+            ch->program_counter += 2;
+            break;
+        }
+        case CHIP8_OP_FN01: // FN01 xo-chip
+            if (!(quirks & QUIRK_XO_MEMORY)) {
+                return CHIP8_STOP_ERROR;
+            }
+            ch->planes = x & 0x3;
+            break;
+        case CHIP8_OP_F002: // F002 xo-chip
+            if (!(quirks & QUIRK_XO_MEMORY) || ch->i_reg + AUDIO_PATTERN_SIZE > ch->memory_size) {
+                return CHIP8_STOP_ERROR;
+            }
+            memcpy(ch->audio_pattern, chip8_interpreter_memory(ch, quirks) + ch->i_reg, AUDIO_PATTERN_SIZE);
+            ch->has_audio_pattern = true;
+            if (ch->audio.ring != NULL) {
+                chip8_audio_update(ch, ch->cycle_count - 1);
+            }
+            break;
+        case CHIP8_OP_FX07: // FX07
+            ch->regs[x] = ch->delay_timer;
+            break;
+        case CHIP8_OP_FX0A: { // FX0A
+            bool key_pressed = false;
+            for (int i = 0; i < sizeof(input->keys); i++) {
+                if (input->keys[i]) {
+                    key_pressed = true;
+                    break;
+                }
+            }
+            if (!key_pressed) {
+                return CHIP8_STOP_WAIT_KEY;
+            }
+            break;
+        }
+        case CHIP8_OP_FX15: // FX15
+            ch->delay_timer = ch->regs[x];
+            break;
+        case CHIP8_OP_FX18: // FX18
+            if (ch->sound_timer == 0 && ch->regs[x] > 0) {
+                reason = CHIP8_STOP_BEEP;
+            }
+            ch->sound_timer = ch->regs[x];
+            if (ch->audio.ring != NULL) {
+                chip8_audio_update(ch, ch->cycle_count - 1);
+            }
+            break;
+        case CHIP8_OP_FX1E: // FX1E
+            ch->i_reg += ch->regs[x];
+            break;
+        case CHIP8_OP_FX29: // FX29
+            ch->i_reg = ch->regs[x] * 5;
+            break;
+        case CHIP8_OP_FX30: // FX30
+            ch->i_reg = SUPER_DIGITS_OFFSET + ch->regs[x] * 10;
+            break;
+        case CHIP8_OP_FX3A: // FX3A xo-chip
+            if (!(quirks & QUIRK_XO_MEMORY)) {
+                return CHIP8_STOP_ERROR;
+            }
+            ch->pitch = ch->regs[x];
+            if (ch->audio.ring != NULL) {
+                chip8_audio_update(ch, ch->cycle_count - 1);
+            }
+            break;
+        case CHIP8_OP_FX33: { // FX33
+            uint8_t val = ch->regs[x];
+            uint8_t bcd100 = val / 100;
+            uint8_t bcd10 = (val - (bcd100 * 100)) / 10;
+            uint8_t bcd1 = val - (bcd100 * 100) - (bcd10 * 10);
+            if ((ch->i_reg + 2) >= ch->memory_size) {
+                return CHIP8_STOP_ERROR;
+            }
+            uint8_t *memory = chip8_interpreter_memory(ch, quirks);
+            memory[ch->i_reg] = bcd100;
+            memory[ch->i_reg + 1] = bcd10;
+            memory[ch->i_reg + 2] = bcd1;
+            chip8_mark_written(ch, ch->i_reg, 3);
+            chip8_invalidate_code(ch, ch->i_reg, 3, quirks);
+            break;
+        }
+        case CHIP8_OP_FX55: { // FX55
+            if (ch->i_reg + x >= ch->memory_size) {
+                return CHIP8_STOP_ERROR;
+            }
+            // a library call, GCC inlines memcpy of a register count as rep movsq
+            memmove(chip8_interpreter_memory(ch, quirks) + ch->i_reg, ch->regs, x + 1);
+            chip8_mark_written(ch, ch->i_reg, x + 1);
+            chip8_invalidate_code(ch, ch->i_reg, x + 1, quirks);
+            if (quirks & QUIRK_INCREMENT_I) {
+                ch->i_reg += x + 1;
+            }
+            break;
+        }
+        case CHIP8_OP_FX65: { // FX65
+            if (ch->i_reg + x >= ch->memory_size) {
+                return CHIP8_STOP_ERROR;
+            }
+            memmove(ch->regs, chip8_interpreter_memory(ch, quirks) + ch->i_reg, x + 1);
+            if (quirks & QUIRK_INCREMENT_I) {
+                ch->i_reg += x + 1;
+            }
+            break;
+        }
+        default: // opcode not found
+            return CHIP8_STOP_ERROR;
+    }
+    ch->program_counter += 2;
+    return reason;
+}
+
+static void chip8_select_interpreter(chip8_t *ch, chip8_quirks_t quirks) {
+    for (size_t i = 0; i < sizeof(chip8_interpreters) / sizeof(chip8_interpreters[0]); i++) {
+        const chip8_interpreter_t *interpreter = &chip8_interpreters[i];
+        bool increment_ireg = (interpreter->flags & QUIRK_INCREMENT_I) != 0;
+        bool traced = (interpreter->flags & QUIRK_TRACE) != 0;
+        bool xo_memory = (interpreter->flags & QUIRK_XO_MEMORY) != 0;
+        if (interpreter->quirks == quirks && (quirks != CHIP8_QUIRKS_DEFAULT || increment_ireg == ch->increment_ireg) &&
+            traced == chip8_is_tracing(ch) && xo_memory == ch->xochip) {
+            ch->interpreter = (uint8_t)i;
+            return;
+        }
+    }
+}
+
+// Compiled blocks don't record instructions, so traced instances only interpret
+static bool chip8_is_tracing(chip8_t *ch) {
+#ifdef CHIP8_TRACE
+    return ch->trace != NULL;
+#else
+    return false;
+#endif
+}
+
+static int chip8_run(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason) {
+    int cycles = 0;
+    do {
+        cycles += chip8_interpreters[ch->interpreter].run(ch, input, max_cycles - cycles, stop_mask, out_reason);
+    } while (*out_reason == CHIP8_STOP_RESELECT);
+    return cycles;
+}
+
+// quirks is constant in every instance, like for chip8_execute_instr, which
+// is inlined so that the loop makes no call per instruction
+static CHIP8_ALWAYS_INLINE int chip8_run_loop(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason, unsigned quirks) {
+    chip8_stop_reason_t reason = CHIP8_STOP_BUDGET;
+    int cycles = 0;
+    while (cycles < max_cycles) {
+        uint16_t pc = ch->program_counter;
+#ifdef CHIP8_JIT_ENABLED
+        if (!(quirks & QUIRK_TRACE) && ch->jit != NULL) {
+            int n = chip8_jit_run_block(ch, max_cycles - cycles);
+            if (n < 0) {
+                reason = CHIP8_STOP_ERROR;
+                break;
+            }
+            if (n > 0) {
+                cycles += n;
+                if (((uint16_t)(pc - ch->program_counter) & ~4) == 0 && cycles < max_cycles) {
+                    cycles += chip8_skip_idle(ch, input, max_cycles - cycles);
+                }
+                continue;
+            }
+        }
+#endif
+        chip8_stop_reason_t r = chip8_step(ch, input, quirks);
+        cycles++;
+        if (r != CHIP8_STOP_NONE) {
+            if (r == CHIP8_STOP_RESELECT) {
+                reason = r;
+                break;
+            }
+            if (stop_mask & (1 << r)) {
+                reason = r;
+                // the key wait can't end before the budget does, so callers
+                // don't have to come back once per cycle
+                if (r == CHIP8_STOP_WAIT_KEY && cycles < max_cycles) {
+                    cycles += chip8_skip_idle(ch, input, max_cycles - cycles);
+                }
+                break;
+            }
+        }
+        // an idle loop leaves the PC where it was or 4 bytes back
+        if (((uint16_t)(pc - ch->program_counter) & ~4) == 0 && cycles < max_cycles) {
+            cycles += chip8_skip_idle(ch, input, max_cycles - cycles);
+        }
+    }
+    *out_reason = reason;
+    return cycles;
+}
+
+// Each profile gets the bare instruction, for batch lanes, and a whole run loop
+#define CHIP8_INTERPRETER_DEFINITION(name, profile, flags) \
+    static chip8_stop_reason_t chip8_execute_instr_##name(chip8_t *ch, const chip8_keyboard_input_t *input) { \
+        return chip8_execute_instr(ch, input, flags); \
+    } \
+    static int chip8_run_##name(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason) { \
+        return chip8_run_loop(ch, input, max_cycles, stop_mask, out_reason, flags); \
+    }
+CHIP8_INTERPRETERS(CHIP8_INTERPRETER_DEFINITION)
+#undef CHIP8_INTERPRETER_DEFINITION
+
+#define CHIP8_TRACED_INTERPRETER_DEFINITION(name, profile, flags) \
+    static chip8_stop_reason_t chip8_trace_instr_##name(chip8_t *ch, const chip8_keyboard_input_t *input) { \
+        return chip8_trace_instr(ch, input, flags); \
+    } \
+    static int chip8_trace_run_##name(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, unsigned stop_mask, chip8_stop_reason_t *out_reason) { \
+        return chip8_run_loop(ch, input, max_cycles, stop_mask, out_reason, (flags) | QUIRK_TRACE); \
+    }
+CHIP8_TRACED_INTERPRETERS(CHIP8_TRACED_INTERPRETER_DEFINITION)
+#undef CHIP8_TRACED_INTERPRETER_DEFINITION
+
+// Fast-forwards through up to max_cycles cycles of a loop that only waits
+// for a key press or the delay timer, leaving the machine exactly as
+// executing them would. Returns the number of cycles skipped.
+static int chip8_skip_idle(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles) {
+    uint16_t pc = ch->program_counter;
+    if (!ch->idle_skip || !chip8_in_program(ch, pc)) {
+        return 0;
+    }
+    const chip8_instr_t *ins = chip8_fetch(ch, pc);
+    if (ins->op == CHIP8_OP_FX0A || (ins->op == CHIP8_OP_1NNN && ins->nnn == pc)) {
+        if (ins->op == CHIP8_OP_FX0A && chip8_key_mask(input) != 0) {
+            return 0;
+        }
+        // the input can't change before the caller's budget runs out
+        ch->cycle_count += max_cycles;
+        chip8_advance_timers(ch, max_cycles);
+#ifdef CHIP8_PROFILE
+        chip8_profile_skipped(ch, pc, max_cycles);
+#endif
+        return max_cycles;
+    }
+    if (ins->op == CHIP8_OP_DXYN && chip8_display_wait_cycles(ch) > 0) {
+        int cycles = chip8_display_wait_cycles(ch) < max_cycles ? chip8_display_wait_cycles(ch) : max_cycles;
+        ch->cycle_count += cycles;
+        chip8_advance_timers(ch, cycles);
+#ifdef CHIP8_PROFILE
+        chip8_profile_skipped(ch, pc, cycles);
+#endif
+        return cycles;
+    }
+    chip8_timer_loop_t loop;
+    if (!chip8_match_timer_loop(ch, pc, &loop)) {
+        return 0;
+    }
+    uint8_t value = 0;
+    uint64_t iterations = chip8_timer_loop_iterations(ch, &loop, max_cycles / 3, &value);
+    if (iterations == 0) {
+        return 0;
+    }
+    ch->regs[loop.x] = value;
+    ch->cycle_count += iterations * 3;
+    chip8_advance_timers(ch, iterations * 3);
+#ifdef CHIP8_PROFILE
+    for (int i = 0; i < 3; i++) {
+        chip8_profile_skipped(ch, pc + i * 2, iterations);
+    }
+#endif
+    return (int)(iterations * 3);
+}
+
+// Cycles a DXYN at the PC retries before it draws, 0 without QUIRK_DISPLAY_WAIT
+static int chip8_display_wait_cycles(chip8_t *ch) {
+    if (!(chip8_interpreters[ch->interpreter].flags & QUIRK_DISPLAY_WAIT) || ch->timer_counter >= ch->timer_period - 1) {
+        return 0;
+    }
+    return ch->timer_period - 1 - ch->timer_counter;
+}
+
+static bool chip8_match_timer_loop(chip8_t *ch, uint16_t addr, chip8_timer_loop_t *out_loop) {
+    if (!chip8_in_program(ch, addr) || !chip8_in_program(ch, addr + 4)) {
+        return false;
+    }
+    const chip8_instr_t *read = chip8_fetch(ch, addr);
+    const chip8_instr_t *skip = chip8_fetch(ch, addr + 2);
+    const chip8_instr_t *jump = chip8_fetch(ch, addr + 4);
+    if (read->op != CHIP8_OP_FX07 || (skip->op != CHIP8_OP_3XNN && skip->op != CHIP8_OP_4XNN) ||
+        skip->x != read->x || jump->op != CHIP8_OP_1NNN || jump->nnn != addr) {
+        return false;
+    }
+    out_loop->addr = addr;
+    out_loop->x = read->x;
+    out_loop->nn = skip->nnn & 0xff;
+    out_loop->exit_if_equal = skip->op == CHIP8_OP_3XNN;
+    return true;
+}
+
+// Number of whole iterations, up to max_iterations, the loop runs from its
+// first instruction before one leaves it. out_value is set to the timer
+// value the last of them read.
+static uint64_t chip8_timer_loop_iterations(chip8_t *ch, const chip8_timer_loop_t *loop, uint64_t max_iterations, uint8_t *out_value) {
+    uint64_t period = ch->timer_period;
+    uint64_t until_decrement = ch->timer_counter < period ? period - ch->timer_counter : 1;
+    uint64_t iterations = 0;
+    while (iterations < max_iterations) {
+        // iteration i runs FX07 after 3 * i + 1 timer ticks
+        uint64_t ticks = iterations * 3 + 1;
+        int value = chip8_delay_timer_after(ch, ticks);
+        if (loop->exit_if_equal ? value == loop->nn : value != loop->nn) {
+            break;
+        }
+        *out_value = value;
+        uint64_t remaining = max_iterations - iterations;
+        if (value == 0) {
+            iterations += remaining;
+            break;
+        }
+        // every iteration until the next decrement reads the same value
+        uint64_t next_decrement = until_decrement;
+        if (ticks >= until_decrement) {
+            next_decrement += ((ticks - until_decrement) / period + 1) * period;
+        }
+        uint64_t same = (next_decrement - ticks - 1) / 3 + 1;
+        iterations += same < remaining ? same : remaining;
+    }
+    return iterations;
+}
+
+#ifdef CHIP8_PROFILE
+static void chip8_profile_skipped(chip8_t *ch, uint16_t addr, uint64_t count) {
+    ch->profile.instructions += count;
+    ch->profile.op_counts[chip8_decoded(ch)[addr].op] += count;
+    ch->profile.pc_counts[addr] += count;
+}
+#endif
+
+// XO-CHIP skips step over F000 NNNN as a whole
+static void chip8_skip_next(chip8_t *ch) {
+    ch->program_counter += 2;
+    if (ch->xochip && chip8_xo(ch)->memory[ch->program_counter] == 0xf0 && chip8_xo(ch)->memory[ch->program_counter + 1] == 0x00) {
+        ch->program_counter += 2;
+    }
+}
+
+static uint8_t chip8_decode(uint16_t opcode) {
+    uint8_t x = (opcode >> 8) & 0xf;
+    uint8_t nn = opcode & 0xff;
+    uint8_t n = opcode & 0xf;
+    switch (opcode >> 12) {
+        case 0x0:
+            if (x == 0x0 && (nn >> 4) == 0xc) {
+                return CHIP8_OP_00CN;
+            }
+            if (x == 0x0 && (nn >> 4) == 0xd) {
+                return CHIP8_OP_00DN;
+            }
+            switch (opcode) {
+                case 0x00e0: return CHIP8_OP_00E0;
+                case 0x00ee: return CHIP8_OP_00EE;
+                case 0x00fa: return CHIP8_OP_00FA;
+                case 0x00fb: return CHIP8_OP_00FB;
+                case 0x00fc: return CHIP8_OP_00FC;
+                case 0x00fd: return CHIP8_OP_00FD;
+                case 0x00fe: return CHIP8_OP_00FE;
+                case 0x00ff: return CHIP8_OP_00FF;
+                default: return CHIP8_OP_0NNN;
+            }
+        case 0x1: return CHIP8_OP_1NNN;
+        case 0x2: return CHIP8_OP_2NNN;
+        case 0x3: return CHIP8_OP_3XNN;
+        case 0x4: return CHIP8_OP_4XNN;
+        case 0x5:
+            switch (n) {
+                case 0x0: return CHIP8_OP_5XY0;
+                case 0x2: return CHIP8_OP_5XY2;
+                case 0x3: return CHIP8_OP_5XY3;
+                default: return CHIP8_OP_INVALID;
+            }
+        case 0x6: return CHIP8_OP_6XNN;
+        case 0x7: return CHIP8_OP_7XNN;
+        case 0x8:
+            switch (n) {
+                case 0x0: return CHIP8_OP_8XY0;
+                case 0x1: return CHIP8_OP_8XY1;
+                case 0x2: return CHIP8_OP_8XY2;
+                case 0x3: return CHIP8_OP_8XY3;
+                case 0x4: return CHIP8_OP_8XY4;
+                case 0x5: return CHIP8_OP_8XY5;
+                case 0x6: return CHIP8_OP_8XY6;
+                case 0x7: return CHIP8_OP_8XY7;
+                case 0xe: return CHIP8_OP_8XYE;
+                default: return CHIP8_OP_INVALID;
+            }
+        case 0x9: return n == 0x0 ? CHIP8_OP_9XY0 : CHIP8_OP_INVALID;
+        case 0xa: return CHIP8_OP_ANNN;
+        case 0xb: return CHIP8_OP_BNNN;
+        case 0xc: return CHIP8_OP_CXNN;
+        case 0xd: return CHIP8_OP_DXYN;
+        case 0xe:
+            switch (nn) {
+                case 0x9e: return CHIP8_OP_EX9E;
+                case 0xa1: return CHIP8_OP_EXA1;
+                default: return CHIP8_OP_INVALID;
+            }
+        case 0xf:
+            if (opcode == 0xf000) {
+                return CHIP8_OP_F000;
+            }
+            if (opcode == 0xf002) {
+                return CHIP8_OP_F002;
+            }
+            switch (nn) {
+                case 0x01: return CHIP8_OP_FN01;
+                case 0x07: return CHIP8_OP_FX07;
+                case 0x0a: return CHIP8_OP_FX0A;
+                case 0x15: return CHIP8_OP_FX15;
+                case 0x18: return CHIP8_OP_FX18;
+                case 0x1e: return CHIP8_OP_FX1E;
+                case 0x29: return CHIP8_OP_FX29;
+                case 0x30: return CHIP8_OP_FX30;
+                case 0x33: return CHIP8_OP_FX33;
+                case 0x3a: return CHIP8_OP_FX3A;
+                case 0x55: return CHIP8_OP_FX55;
+                case 0x65: return CHIP8_OP_FX65;
+                default: return CHIP8_OP_INVALID;
+            }
+    }
+    return CHIP8_OP_INVALID;
+}
+
+static void chip8_invalidate_code(chip8_t *ch, int addr, int len, unsigned quirks) {
+    if (ch->code_verified) {
+        return;
+    }
+    // an instruction starting one byte before addr overlaps the write too
+    int start = addr > 0 ? addr - 1 : 0;
+    int end = addr + len;
+    if (end > (int)ch->memory_size) {
+        end = ch->memory_size;
+    }
+    chip8_instr_t *decoded = chip8_interpreter_decoded(ch, quirks);
+    for (int i = start; i < end; i++) {
+        decoded[i].op = CHIP8_OP_UNDECODED;
+    }
+#ifdef CHIP8_JIT_ENABLED
+    if (ch->jit != NULL) {
+        chip8_jit_invalidate(ch->jit, start, end);
+    }
+#endif
+}
+
+// Stamps the memory pages of a store for chip8_fork
+static void chip8_mark_written(chip8_t *ch, int addr, int len) {
+    int last = (addr + len - 1) / FORK_PAGE_SIZE;
+    if (last >= FORK_MEMORY_PAGES) {
+        last = FORK_MEMORY_PAGES - 1;
+    }
+    for (int page = addr / FORK_PAGE_SIZE; page <= last; page++) {
+        ch->page_clock[page] = ch->fork_clock;
+    }
+}
+
+// Stamps the display pages of the rows drawn since the clock last
+// advanced, in every plane. Draws only collect rows, which is cheaper.
+static void chip8_stamp_display(chip8_t *ch) {
+    uint64_t group_mask = (1ull << FORK_DISPLAY_PAGE_ROWS) - 1;
+    for (int group = 0; group < FORK_PLANE_PAGES; group++) {
+        if ((ch->fork_rows >> (group * FORK_DISPLAY_PAGE_ROWS)) & group_mask) {
+            for (int plane = 0; plane < NUM_PLANES; plane++) {
+                ch->page_clock[FORK_MEMORY_PAGES + plane * FORK_PLANE_PAGES + group] = ch->fork_clock;
+            }
+        }
+    }
+    ch->fork_rows = 0;
+}
+
+// Starts a new history after the whole state was replaced, the next
+// chip8_fork from or into this instance copies everything
+static void chip8_fork_reset(chip8_t *ch) {
+    static atomic_uint_fast64_t next_fork_id = 1;
+    ch->fork_id = atomic_fetch_add(&next_fork_id, 1);
+    ch->fork_parent_id = 0;
+    ch->fork_parent = NULL;
+}
+
+// Copies the registers, timers and modes but not memory or the display.
+// dst keeps its own recording, trace, audio output, JIT and settings for
+// the next load.
+static void chip8_copy_machine(chip8_t *dst, const chip8_t *src) {
+    dst->stack_offset = src->stack_offset;
+    dst->planes = src->planes;
+    dst->dirty_rows = src->dirty_rows;
+    dst->dirty_columns = src->dirty_columns;
+    dst->frame_generation = src->frame_generation;
+    memcpy(dst->regs, src->regs, sizeof(dst->regs));
+    dst->i_reg = src->i_reg;
+    dst->program_counter = src->program_counter;
+    dst->stack_pointer = src->stack_pointer;
+    dst->delay_timer = src->delay_timer;
+    dst->sound_timer = src->sound_timer;
+    dst->program_size = src->program_size;
+    dst->code_verified = src->code_verified;
+    dst->increment_ireg = src->increment_ireg;
+    dst->schip_mode = src->schip_mode;
+    dst->xochip = src->xochip;
+    dst->memory_size = src->memory_size;
+    dst->timer_counter = src->timer_counter;
+    dst->timer_period = src->timer_period;
+    dst->pitch = src->pitch;
+    dst->has_audio_pattern = src->has_audio_pattern;
+    memcpy(dst->audio_pattern, src->audio_pattern, sizeof(dst->audio_pattern));
+    dst->rng_state = src->rng_state;
+    dst->cycle_count = src->cycle_count;
+    // src's interpreter may be a traced copy or the other way round
+    chip8_select_interpreter(dst, chip8_interpreters[src->interpreter].quirks);
+}
+
+static void chip8_fork_copy_page(chip8_t *parent, chip8_t *child, int page) {
+    if (page >= FORK_MEMORY_PAGES) {
+        page -= FORK_MEMORY_PAGES;
+        uint64_t *src = parent->display[page / FORK_PLANE_PAGES][(page % FORK_PLANE_PAGES) * FORK_DISPLAY_PAGE_ROWS];
+        uint64_t *dst = child->display[page / FORK_PLANE_PAGES][(page % FORK_PLANE_PAGES) * FORK_DISPLAY_PAGE_ROWS];
+        memcpy(dst, src, FORK_PAGE_SIZE);
+        return;
+    }
+    int addr = page * FORK_PAGE_SIZE;
+    if (addr >= (int)chip8_memory_end(parent)) {
+        return;
+    }
+    memcpy(chip8_memory(child) + addr, chip8_memory(parent) + addr, FORK_PAGE_SIZE);
+    // with the instruction that starts one byte before the page
+    int start = addr > 0 ? addr - 1 : 0;
+    int end = addr + FORK_PAGE_SIZE < (int)parent->memory_size ? addr + FORK_PAGE_SIZE : (int)parent->memory_size;
+    if (start < end) {
+        memcpy(chip8_decoded(child) + start, chip8_decoded(parent) + start, (end - start) * sizeof(chip8_instr_t));
+#ifdef CHIP8_JIT_ENABLED
+        if (child->jit != NULL) {
+            chip8_jit_invalidate(child->jit, start, end);
+        }
+#endif
+    }
+}
+
+// Fills in a zeroed instance
+static void chip8_setup(chip8_t *ch) {
+    ch->stack_offset = STACK_OFFSET;
+    ch->memory_size = CHIP8_MEMORY_SIZE;
+    ch->timer_period = 16;
+    ch->planes = 0x1;
+    ch->interpreter = 0;
+    ch->idle_skip = true;
+    memcpy(ch->memory, digits, sizeof(digits));
+    memcpy(ch->memory + SUPER_DIGITS_OFFSET, super_digits, sizeof(super_digits));
+    chip8_seed_rng(ch, 0);
+    chip8_fork_reset(ch);
+}
+
+// Switches between the 4 KB and the 64 KB address space and drops all
+// decoded and compiled code, the caller fills in memory. Fails if there
+// is no room for the XO-CHIP extension.
+static bool chip8_set_xochip(chip8_t *ch, bool xochip) {
+    if (xochip && !chip8_reserve_xo(ch)) {
+        return false;
+    }
+    uint32_t memory_size = xochip ? MEMORY_SIZE : CHIP8_MEMORY_SIZE;
+    // instructions past memory_size are never decoded
+    memset(xochip ? chip8_xo(ch)->decoded : ch->decoded, 0, memory_size * sizeof(chip8_instr_t));
+    ch->code_verified = false;
+    ch->load_clock = 0;
+    chip8_fork_reset(ch);
+#ifdef CHIP8_JIT_ENABLED
+    if (ch->jit != NULL) {
+        chip8_jit_flush(ch->jit);
+    }
+#endif
+    if (!xochip) {
+        memset(ch->display[1], 0, sizeof(ch->display[1]));
+    }
+    ch->xochip = xochip;
+    ch->memory_size = memory_size;
+    ch->stack_offset = xochip ? XO_STACK_OFFSET : STACK_OFFSET;
+    return true;
+}
+
+// Fills memory between start and end as chip8_load_program leaves it
+static void chip8_write_image(chip8_t *ch, int start, int end, const uint8_t *program, size_t size) {
+    const uint8_t *sources[] = {digits, super_digits, program};
+    int offsets[] = {0, SUPER_DIGITS_OFFSET, PROGRAM_OFFSET};
+    int sizes[] = {sizeof(digits), sizeof(super_digits), (int)size};
+    uint8_t *memory = chip8_memory(ch);
+    memset(memory + start, 0, end - start);
+    for (int i = 0; i < 3; i++) {
+        int from = offsets[i] > start ? offsets[i] : start;
+        int to = offsets[i] + sizes[i] < end ? offsets[i] + sizes[i] : end;
+        if (from < to) {
+            memcpy(memory + from, sources[i] + from - offsets[i], to - from);
+        }
+    }
+}
+
+// Loads a program over the previous one of the same variant, rewriting only
+// the pages written since that load and the ones either program or the stack
+// occupies. Decoded instructions in the other pages are still valid.
+static void chip8_restore_pages(chip8_t *ch, const uint8_t *program, size_t size) {
+    int program_end = PROGRAM_OFFSET + (size > ch->program_size ? size : ch->program_size);
+    int memory_end = chip8_memory_end(ch);
+    chip8_stamp_display(ch);
+    for (int page = 0; page < FORK_NUM_PAGES; page++) {
+        bool written = ch->page_clock[page] >= ch->load_clock;
+        if (page >= FORK_MEMORY_PAGES) {
+            if (written) {
+                int plane_page = page - FORK_MEMORY_PAGES;
+                memset(ch->display[plane_page / FORK_PLANE_PAGES][(plane_page % FORK_PLANE_PAGES) * FORK_DISPLAY_PAGE_ROWS], 0, FORK_PAGE_SIZE);
+            }
+            continue;
+        }
+        int addr = page * FORK_PAGE_SIZE;
+        bool in_program = addr < program_end && addr + FORK_PAGE_SIZE > PROGRAM_OFFSET;
+        bool in_stack = addr < memory_end && addr + FORK_PAGE_SIZE > (int)ch->stack_offset;
+        if (addr >= memory_end || (!written && !in_program && !in_stack)) {
+            continue;
+        }
+        chip8_write_image(ch, addr, addr + FORK_PAGE_SIZE, program, size);
+        int start = addr > 0 ? addr - 1 : 0;
+        int end = addr + FORK_PAGE_SIZE < (int)ch->memory_size ? addr + FORK_PAGE_SIZE : (int)ch->memory_size;
+        if (start < end) {
+            memset(chip8_decoded(ch) + start, 0, (end - start) * sizeof(chip8_instr_t));
+        }
+    }
+    ch->code_verified = false;
+    chip8_fork_reset(ch);
+#ifdef CHIP8_JIT_ENABLED
+    if (ch->jit != NULL) {
+        chip8_jit_flush(ch->jit);
+    }
+#endif
+}
+
+static size_t chip8_snapshot_size(bool xochip) {
+    if (xochip) {
+        return STATE_FIXED_SIZE + MEMORY_SIZE + STACK_SIZE + NUM_PLANES * STATE_PLANE_SIZE;
+    }
+    return STATE_FIXED_SIZE + CHIP8_MEMORY_SIZE + STATE_PLANE_SIZE;
+}
+
+static uint8_t* chip8_put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t* chip8_put_u32(uint8_t *p, uint32_t v) {
+    p = chip8_put_u16(p, v & 0xffff);
+    return chip8_put_u16(p, v >> 16);
+}
+
+static uint8_t* chip8_put_u64(uint8_t *p, uint64_t v) {
+    p = chip8_put_u32(p, v & 0xffffffff);
+    return chip8_put_u32(p, v >> 32);
+}
+
+static uint16_t chip8_get_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t chip8_get_u32(const uint8_t *p) {
+    return chip8_get_u16(p) | ((uint32_t)chip8_get_u16(p + 2) << 16);
+}
+
+static uint64_t chip8_get_u64(const uint8_t *p) {
+    return chip8_get_u32(p) | ((uint64_t)chip8_get_u32(p + 4) << 32);
+}
+
+static size_t chip8_put_varint(uint8_t *p, size_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// Returns the number of bytes read, 0 if the varint is truncated
+static size_t chip8_get_varint(const uint8_t *p, size_t size, size_t *out_v) {
+    size_t v = 0;
+    for (size_t n = 0; n < size && n < 10; n++) {
+        v |= (size_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *out_v = v;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+// Encodes a ^ b as (zero run, literal length, literal bytes) tokens.
+// out must hold at least 2 * len + 16 bytes.
+static size_t chip8_xor_rle_encode(const uint8_t *a, const uint8_t *b, size_t len, uint8_t *out) {
+    size_t out_len = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t zeros_start = i;
+        while (i < len && a[i] == b[i]) {
+            i++;
+        }
+        size_t literal_start = i;
+        while (i < len && a[i] != b[i]) {
+            i++;
+        }
+        out_len += chip8_put_varint(out + out_len, literal_start - zeros_start);
+        out_len += chip8_put_varint(out + out_len, i - literal_start);
+        for (size_t j = literal_start; j < i; j++) {
+            out[out_len++] = a[j] ^ b[j];
+        }
+    }
+    return out_len;
+}
+
+static bool chip8_xor_rle_apply(uint8_t *target, size_t len, const uint8_t *delta, size_t delta_size) {
+    size_t pos = 0;
+    size_t i = 0;
+    while (i < delta_size) {
+        size_t zeros, literals;
+        size_t n = chip8_get_varint(delta + i, delta_size - i, &zeros);
+        if (n == 0) {
+            return false;
+        }
+        i += n;
+        n = chip8_get_varint(delta + i, delta_size - i, &literals);
+        if (n == 0) {
+            return false;
+        }
+        i += n;
+        if (zeros > len - pos || literals > len - pos - zeros || literals > delta_size - i) {
+            return false;
+        }
+        pos += zeros;
+        for (size_t j = 0; j < literals; j++) {
+            target[pos++] ^= delta[i++];
+        }
+    }
+    return true;
+}
+
+static void chip8_ring_write(chip8_rewind_t *rw, size_t offset, const uint8_t *src, size_t len) {
+    offset %= rw->capacity;
+    size_t first = rw->capacity - offset < len ? rw->capacity - offset : len;
+    memcpy(rw->ring + offset, src, first);
+    memcpy(rw->ring, src + first, len - first);
+}
+
+static void chip8_ring_read(chip8_rewind_t *rw, size_t offset, uint8_t *dst, size_t len) {
+    offset %= rw->capacity;
+    size_t first = rw->capacity - offset < len ? rw->capacity - offset : len;
+    memcpy(dst, rw->ring + offset, first);
+    memcpy(dst + first, rw->ring, len - first);
+}
+
+// FNV-1a of the save state
+static uint64_t chip8_fnv1a(const uint8_t *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint64_t chip8_state_hash(chip8_t *ch) {
+    uint8_t state[STATE_MAX_SIZE];
+    size_t state_size = chip8_save_state(ch, state, sizeof(state));
+    return chip8_fnv1a(state, state_size);
+}
+
+static uint16_t chip8_key_mask(const chip8_keyboard_input_t *input) {
+    uint16_t keys = 0;
+    for (int i = 0; i < 16; i++) {
+        keys |= input->keys[i] ? 1 << i : 0;
+    }
+    return keys;
+}
+
+static void chip8_record(chip8_t *ch, uint8_t tag, const uint8_t *payload, size_t payload_size) {
+    struct chip8_recording *rec = ch->recording;
+    uint8_t buf[32];
+    buf[0] = tag;
+    size_t len = 1 + chip8_put_varint(buf + 1, ch->cycle_count - rec->last_cycle);
+    memcpy(buf + len, payload, payload_size);
+    len += payload_size;
+    if (fwrite(buf, len, 1, rec->fp) != 1) {
+        rec->failed = true;
+    }
+    rec->last_cycle = ch->cycle_count;
+}
+
+static void chip8_record_input(chip8_t *ch, const chip8_keyboard_input_t *input) {
+    uint16_t keys = chip8_key_mask(input);
+    if (keys != ch->recording->keys) {
+        uint8_t payload[2];
+        chip8_put_u16(payload, keys);
+        chip8_record(ch, RECORD_INPUT, payload, sizeof(payload));
+        ch->recording->keys = keys;
+    }
+}
+
+static void chip8_record_checkpoint(chip8_t *ch) {
+    struct chip8_recording *rec = ch->recording;
+    if (ch->cycle_count >= rec->next_hash_cycle) {
+        uint8_t payload[8];
+        chip8_put_u64(payload, chip8_state_hash(ch));
+        chip8_record(ch, RECORD_HASH, payload, sizeof(payload));
+        rec->next_hash_cycle = ch->cycle_count + rec->hash_interval;
+    }
+}
+
+// Starts generating samples from the current cycle, e.g. after a jump in
+// time caused by loading a state.
+static void chip8_audio_restart(chip8_t *ch) {
+    ch->audio.last_cycle = ch->cycle_count;
+    chip8_audio_update(ch, ch->cycle_count);
+}
+
+// Generates samples up to until_cycle and recomputes when the sound stops
+// after the sound timer or the timer period changed.
+static void chip8_audio_update(chip8_t *ch, uint64_t until_cycle) {
+    chip8_audio_t *a = &ch->audio;
+    if (a->ring == NULL) {
+        return;
+    }
+    chip8_audio_flush(ch, until_cycle);
+    a->cycle_time = 960 / ch->timer_period;
+    a->use_pattern = ch->has_audio_pattern;
+    if (a->use_pattern) {
+        memcpy(a->pattern, ch->audio_pattern, AUDIO_PATTERN_SIZE);
+        // 4000 * 2^((pitch - 64) / 48) bits per second
+        double rate = 4000.0;
+        int steps = ch->pitch - 64;
+        for (; steps < 0; steps += 48) {
+            rate /= 2;
+        }
+        for (; steps >= 48; steps -= 48) {
+            rate *= 2;
+        }
+        for (int i = 0; i < steps; i++) {
+            rate *= 1.0145453349375237; // 2^(1/48)
+        }
+        a->pattern_step = (uint32_t)(rate * 65536 / a->sample_rate);
+    }
+    if (ch->sound_timer == 0) {
+        a->sound_end_cycle = 0;
+        return;
+    }
+    int period = ch->timer_period;
+    int until_decrement = ch->timer_counter < period ? period - ch->timer_counter : 1;
+    a->sound_end_cycle = ch->cycle_count + until_decrement + (uint64_t)(ch->sound_timer - 1) * period;
+}
+
+static void chip8_audio_flush(chip8_t *ch, uint64_t until_cycle) {
+    chip8_audio_t *a = &ch->audio;
+    if (until_cycle <= a->last_cycle) {
+        return;
+    }
+    uint64_t cycles = until_cycle - a->last_cycle;
+    uint64_t on_cycles = 0;
+    if (a->sound_end_cycle > a->last_cycle + 1) {
+        on_cycles = a->sound_end_cycle - a->last_cycle - 1;
+        if (on_cycles > cycles) {
+            on_cycles = cycles;
+        }
+    }
+    chip8_audio_emit(ch, on_cycles * a->cycle_time, true);
+    chip8_audio_emit(ch, (cycles - on_cycles) * a->cycle_time, false);
+    a->last_cycle = until_cycle;
+}
+
+// Appends the samples covering time units of a square wave, the XO-CHIP
+// pattern or silence.
+// Samples that don't fit are dropped and counted as an overrun.
+static void chip8_audio_emit(chip8_t *ch, uint64_t time, bool on) {
+    chip8_audio_t *a = &ch->audio;
+    chip8_audio_ring_t *ring = a->ring;
+    // time is in 1/57600ths of a second, a sample in 1/sample_rate
+    uint64_t total = a->time_fraction + time * a->sample_rate;
+    uint64_t count = total / 57600;
+    a->time_fraction = total % 57600;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = ring->mask + 1 - (head - tail);
+    size_t n = count < space ? count : space;
+    if (n < count) {
+        atomic_fetch_add_explicit(&ring->overrun_samples, count - n, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < n; i++) {
+        int16_t sample = 0;
+        if (on && a->use_pattern) {
+            uint32_t bit = (a->pattern_pos >> 16) % (AUDIO_PATTERN_SIZE * 8);
+            sample = (a->pattern[bit / 8] >> (7 - bit % 8)) & 1 ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+            a->pattern_pos += a->pattern_step;
+        } else if (on) {
+            sample = a->phase < a->sample_rate / 2 ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+            a->phase += a->tone_hz;
+            if (a->phase >= a->sample_rate) {
+                a->phase -= a->sample_rate;
+            }
+        }
+        ring->samples[(head + i) & ring->mask] = sample;
+    }
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+}
+
+#if defined(__AVX2__)
+static chip8_vec_t vec_load(const uint8_t *p) { return _mm256_loadu_si256((const __m256i*)p); }
+static void vec_store(uint8_t *p, chip8_vec_t a) { _mm256_storeu_si256((__m256i*)p, a); }
+static chip8_vec_t vec_set1(uint8_t v) { return _mm256_set1_epi8((char)v); }
+static chip8_vec_t vec_add(chip8_vec_t a, chip8_vec_t b) { return _mm256_add_epi8(a, b); }
+static chip8_vec_t vec_sub(chip8_vec_t a, chip8_vec_t b) { return _mm256_sub_epi8(a, b); }
+static chip8_vec_t vec_and(chip8_vec_t a, chip8_vec_t b) { return _mm256_and_si256(a, b); }
+static chip8_vec_t vec_or(chip8_vec_t a, chip8_vec_t b) { return _mm256_or_si256(a, b); }
+static chip8_vec_t vec_xor(chip8_vec_t a, chip8_vec_t b) { return _mm256_xor_si256(a, b); }
+static chip8_vec_t vec_andnot(chip8_vec_t a, chip8_vec_t b) { return _mm256_andnot_si256(a, b); }
+static chip8_vec_t vec_cmpeq(chip8_vec_t a, chip8_vec_t b) { return _mm256_cmpeq_epi8(a, b); }
+static chip8_vec_t vec_min(chip8_vec_t a, chip8_vec_t b) { return _mm256_min_epu8(a, b); }
+static chip8_vec_t vec_shr(chip8_vec_t a, int n) { return _mm256_and_si256(_mm256_srli_epi16(a, n), vec_set1(0xff >> n)); }
+static bool vec_any(chip8_vec_t a) { return _mm256_movemask_epi8(a) != 0; }
+#elif defined(__SSE2__)
+static chip8_vec_t vec_load(const uint8_t *p) { return _mm_loadu_si128((const __m128i*)p); }
+static void vec_store(uint8_t *p, chip8_vec_t a) { _mm_storeu_si128((__m128i*)p, a); }
+static chip8_vec_t vec_set1(uint8_t v) { return _mm_set1_epi8((char)v); }
+static chip8_vec_t vec_add(chip8_vec_t a, chip8_vec_t b) { return _mm_add_epi8(a, b); }
+static chip8_vec_t vec_sub(chip8_vec_t a, chip8_vec_t b) { return _mm_sub_epi8(a, b); }
+static chip8_vec_t vec_and(chip8_vec_t a, chip8_vec_t b) { return _mm_and_si128(a, b); }
+static chip8_vec_t vec_or(chip8_vec_t a, chip8_vec_t b) { return _mm_or_si128(a, b); }
+static chip8_vec_t vec_xor(chip8_vec_t a, chip8_vec_t b) { return _mm_xor_si128(a, b); }
+static chip8_vec_t vec_andnot(chip8_vec_t a, chip8_vec_t b) { return _mm_andnot_si128(a, b); }
+static chip8_vec_t vec_cmpeq(chip8_vec_t a, chip8_vec_t b) { return _mm_cmpeq_epi8(a, b); }
+static chip8_vec_t vec_min(chip8_vec_t a, chip8_vec_t b) { return _mm_min_epu8(a, b); }
+static chip8_vec_t vec_shr(chip8_vec_t a, int n) { return _mm_and_si128(_mm_srli_epi16(a, n), vec_set1(0xff >> n)); }
+static bool vec_any(chip8_vec_t a) { return _mm_movemask_epi8(a) != 0; }
+#else
+#define VEC_MAP(expr) chip8_vec_t r; for (int k = 0; k < CHIP8_VEC_WIDTH; k++) { r.b[k] = (expr); } return r
+static chip8_vec_t vec_load(const uint8_t *p) { chip8_vec_t r; memcpy(r.b, p, CHIP8_VEC_WIDTH); return r; }
+static void vec_store(uint8_t *p, chip8_vec_t a) { memcpy(p, a.b, CHIP8_VEC_WIDTH); }
+static chip8_vec_t vec_set1(uint8_t v) { VEC_MAP(v); }
+static chip8_vec_t vec_add(chip8_vec_t a, chip8_vec_t b) { VEC_MAP(a.b[k] + b.b[k]); }
+static chip8_vec_t vec_sub(chip8_vec_t a, chip8_vec_t b) { VEC_MAP(a.b[k] - b.b[k]); }
+static chip8_vec_t vec_and(chip8_vec_t a, chip8_vec_t b) { VEC_MAP(a.b[k] & b.b[k]); }
+static chip8_vec_t vec_or(chip8_vec_t a, chip8_vec_t b) { VEC_MAP(a.b[k] | b.b[k]); }
+static chip8_vec_t vec_xor(chip8_vec_t a, chip8_vec_t b) { VEC_MAP(a.b[k] ^ b.b[k]); }
+static chip8_vec_t vec_andnot(chip8_vec_t a, chip8_vec_t b) { VEC_MAP(~a.b[k] & b.b[k]); }
+static chip8_vec_t vec_cmpeq(chip8_vec_t a, chip8_vec_t b) { VEC_MAP(a.b[k] == b.b[k] ? 0xff : 0x00); }
+static chip8_vec_t vec_min(chip8_vec_t a, chip8_vec_t b) { VEC_MAP(a.b[k] < b.b[k] ? a.b[k] : b.b[k]); }
+static chip8_vec_t vec_shr(chip8_vec_t a, int n) { VEC_MAP(a.b[k] >> n); }
+static bool vec_any(chip8_vec_t a) { uint8_t r = 0; for (int k = 0; k < CHIP8_VEC_WIDTH; k++) { r |= a.b[k]; } return r != 0; }
+#undef VEC_MAP
+#endif
+
+// m ? a : b per byte, m being 0x00 or 0xff
+static chip8_vec_t vec_blend(chip8_vec_t m, chip8_vec_t a, chip8_vec_t b) {
+    return vec_or(vec_and(m, a), vec_andnot(m, b));
+}
+
+// 1 where a > b, 0 elsewhere
+static chip8_vec_t vec_gt_bit(chip8_vec_t a, chip8_vec_t b) {
+    return vec_andnot(vec_cmpeq(vec_min(a, b), a), vec_set1(1));
+}
+
+// hi:lo += a, per lane
+static void vec_add16(uint8_t *lo, uint8_t *hi, chip8_vec_t a) {
+    chip8_vec_t old = vec_load(lo);
+    chip8_vec_t sum = vec_add(old, a);
+    vec_store(lo, sum);
+    vec_store(hi, vec_add(vec_load(hi), vec_gt_bit(old, sum)));
+}
+
+// hi:lo = m ? v : hi:lo, per lane
+static void vec_blend16(uint8_t *lo, uint8_t *hi, chip8_vec_t m, uint16_t v) {
+    vec_store(lo, vec_blend(m, vec_set1(v & 0xff), vec_load(lo)));
+    vec_store(hi, vec_blend(m, vec_set1(v >> 8), vec_load(hi)));
+}
+
+// Loads the lane's registers from its instance
+static void chip8_batch_gather(chip8_batch_t *b, int lane) {
+    chip8_t *ch = b->lanes[lane];
+    for (int r = 0; r < NUM_REGS; r++) {
+        b->regs[r * b->stride + lane] = ch->regs[r];
+    }
+    b->pc_lo[lane] = ch->program_counter & 0xff;
+    b->pc_hi[lane] = ch->program_counter >> 8;
+    b->i_lo[lane] = ch->i_reg & 0xff;
+    b->i_hi[lane] = ch->i_reg >> 8;
+    b->delay_timer[lane] = ch->delay_timer;
+    b->sound_timer[lane] = ch->sound_timer;
+    b->timer_counter[lane] = ch->timer_counter;
+    b->timer_period[lane] = ch->timer_period;
+}
+
+// Writes the lane's registers back to its instance
+static void chip8_batch_scatter(chip8_batch_t *b, int lane) {
+    chip8_t *ch = b->lanes[lane];
+    for (int r = 0; r < NUM_REGS; r++) {
+        ch->regs[r] = b->regs[r * b->stride + lane];
+    }
+    ch->program_counter = b->pc_lo[lane] | (b->pc_hi[lane] << 8);
+    ch->i_reg = b->i_lo[lane] | (b->i_hi[lane] << 8);
+    ch->delay_timer = b->delay_timer[lane];
+    ch->sound_timer = b->sound_timer[lane];
+    ch->timer_counter = b->timer_counter[lane];
+}
+
+static void chip8_batch_sync_touched(chip8_batch_t *b) {
+    if (!b->any_touched) {
+        return;
+    }
+    for (int lane = 0; lane < b->num_lanes; lane++) {
+        if (!b->touched[lane]) {
+            continue;
+        }
+        chip8_t *ch = b->lanes[lane];
+        chip8_batch_gather(b, lane);
+        if (ch->xochip || chip8_interpreters[ch->interpreter].quirks != CHIP8_QUIRKS_DEFAULT) {
+            // lanes share the SCHIP skip and timer kernels and the default ALU and jump quirks
+            b->active[lane] = 0;
+        }
+        for (int addr = PROGRAM_OFFSET; addr < STACK_OFFSET; addr++) {
+            b->modified[addr] |= ch->memory[addr] != b->image[addr];
+        }
+        b->sizes_differ |= ch->program_size != b->program_size;
+        b->touched[lane] = false;
+    }
+    b->any_touched = false;
+}
+
+static void chip8_batch_tick_timers(chip8_batch_t *b) {
+    chip8_vec_t one = vec_set1(1);
+    chip8_vec_t zero = vec_set1(0);
+    for (int c = 0; c < b->stride; c += CHIP8_VEC_WIDTH) {
+        chip8_vec_t active = vec_load(b->active + c);
+        chip8_vec_t counter = vec_add(vec_load(b->timer_counter + c), vec_and(active, one));
+        chip8_vec_t period = vec_load(b->timer_period + c);
+        chip8_vec_t due = vec_and(active, vec_cmpeq(vec_min(counter, period), period));
+        chip8_vec_t dt = vec_load(b->delay_timer + c);
+        chip8_vec_t st = vec_load(b->sound_timer + c);
+        dt = vec_sub(dt, vec_and(vec_andnot(vec_cmpeq(dt, zero), due), one));
+        st = vec_sub(st, vec_and(vec_andnot(vec_cmpeq(st, zero), due), one));
+        vec_store(b->delay_timer + c, dt);
+        vec_store(b->sound_timer + c, st);
+        vec_store(b->timer_counter + c, vec_andnot(due, counter));
+    }
+}
+
+// Returns the first pending lane at or after from, num_lanes if there is none
+static int chip8_batch_next_pending(chip8_batch_t *b, int from) {
+    for (int c = from - from % CHIP8_VEC_WIDTH; c < b->stride; c += CHIP8_VEC_WIDTH) {
+        if (vec_any(vec_load(b->pending + c))) {
+            for (int lane = c > from ? c : from; lane < c + CHIP8_VEC_WIDTH; lane++) {
+                if (b->pending[lane]) {
+                    return lane;
+                }
+            }
+        }
+    }
+    return b->num_lanes;
+}
+
+// Executes the instruction at lane first's PC on every pending lane that is
+// at the same address with the same opcode.
+static void chip8_batch_step_group(chip8_batch_t *b, int first, const chip8_keyboard_input_t *inputs) {
+    chip8_t *leader = b->lanes[first];
+    uint16_t pc = b->pc_lo[first] | (b->pc_hi[first] << 8);
+    if (!chip8_in_program(leader, pc)) {
+        b->pending[first] = 0;
+        chip8_batch_execute_lane(b, first, inputs);
+        return;
+    }
+    int start = first - first % CHIP8_VEC_WIDTH;
+    chip8_vec_t pc_lo = vec_set1(pc & 0xff);
+    chip8_vec_t pc_hi = vec_set1(pc >> 8);
+    for (int c = start; c < b->stride; c += CHIP8_VEC_WIDTH) {
+        chip8_vec_t pending = vec_load(b->pending + c);
+        chip8_vec_t same_pc = vec_and(vec_cmpeq(vec_load(b->pc_lo + c), pc_lo), vec_cmpeq(vec_load(b->pc_hi + c), pc_hi));
+        chip8_vec_t m = vec_and(pending, same_pc);
+        vec_store(b->mask + c, m);
+        vec_store(b->pending + c, vec_andnot(m, pending));
+    }
+    if (b->modified[pc] || b->modified[pc + 1] || b->sizes_differ) {
+        for (int lane = first + 1; lane < b->num_lanes; lane++) {
+            chip8_t *ch = b->lanes[lane];
+            if (b->mask[lane] && (!chip8_in_program(ch, pc) || ch->memory[pc] != leader->memory[pc]
+                                  || ch->memory[pc + 1] != leader->memory[pc + 1])) {
+                b->mask[lane] = 0;
+                b->pending[lane] = 0xff;
+            }
+        }
+    }
+    const chip8_instr_t *ins = chip8_fetch(leader, pc);
+    if (chip8_batch_can_vectorize(ins->op)) {
+        for (int c = start; c < b->stride; c += CHIP8_VEC_WIDTH) {
+            chip8_batch_execute_chunk(b, ins, c, inputs);
+        }
+        return;
+    }
+    for (int lane = first; lane < b->num_lanes; lane++) {
+        if (b->mask[lane]) {
+            chip8_batch_execute_lane(b, lane, inputs);
+        }
+    }
+}
+
+static bool chip8_batch_can_vectorize(uint8_t op) {
+    switch (op) {
+        case CHIP8_OP_00FD: case CHIP8_OP_0NNN: case CHIP8_OP_1NNN:
+        case CHIP8_OP_3XNN: case CHIP8_OP_4XNN: case CHIP8_OP_5XY0:
+        case CHIP8_OP_6XNN: case CHIP8_OP_7XNN: case CHIP8_OP_8XY0:
+        case CHIP8_OP_8XY1: case CHIP8_OP_8XY2: case CHIP8_OP_8XY3:
+        case CHIP8_OP_8XY4: case CHIP8_OP_8XY5: case CHIP8_OP_8XY6:
+        case CHIP8_OP_8XY7: case CHIP8_OP_8XYE: case CHIP8_OP_9XY0:
+        case CHIP8_OP_ANNN: case CHIP8_OP_BNNN: case CHIP8_OP_EX9E:
+        case CHIP8_OP_EXA1: case CHIP8_OP_FX07: case CHIP8_OP_FX15:
+        case CHIP8_OP_FX18: case CHIP8_OP_FX1E: case CHIP8_OP_FX29:
+        case CHIP8_OP_FX30:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Masked execution of a vectorizable instruction on lanes start to
+// start + CHIP8_VEC_WIDTH - 1. Mirrors chip8_execute_instr, including the
+// order of the VF and VX writes when X is F.
+static void chip8_batch_execute_chunk(chip8_batch_t *b, const chip8_instr_t *ins, int start, const chip8_keyboard_input_t *inputs) {
+    chip8_vec_t m = vec_load(b->mask + start);
+    if (!vec_any(m)) {
+        return;
+    }
+    uint16_t nnn = ins->nnn;
+    uint8_t nn = nnn & 0xff;
+    uint8_t y = (nnn >> 4) & 0xf;
+    uint8_t *vx = b->regs + ins->x * b->stride + start;
+    uint8_t *vy = b->regs + y * b->stride + start;
+    uint8_t *vf = b->regs + 0xf * b->stride + start;
+    uint8_t *pc_lo = b->pc_lo + start;
+    uint8_t *pc_hi = b->pc_hi + start;
+    uint8_t *i_lo = b->i_lo + start;
+    uint8_t *i_hi = b->i_hi + start;
+    chip8_vec_t one = vec_set1(1);
+    chip8_vec_t skip = vec_set1(0);
+    chip8_vec_t a;
+    chip8_vec_t c;
+    uint8_t pressed[CHIP8_VEC_WIDTH];
+    switch (ins->op) {
+        case CHIP8_OP_00FD:
+        case CHIP8_OP_0NNN:
+            break;
+        case CHIP8_OP_1NNN:
+            vec_blend16(pc_lo, pc_hi, m, nnn - 2);
+            break;
+        case CHIP8_OP_3XNN:
+            skip = vec_and(m, vec_cmpeq(vec_load(vx), vec_set1(nn)));
+            break;
+        case CHIP8_OP_4XNN:
+            skip = vec_andnot(vec_cmpeq(vec_load(vx), vec_set1(nn)), m);
+            break;
+        case CHIP8_OP_5XY0:
+            skip = vec_and(m, vec_cmpeq(vec_load(vx), vec_load(vy)));
+            break;
+        case CHIP8_OP_6XNN:
+            vec_store(vx, vec_blend(m, vec_set1(nn), vec_load(vx)));
+            break;
+        case CHIP8_OP_7XNN:
+            vec_store(vx, vec_add(vec_load(vx), vec_and(m, vec_set1(nn))));
+            break;
+        case CHIP8_OP_8XY0:
+            vec_store(vx, vec_blend(m, vec_load(vy), vec_load(vx)));
+            break;
+        case CHIP8_OP_8XY1:
+            a = vec_load(vx);
+            vec_store(vx, vec_blend(m, vec_or(a, vec_load(vy)), a));
+            break;
+        case CHIP8_OP_8XY2:
+            a = vec_load(vx);
+            vec_store(vx, vec_blend(m, vec_and(a, vec_load(vy)), a));
+            break;
+        case CHIP8_OP_8XY3:
+            a = vec_load(vx);
+            vec_store(vx, vec_blend(m, vec_xor(a, vec_load(vy)), a));
+            break;
+        case CHIP8_OP_8XY4:
+            a = vec_load(vx);
+            c = vec_add(a, vec_load(vy));
+            vec_store(vx, vec_blend(m, c, a));
+            vec_store(vf, vec_blend(m, vec_gt_bit(a, c), vec_load(vf)));
+            break;
+        case CHIP8_OP_8XY5:
+            vec_store(vf, vec_blend(m, vec_gt_bit(vec_load(vx), vec_load(vy)), vec_load(vf)));
+            a = vec_load(vx);
+            vec_store(vx, vec_blend(m, vec_sub(a, vec_load(vy)), a));
+            break;
+        case CHIP8_OP_8XY6:
+            vec_store(vf, vec_blend(m, vec_and(vec_load(vx), one), vec_load(vf)));
+            a = vec_load(vx);
+            vec_store(vx, vec_blend(m, vec_shr(a, 1), a));
+            break;
+        case CHIP8_OP_8XY7:
+            vec_store(vf, vec_blend(m, vec_gt_bit(vec_load(vy), vec_load(vx)), vec_load(vf)));
+            a = vec_load(vx);
+            vec_store(vx, vec_blend(m, vec_sub(vec_load(vy), a), a));
+            break;
+        case CHIP8_OP_8XYE:
+            vec_store(vf, vec_blend(m, vec_shr(vec_load(vx), 7), vec_load(vf)));
+            a = vec_load(vx);
+            vec_store(vx, vec_blend(m, vec_add(a, a), a));
+            break;
+        case CHIP8_OP_9XY0:
+            skip = vec_andnot(vec_cmpeq(vec_load(vx), vec_load(vy)), m);
+            break;
+        case CHIP8_OP_ANNN:
+            vec_blend16(i_lo, i_hi, m, nnn);
+            break;
+        case CHIP8_OP_BNNN:
+            vec_blend16(pc_lo, pc_hi, m, nnn - 2);
+            vec_add16(pc_lo, pc_hi, vec_and(m, vec_load(b->regs + start)));
+            break;
+        case CHIP8_OP_EX9E:
+        case CHIP8_OP_EXA1:
+            for (int k = 0; k < CHIP8_VEC_WIDTH; k++) {
+                pressed[k] = b->mask[start + k] && inputs[start + k].keys[vx[k] & 0xf] ? 0xff : 0x00;
+            }
+            skip = vec_load(pressed);
+            skip = ins->op == CHIP8_OP_EX9E ? skip : vec_andnot(skip, m);
+            break;
+        case CHIP8_OP_FX07:
+            vec_store(vx, vec_blend(m, vec_load(b->delay_timer + start), vec_load(vx)));
+            break;
+        case CHIP8_OP_FX15:
+            vec_store(b->delay_timer + start, vec_blend(m, vec_load(vx), vec_load(b->delay_timer + start)));
+            break;
+        case CHIP8_OP_FX18:
+            vec_store(b->sound_timer + start, vec_blend(m, vec_load(vx), vec_load(b->sound_timer + start)));
+            break;
+        case CHIP8_OP_FX1E:
+            vec_add16(i_lo, i_hi, vec_and(m, vec_load(vx)));
+            break;
+        case CHIP8_OP_FX29:
+        case CHIP8_OP_FX30:
+            for (int k = 0; k < CHIP8_VEC_WIDTH; k++) {
+                if (b->mask[start + k]) {
+                    uint16_t i = ins->op == CHIP8_OP_FX29 ? vx[k] * 5 : SUPER_DIGITS_OFFSET + vx[k] * 10;
+                    i_lo[k] = i & 0xff;
+                    i_hi[k] = i >> 8;
+                }
+            }
+            break;
+    }
+    chip8_vec_t two = vec_set1(2);
+    vec_add16(pc_lo, pc_hi, vec_add(vec_and(m, two), vec_and(skip, two)));
+}
+
+// Runs one lane through the scalar interpreter
+static void chip8_batch_execute_lane(chip8_batch_t *b, int lane, const chip8_keyboard_input_t *inputs) {
+    chip8_t *ch = b->lanes[lane];
+    chip8_batch_scatter(b, lane);
+    if (chip8_in_program(ch, ch->program_counter)) {
+        // code written by one lane must not be grouped with the others' without a check
+        const chip8_instr_t *ins = chip8_fetch(ch, ch->program_counter);
+        int len = ins->op == CHIP8_OP_FX33 ? 3 : ins->op == CHIP8_OP_FX55 ? ins->x + 1 : 0;
+        for (int addr = ch->i_reg; addr < ch->i_reg + len && addr < CHIP8_MEMORY_SIZE; addr++) {
+            b->modified[addr] = 1;
+        }
+    }
+    if (chip8_interpreters[ch->interpreter].execute(ch, &inputs[lane]) == CHIP8_STOP_ERROR) {
+        b->active[lane] = 0;
+        ch->cycle_count += b->cycle + 1;
+    }
+    chip8_batch_gather(b, lane);
+}
+
+#ifdef CHIP8_JIT_ENABLED
+// x86-64 basic block compiler. Blocks are straight-line runs of ALU, ANNN and
+// FX1E/FX29/FX30 instructions ending at 1NNN, BNNN or a skip. Everything
+// else (calls, memory writes, timers, input, drawing) is left to
+// chip8_execute, so compiled code never touches memory, the stack or timers
+// and the caller can apply the block's timer ticks once it returns.
+// The chip8_t pointer stays in rdi, rax/rcx/rdx are scratch.
+
+#define JIT_CODE_SIZE (256 * 1024)
+#define JIT_MAX_BLOCK_LEN 32
+#define JIT_MAX_INSTR_SIZE 64
+
+enum {
+    JIT_BLOCK_UNTRIED = 0,
+    JIT_BLOCK_READY,
+    JIT_BLOCK_UNCOMPILABLE
+};
+
+typedef void (*chip8_jit_fn)(chip8_t *ch);
+
+struct chip8_jit {
+    chip8_jit_mode_t mode;
+    uint8_t *code;              // never writable and executable at once
+    size_t code_used;
+    bool writable;              // code is mapped read-write for chip8_jit_compile, read-execute otherwise
+    chip8_jit_fn blocks[MEMORY_SIZE];
+    uint8_t block_state[MEMORY_SIZE];
+    uint8_t block_len[MEMORY_SIZE];
+    bool covered[MEMORY_SIZE];
+    int extent;                 // tables are clear from here on
+    chip8_t *shadow;
+};
+
+static struct chip8_jit* chip8_jit_make(chip8_jit_mode_t mode) {
+    struct chip8_jit *jit = calloc(1, sizeof(struct chip8_jit));
+    if (jit == NULL) {
+        return NULL;
+    }
+    jit->mode = mode;
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->writable = true;
+    if (mode == CHIP8_JIT_DIFFERENTIAL) {
+        jit->shadow = calloc(1, sizeof(chip8_t));
+        if (jit->shadow == NULL) {
+            munmap(jit->code, JIT_CODE_SIZE);
+            free(jit);
+            return NULL;
+        }
+        jit->shadow->xo_storage = XO_STORAGE_HEAP;
+    }
+    return jit;
+}
+
+static void chip8_jit_destroy(struct chip8_jit *jit) {
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->code, JIT_CODE_SIZE);
+    if (jit->shadow != NULL) {
+        free(jit->shadow->xo);
+    }
+    free(jit->shadow);
+    free(jit);
+}
+
+static void chip8_jit_flush(struct chip8_jit *jit) {
+    jit->code_used = 0;
+    memset(jit->blocks, 0, jit->extent * sizeof(jit->blocks[0]));
+    memset(jit->block_state, 0, jit->extent * sizeof(jit->block_state[0]));
+    memset(jit->covered, 0, jit->extent * sizeof(jit->covered[0]));
+    jit->extent = 0;
+}
+
+// Switches the code buffer between emitting and running blocks, only when
+// a block was compiled since the last run
+static bool chip8_jit_protect(struct chip8_jit *jit, bool writable) {
+    if (jit->writable == writable) {
+        return true;
+    }
+    if (mprotect(jit->code, JIT_CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0) {
+        return false;
+    }
+    jit->writable = writable;
+    return true;
+}
+
+static void chip8_jit_invalidate(struct chip8_jit *jit, int start, int end) {
+    if (end > jit->extent) {
+        end = jit->extent;
+    }
+    for (int i = start; i < end; i++) {
+        if (jit->covered[i]) {
+            chip8_jit_flush(jit);
+            return;
+        }
+    }
+}
+
+static bool chip8_jit_can_compile(uint8_t op) {
+    switch (op) {
+        case CHIP8_OP_00FD: case CHIP8_OP_0NNN:
+        case CHIP8_OP_1NNN: case CHIP8_OP_3XNN: case CHIP8_OP_4XNN: case CHIP8_OP_5XY0:
+        case CHIP8_OP_6XNN: case CHIP8_OP_7XNN: case CHIP8_OP_8XY0: case CHIP8_OP_8XY1:
+        case CHIP8_OP_8XY2: case CHIP8_OP_8XY3: case CHIP8_OP_8XY4: case CHIP8_OP_8XY5:
+        case CHIP8_OP_8XY6: case CHIP8_OP_8XY7: case CHIP8_OP_8XYE: case CHIP8_OP_9XY0:
+        case CHIP8_OP_ANNN: case CHIP8_OP_BNNN: case CHIP8_OP_FX1E: case CHIP8_OP_FX29:
+        case CHIP8_OP_FX30:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool chip8_jit_ends_block(uint8_t op) {
+    switch (op) {
+        case CHIP8_OP_1NNN: case CHIP8_OP_BNNN: case CHIP8_OP_3XNN: case CHIP8_OP_4XNN:
+        case CHIP8_OP_5XY0: case CHIP8_OP_9XY0:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void jit_byte(uint8_t **p, uint8_t b) {
+    *(*p)++ = b;
+}
+
+static void jit_u16(uint8_t **p, uint16_t v) {
+    jit_byte(p, v & 0xff);
+    jit_byte(p, v >> 8);
+}
+
+static void jit_u32(uint8_t **p, uint32_t v) {
+    jit_u16(p, v & 0xffff);
+    jit_u16(p, v >> 16);
+}
+
+// [rdi + disp32] operand with the given reg field
+static void jit_mem(uint8_t **p, int reg, size_t disp) {
+    jit_byte(p, 0x80 | (reg << 3) | 0x7);
+    jit_u32(p, (uint32_t)disp);
+}
+
+#define JIT_AL 0
+#define JIT_CL 1
+#define JIT_REG(x) (offsetof(chip8_t, regs) + (x))
+#define JIT_I_REG offsetof(chip8_t, i_reg)
+#define JIT_PC offsetof(chip8_t, program_counter)
+
+static void jit_load_al(uint8_t **p, size_t disp) { // mov al, [rdi+disp]
+    jit_byte(p, 0x8a);
+    jit_mem(p, JIT_AL, disp);
+}
+
+static void jit_store(uint8_t **p, int reg, size_t disp) { // mov [rdi+disp], r8
+    jit_byte(p, 0x88);
+    jit_mem(p, reg, disp);
+}
+
+static void jit_movzx_eax(uint8_t **p, size_t disp) { // movzx eax, byte [rdi+disp]
+    jit_byte(p, 0x0f);
+    jit_byte(p, 0xb6);
+    jit_mem(p, JIT_AL, disp);
+}
+
+static void jit_store_word(uint8_t **p, int reg, size_t disp) { // mov [rdi+disp], r16
+    jit_byte(p, 0x66);
+    jit_byte(p, 0x89);
+    jit_mem(p, reg, disp);
+}
+
+static void jit_set_pc(uint8_t **p, uint16_t pc) { // mov word [pc], imm16
+    jit_byte(p, 0x66);
+    jit_byte(p, 0xc7);
+    jit_mem(p, 0, JIT_PC);
+    jit_u16(p, pc);
+}
+
+// pc = flag ? skip_pc : next_pc, flag being the condition code of cmovcc
+static void jit_skip(uint8_t **p, uint8_t cmov_cc, uint16_t next_pc, uint16_t skip_pc) {
+    jit_byte(p, 0xb9); // mov ecx, next_pc
+    jit_u32(p, next_pc);
+    jit_byte(p, 0xba); // mov edx, skip_pc
+    jit_u32(p, skip_pc);
+    jit_byte(p, 0x0f); // cmovcc ecx, edx
+    jit_byte(p, cmov_cc);
+    jit_byte(p, 0xca);
+    jit_store_word(p, JIT_CL, JIT_PC);
+}
+
+// quirks are the QUIRK_* flags of the interpreter the block replaces
+static void chip8_jit_emit(uint8_t **p, const chip8_instr_t *ins, uint16_t addr, unsigned quirks) {
+    uint8_t x = ins->x;
+    uint8_t y = (ins->nnn >> 4) & 0xf;
+    uint8_t nn = ins->nnn & 0xff;
+    uint16_t nnn = ins->nnn;
+    switch (ins->op) {
+        case CHIP8_OP_00FD:
+        case CHIP8_OP_0NNN:
+            break;
+        case CHIP8_OP_1NNN:
+            jit_set_pc(p, nnn);
+            break;
+        case CHIP8_OP_3XNN:
+        case CHIP8_OP_4XNN:
+            jit_load_al(p, JIT_REG(x));
+            jit_byte(p, 0x3c); // cmp al, nn
+            jit_byte(p, nn);
+            jit_skip(p, ins->op == CHIP8_OP_3XNN ? 0x44 : 0x45, addr + 2, addr + 4);
+            break;
+        case CHIP8_OP_5XY0:
+        case CHIP8_OP_9XY0:
+            jit_load_al(p, JIT_REG(x));
+            jit_byte(p, 0x3a); // cmp al, vy
+            jit_mem(p, JIT_AL, JIT_REG(y));
+            jit_skip(p, ins->op == CHIP8_OP_5XY0 ? 0x44 : 0x45, addr + 2, addr + 4);
+            break;
+        case CHIP8_OP_6XNN:
+            jit_byte(p, 0xc6); // mov byte [vx], nn
+            jit_mem(p, 0, JIT_REG(x));
+            jit_byte(p, nn);
+            break;
+        case CHIP8_OP_7XNN:
+            jit_byte(p, 0x80); // add byte [vx], nn
+            jit_mem(p, 0, JIT_REG(x));
+            jit_byte(p, nn);
+            break;
+        case CHIP8_OP_8XY0:
+            jit_load_al(p, JIT_REG(y));
+            jit_store(p, JIT_AL, JIT_REG(x));
+            break;
+        case CHIP8_OP_8XY1:
+        case CHIP8_OP_8XY2:
+        case CHIP8_OP_8XY3:
+            jit_load_al(p, JIT_REG(y));
+            // or/and/xor [vx], al
+            jit_byte(p, ins->op == CHIP8_OP_8XY1 ? 0x08 : ins->op == CHIP8_OP_8XY2 ? 0x20 : 0x30);
+            jit_mem(p, JIT_AL, JIT_REG(x));
+            if (quirks & QUIRK_RESET_VF) {
+                jit_byte(p, 0xc6); // mov byte [vf], 0
+                jit_mem(p, 0, JIT_REG(0xf));
+                jit_byte(p, 0);
+            }
+            break;
+        case CHIP8_OP_8XY4:
+            jit_load_al(p, JIT_REG(x));
+            jit_byte(p, 0x02); // add al, vy
+            jit_mem(p, JIT_AL, JIT_REG(y));
+            jit_byte(p, 0x0f); // setc cl
+            jit_byte(p, 0x92);
+            jit_byte(p, 0xc1);
+            jit_store(p, JIT_AL, JIT_REG(x));
+            jit_store(p, JIT_CL, JIT_REG(0xf));
+            break;
+        case CHIP8_OP_8XY5:
+        case CHIP8_OP_8XY7: {
+            // VF is written before the subtraction reads its operands, as in chip8_execute
+            uint8_t a = ins->op == CHIP8_OP_8XY5 ? x : y;
+            uint8_t b = ins->op == CHIP8_OP_8XY5 ? y : x;
+            jit_load_al(p, JIT_REG(a));
+            jit_byte(p, 0x3a); // cmp al, vb
+            jit_mem(p, JIT_AL, JIT_REG(b));
+            jit_byte(p, 0x0f); // seta cl
+            jit_byte(p, 0x97);
+            jit_byte(p, 0xc1);
+            jit_store(p, JIT_CL, JIT_REG(0xf));
+            jit_load_al(p, JIT_REG(a));
+            jit_byte(p, 0x2a); // sub al, vb
+            jit_mem(p, JIT_AL, JIT_REG(b));
+            jit_store(p, JIT_AL, JIT_REG(x));
+            break;
+        }
+        case CHIP8_OP_8XY6: {
+            uint8_t src = quirks & QUIRK_SHIFT_VY ? y : x;
+            jit_load_al(p, JIT_REG(src));
+            jit_byte(p, 0x24); // and al, 1
+            jit_byte(p, 0x01);
+            jit_store(p, JIT_AL, JIT_REG(0xf));
+            jit_load_al(p, JIT_REG(src));
+            jit_byte(p, 0xd0); // shr al, 1
+            jit_byte(p, 0xe8);
+            jit_store(p, JIT_AL, JIT_REG(x));
+            break;
+        }
+        case CHIP8_OP_8XYE: {
+            uint8_t src = quirks & QUIRK_SHIFT_VY ? y : x;
+            jit_load_al(p, JIT_REG(src));
+            jit_byte(p, 0xc0); // shr al, 7
+            jit_byte(p, 0xe8);
+            jit_byte(p, 0x07);
+            jit_store(p, JIT_AL, JIT_REG(0xf));
+            jit_load_al(p, JIT_REG(src));
+            jit_byte(p, 0x00); // add al, al
+            jit_byte(p, 0xc0);
+            jit_store(p, JIT_AL, JIT_REG(x));
+            break;
+        }
+        case CHIP8_OP_ANNN:
+            jit_byte(p, 0x66); // mov word [i], nnn
+            jit_byte(p, 0xc7);
+            jit_mem(p, 0, JIT_I_REG);
+            jit_u16(p, nnn);
+            break;
+        case CHIP8_OP_BNNN:
+            jit_movzx_eax(p, JIT_REG(quirks & QUIRK_JUMP_VX ? x : 0));
+            jit_byte(p, 0x05); // add eax, nnn
+            jit_u32(p, nnn);
+            jit_store_word(p, JIT_AL, JIT_PC);
+            break;
+        case CHIP8_OP_FX1E:
+            jit_movzx_eax(p, JIT_REG(x));
+            jit_byte(p, 0x66); // add [i], ax
+            jit_byte(p, 0x01);
+            jit_mem(p, JIT_AL, JIT_I_REG);
+            break;
+        case CHIP8_OP_FX29:
+        case CHIP8_OP_FX30:
+            jit_movzx_eax(p, JIT_REG(x));
+            jit_byte(p, 0x8d); // lea eax, [rax + rax * 4]
+            jit_byte(p, 0x04);
+            jit_byte(p, 0x80);
+            if (ins->op == CHIP8_OP_FX30) {
+                jit_byte(p, 0x01); // add eax, eax
+                jit_byte(p, 0xc0);
+                jit_byte(p, 0x05); // add eax, SUPER_DIGITS_OFFSET
+                jit_u32(p, SUPER_DIGITS_OFFSET);
+            }
+            jit_store_word(p, JIT_AL, JIT_I_REG);
+            break;
+    }
+}
+
+static void chip8_jit_compile(chip8_t *ch, uint16_t start) {
+    struct chip8_jit *jit = ch->jit;
+    if (!chip8_jit_protect(jit, true)) {
+        jit->block_state[start] = JIT_BLOCK_UNCOMPILABLE;
+        return;
+    }
+    if (JIT_CODE_SIZE - jit->code_used < JIT_MAX_BLOCK_LEN * JIT_MAX_INSTR_SIZE) {
+        chip8_jit_flush(jit);
+    }
+    uint8_t *entry = jit->code + jit->code_used;
+    uint8_t *p = entry;
+    uint16_t addr = start;
+    int len = 0;
+    bool terminated = false;
+    while (len < JIT_MAX_BLOCK_LEN && chip8_in_program(ch, addr)) {
+        const chip8_instr_t *ins = chip8_fetch(ch, addr);
+        if (!chip8_jit_can_compile(ins->op)) {
+            break;
+        }
+        bool skip = chip8_jit_ends_block(ins->op) && ins->op != CHIP8_OP_1NNN && ins->op != CHIP8_OP_BNNN;
+        if (ch->xochip && skip && chip8_in_program(ch, addr + 2)) {
+            // the skip's length depends on the next instruction, which must not change under it
+            if (chip8_xo(ch)->memory[addr + 2] == 0xf0 && chip8_xo(ch)->memory[addr + 3] == 0x00) {
+                break;
+            }
+            jit->covered[addr + 2] = true;
+            jit->covered[addr + 3] = true;
+        }
+        chip8_jit_emit(&p, ins, addr, chip8_interpreters[ch->interpreter].flags);
+        jit->covered[addr] = true;
+        jit->covered[addr + 1] = true;
+        len++;
+        addr += 2;
+        if (chip8_jit_ends_block(ins->op)) {
+            terminated = true;
+            break;
+        }
+    }
+    if (addr + 2 > jit->extent) {
+        jit->extent = addr + 2;
+    }
+    if (len == 0) {
+        jit->block_state[start] = JIT_BLOCK_UNCOMPILABLE;
+        return;
+    }
+    if (!terminated) {
+        jit_set_pc(&p, addr);
+    }
+    jit_byte(&p, 0xc3); // ret
+    jit->code_used += p - entry;
+    jit->blocks[start] = (chip8_jit_fn)entry;
+    jit->block_len[start] = len;
+    jit->block_state[start] = JIT_BLOCK_READY;
+}
+
+static bool chip8_jit_matches(const chip8_t *a, const chip8_t *b) {
+    return memcmp(a->regs, b->regs, sizeof(a->regs)) == 0 &&
+        a->i_reg == b->i_reg &&
+        a->program_counter == b->program_counter &&
+        a->stack_pointer == b->stack_pointer &&
+        a->delay_timer == b->delay_timer &&
+        a->sound_timer == b->sound_timer &&
+        a->timer_counter == b->timer_counter;
+}
+
+// Returns the number of instructions executed, 0 if the interpreter has to
+// execute the next instruction and -1 if differential mode found a mismatch.
+static int chip8_jit_run_block(chip8_t *ch, int max_cycles) {
+    struct chip8_jit *jit = ch->jit;
+    uint16_t pc = ch->program_counter;
+    if (!chip8_in_program(ch, pc)) {
+        return 0;
+    }
+    if (jit->block_state[pc] == JIT_BLOCK_UNTRIED) {
+        chip8_jit_compile(ch, pc);
+    }
+    if (jit->block_state[pc] != JIT_BLOCK_READY || jit->block_len[pc] > max_cycles || !chip8_jit_protect(jit, false)) {
+        return 0;
+    }
+    int len = jit->block_len[pc];
+    if (jit->mode == CHIP8_JIT_DIFFERENTIAL) {
+        chip8_keyboard_input_t no_input = {0};
+        chip8_t *shadow = jit->shadow;
+        if (ch->xochip && !chip8_reserve_xo(shadow)) {
+            return 0;
+        }
+        chip8_copy_machine(shadow, ch);
+        memcpy(shadow->display, ch->display, sizeof(shadow->display));
+        // only the used part of memory and the decode cache
+        memcpy(chip8_memory(shadow), chip8_memory(ch), chip8_memory_end(ch));
+        memcpy(chip8_decoded(shadow), chip8_decoded(ch), ch->memory_size * sizeof(chip8_instr_t));
+        chip8_stop_reason_t reason;
+        for (int i = 0; i < len; i++) {
+            chip8_interpreters[shadow->interpreter].run(shadow, &no_input, 1, 0, &reason);
+        }
+    }
+    jit->blocks[pc](ch);
+    chip8_advance_timers(ch, len);
+    ch->cycle_count += len;
+    if (jit->mode == CHIP8_JIT_DIFFERENTIAL && !chip8_jit_matches(ch, jit->shadow)) {
+        return -1;
+    }
+    return len;
 }
+#endif
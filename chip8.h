@@ -22,21 +22,282 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef struct chip8 chip8_t;
+typedef struct chip8_rewind chip8_rewind_t;
+typedef struct chip8_batch chip8_batch_t;
+typedef struct chip8_audio_ring chip8_audio_ring_t;
 
 typedef struct chip8_keyboard_input {
     bool keys[16];
 } chip8_keyboard_input_t;
 
+typedef enum chip8_stop_reason {
+    CHIP8_STOP_BUDGET = 0,  // max_cycles executed
+    CHIP8_STOP_WAIT_KEY,    // FX0A is waiting for a key press
+    CHIP8_STOP_DISPLAY,     // display contents or mode changed
+    CHIP8_STOP_BEEP,        // sound timer went from 0 to non-zero
+    CHIP8_STOP_ERROR,       // invalid opcode or out of range access
+} chip8_stop_reason_t;
+
+typedef enum chip8_idle_state {
+    CHIP8_IDLE_NONE = 0,        // not in a recognised idle loop
+    CHIP8_IDLE_WAIT_KEY,        // FX0A is waiting for a key press
+    CHIP8_IDLE_WAIT_TIMER,      // polling the delay timer in a loop, or DXYN waiting for the next timer period
+    CHIP8_IDLE_HALTED,          // looping forever, only input changes can matter
+} chip8_idle_state_t;
+
+typedef enum chip8_variant {
+    CHIP8_VARIANT_SCHIP = 0,    // CHIP-8 with the SUPER-CHIP extensions, 4 KB of memory
+    CHIP8_VARIANT_XOCHIP,       // 64 KB of memory, two bitplanes and audio patterns
+} chip8_variant_t;
+
+// Behaviour of the instructions interpreters disagree on
+typedef enum chip8_quirks {
+    CHIP8_QUIRKS_DEFAULT = 0,   // shifts change VX in place, 00FA toggles the FX55/FX65 I increment, sprites wrap
+    CHIP8_QUIRKS_CHIP8,         // COSMAC VIP: shifts read VY, FX55/FX65 increment I, 8XY1-8XY3 reset VF,
+                                // sprites clip and DXYN waits for the next timer period
+    CHIP8_QUIRKS_SCHIP,         // SUPER-CHIP 1.1: shifts change VX in place, BXNN jumps to XNN + VX, sprites clip
+    CHIP8_QUIRKS_XOCHIP,        // shifts read VY, FX55/FX65 increment I, sprites wrap
+} chip8_quirks_t;
+
+typedef struct chip8_dirty_region {
+    uint64_t rows;      // bit y is set if row y changed
+    uint16_t columns;   // bit c is set if pixels c * 8 to c * 8 + 7 changed in any row
+} chip8_dirty_region_t;
+
+#define CHIP8_NUM_OP_CLASSES 52
+#define CHIP8_STATS_HOT_PCS 16
+
+typedef struct chip8_stats {
+    uint64_t instructions;
+    uint64_t op_counts[CHIP8_NUM_OP_CLASSES];   // see chip8_op_class_name
+    uint16_t hot_pcs[CHIP8_STATS_HOT_PCS];      // most executed addresses, hottest first
+    uint64_t hot_pc_counts[CHIP8_STATS_HOT_PCS];
+    int num_hot_pcs;
+    int max_stack_depth;
+    uint64_t sprites_drawn;
+    uint64_t pixels_drawn;                      // pixels DXYN XORed onto the selected planes, after clipping
+    uint64_t collisions;                        // sprites that set VF
+} chip8_stats_t;
+
+typedef struct chip8_audio_stats {
+    size_t buffered_samples;    // written and not read yet
+    uint64_t underrun_samples;  // silence returned because the ring was empty
+    uint64_t overrun_samples;   // dropped because the ring was full
+} chip8_audio_stats_t;
+
+#define CHIP8_TRACE_RING_SIZE 4096
+#define CHIP8_TRACE_NO_REG 0xff
+
+typedef struct chip8_trace_record {
+    uint64_t cycle;             // chip8_get_cycle_count after the instruction
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t i_reg;             // after the instruction
+    uint8_t reg;                // register the instruction wrote, CHIP8_TRACE_NO_REG if none
+    uint8_t value;              // its value afterwards
+} chip8_trace_record_t;
+
+typedef struct chip8_replay_result {
+    bool ok;                    // every hash matched up to the end of the recording
+    bool error;                 // malformed or truncated recording
+    uint64_t cycles;            // cycles replayed
+    int checkpoints;            // hashes compared
+    uint64_t last_good_cycle;   // cycle of the last matching hash
+    uint64_t diverged_cycle;    // cycle of the first mismatching hash, 0 if none
+} chip8_replay_result_t;
+
+typedef enum chip8_jit_mode {
+    CHIP8_JIT_OFF = 0,
+    CHIP8_JIT_ON,
+    CHIP8_JIT_DIFFERENTIAL, // runs the interpreter alongside and fails on any mismatch
+} chip8_jit_mode_t;
+
 chip8_t* chip8_make(void);
 void chip8_destroy(chip8_t *ch);
+// For instances in caller-managed memory: chip8_init sets up
+// chip8_state_size(variant) bytes at buf, aligned for any type, and
+// chip8_deinit releases what the instance holds without freeing buf. Only
+// CHIP8_VARIANT_XOCHIP instances have room for 64 KB programs, others
+// can't switch to that variant. An instance holds no pointers into itself,
+// so it can be moved or cloned with memcpy while it has no recording,
+// trace, audio ring or JIT, and no XO-CHIP extension chip8_make allocated
+// for it; a clone would share these and both copies would free them.
+size_t chip8_state_size(chip8_variant_t variant);
+chip8_t* chip8_init(void *buf, chip8_variant_t variant);
+void chip8_deinit(chip8_t *ch);
+// Makes child an exact copy of parent. Memory and the display are tracked
+// in 256-byte pages, and forking the same parent into the same child again
+// only copies the pages either of them wrote since the last fork, so one
+// child can be reused for many short branches. The first fork into a
+// child, or one from another parent, copies everything. Parents are told
+// apart by address too, so a memcpy clone or a moved parent also gets a
+// full copy. Fails if child is recording or has no room for the parent's
+// XO-CHIP memory. A parent overwritten in place with memcpy must not be
+// forked into children it had before, chip8_load_state is fine.
+bool chip8_fork(chip8_t *parent, chip8_t *child);
+// Resets the machine, except for the RNG, and loads a program at 0x200.
+// Loading into a used instance of the same variant only rewrites the memory
+// pages and display rows the previous program wrote, so reusing one
+// instance for many short runs is cheap.
 bool chip8_load_program(chip8_t *ch, unsigned char *program, size_t size);
+// Applied by the next chip8_load_program, CHIP8_VARIANT_SCHIP by default.
+// Fails for CHIP8_VARIANT_XOCHIP on a chip8_init instance set up without
+// room for it. chip8_get_variant returns the variant of the loaded program.
+bool chip8_set_variant(chip8_t *ch, chip8_variant_t variant);
+chip8_variant_t chip8_get_variant(chip8_t *ch);
+// Applied by the next chip8_load_program, CHIP8_QUIRKS_DEFAULT by default.
+// chip8_get_quirks returns the quirks of the loaded program.
+bool chip8_set_quirks(chip8_t *ch, chip8_quirks_t quirks);
+chip8_quirks_t chip8_get_quirks(chip8_t *ch);
 bool chip8_cpu_tick(chip8_t *ch, const chip8_keyboard_input_t *input);
+int chip8_run_cycles(chip8_t *ch, const chip8_keyboard_input_t *input, int max_cycles, chip8_stop_reason_t *out_reason);
+bool chip8_run_frame(chip8_t *ch, const chip8_keyboard_input_t *input); // one timer period, see chip8_get_timer_period
+uint64_t chip8_get_cycle_count(chip8_t *ch); // instructions executed since chip8_load_program
+int chip8_get_timer_period(chip8_t *ch); // cycles per 60 Hz timer decrement
+// chip8_run_cycles and chip8_run_frame skip over loops that only wait for
+// a key or the delay timer. This reports whether the program is in such a
+// loop, so hosts can stop running it until its input changes. out_cycles
+// (may be NULL) is set to about how many cycles a WAIT_TIMER loop has left.
+chip8_idle_state_t chip8_get_idle_state(chip8_t *ch, uint64_t *out_cycles);
+// Skipping idle loops is on by default. With it off every cycle counted by
+// chip8_run_cycles was executed, e.g. for timing the interpreter.
+void chip8_set_idle_skip(chip8_t *ch, bool enabled);
+// Versioned binary snapshot of the whole machine. chip8_save_state returns
+// the number of bytes written, the required size if buf is NULL or 0 if
+// size is too small. chip8_load_state fails for an XO-CHIP snapshot on an
+// instance without room for one.
+size_t chip8_save_state(chip8_t *ch, void *buf, size_t size);
+bool chip8_load_state(chip8_t *ch, const void *buf, size_t size);
+
+// Streams a snapshot of the current state followed by every input change
+// passed to chip8_cpu_tick, chip8_run_cycles or chip8_run_frame, stamped with
+// its cycle, and a state hash every hash_interval cycles (0 for none).
+// chip8_replay runs a whole recording headless as fast as possible and
+// checks every hash. data is the complete file, e.g. mapped with mmap.
+bool chip8_start_recording(chip8_t *ch, FILE *fp, uint64_t hash_interval);
+bool chip8_stop_recording(chip8_t *ch);
+bool chip8_replay(const void *data, size_t size, chip8_jit_mode_t jit_mode, chip8_replay_result_t *out_result);
+
+// Rewind history holding up to capacity bytes of delta-compressed snapshots.
+// chip8_rewind_pop restores the newest snapshot and drops it.
+chip8_rewind_t* chip8_rewind_make(size_t capacity);
+void chip8_rewind_destroy(chip8_rewind_t *rw);
+bool chip8_rewind_push(chip8_rewind_t *rw, chip8_t *ch);
+bool chip8_rewind_pop(chip8_rewind_t *rw, chip8_t *ch);
+size_t chip8_rewind_count(chip8_rewind_t *rw);
+
+// Mono 16-bit square wave samples, sample_rate per second of emulated time
+// (60 timer periods), written while the sound timer is non-zero and as
+// silence otherwise. XO-CHIP programs that load an audio pattern (F002)
+// play it at the FX3A pitch instead. They are generated by chip8_cpu_tick, chip8_run_cycles
+// and chip8_run_frame. The ring has one producer (the emulation thread) and
+// one consumer, e.g. an audio callback, and neither side locks or allocates.
+// chip8_audio_ring_read fills the part of out it couldn't read with silence.
+chip8_audio_ring_t* chip8_audio_ring_make(size_t capacity); // in samples, rounded up to a power of two
+void chip8_audio_ring_destroy(chip8_audio_ring_t *ring);
+size_t chip8_audio_ring_read(chip8_audio_ring_t *ring, int16_t *out, size_t count);
+size_t chip8_audio_ring_buffered(chip8_audio_ring_t *ring);
+void chip8_audio_ring_get_stats(chip8_audio_ring_t *ring, chip8_audio_stats_t *out_stats);
+bool chip8_set_audio(chip8_t *ch, chip8_audio_ring_t *ring, int sample_rate, int tone_hz); // NULL ring to stop
+
+// CXNN uses a per-instance generator, seeded with 0 by chip8_make
+void chip8_seed_rng(chip8_t *ch, uint64_t seed);
+bool chip8_set_jit(chip8_t *ch, chip8_jit_mode_t mode); // requires CHIP8_JIT and x86-64
+// Execution counters since the last chip8_reset_stats. They are only collected
+// when built with CHIP8_PROFILE, chip8_get_stats returns false otherwise.
+bool chip8_get_stats(chip8_t *ch, chip8_stats_t *out_stats);
+void chip8_reset_stats(chip8_t *ch);
+// Binary execution trace, only available when built with CHIP8_TRACE
+// (chip8_start_trace returns false otherwise). Every instruction the
+// interpreter runs is stored in a ring of CHIP8_TRACE_RING_SIZE records and
+// each full ring is written to fp in one go. With a NULL fp the ring only
+// keeps the latest records for chip8_get_trace. The JIT is bypassed while
+// tracing, idle loops skipped by chip8_run_cycles leave a gap in the cycle
+// numbers and batch lanes aren't traced. chip8_stop_trace writes the rest of
+// the ring and returns false if any write failed.
+bool chip8_start_trace(chip8_t *ch, FILE *fp);
+size_t chip8_get_trace(chip8_t *ch, chip8_trace_record_t *out_records, size_t max_records); // latest, oldest first
+bool chip8_stop_trace(chip8_t *ch);
+const char* chip8_op_class_name(int op_class); // "8XY4" etc.
+// Writes the instruction at code, e.g. "LD V1, 0x2A", to buf and returns its
+// length: 4 for F000 NNNN, 2 otherwise and 0 if size is too small. Unknown
+// opcodes are written as "DW 0xXXXX".
+size_t chip8_disassemble(const uint8_t *code, size_t size, char *buf, size_t buf_size);
+// Reads a sidecar written by analyse.c, false if it was made for another
+// program. Decodes every instruction the analyser reached and, for programs
+// it proved never store to their own code, skips the self-modification
+// checks of FX55/FX33/5XY2 until the next load.
+bool chip8_load_analysis(chip8_t *ch, const char *text, size_t size);
 bool chip8_should_beep(chip8_t *ch);
 int chip8_get_width(chip8_t *ch);
 int chip8_get_height(chip8_t *ch);
 bool chip8_get_pixel(chip8_t *ch, int x, int y);
 int chip8_is_super(chip8_t *ch);
 
+// Display changes since the last chip8_acknowledge_dirty, false if there were none.
+// The frame generation is bumped whenever the display changes.
+uint32_t chip8_get_frame_generation(chip8_t *ch);
+bool chip8_get_dirty_region(chip8_t *ch, chip8_dirty_region_t *out_region);
+bool chip8_get_dirty_rect(chip8_t *ch, int *out_x, int *out_y, int *out_width, int *out_height);
+void chip8_acknowledge_dirty(chip8_t *ch);
+
+// Packed 1bpp display, chip8_get_height rows of out_row_stride words.
+// Bit 63 of a row's first word is its leftmost pixel. XO-CHIP programs draw
+// to chip8_get_num_planes bitplanes laid out the same way, the framebuffer
+// is plane 0. chip8_get_pixel is true if the pixel is set in any plane.
+const uint64_t* chip8_get_framebuffer(chip8_t *ch, size_t *out_row_stride);
+int chip8_get_num_planes(chip8_t *ch);
+const uint64_t* chip8_get_plane(chip8_t *ch, int plane, size_t *out_row_stride);
+
+// Expand the display into width * scale by height * scale pixels, pitch is in bytes.
+// Pixels set in any plane get the on colour.
+void chip8_render_rgba(chip8_t *ch, uint32_t *pixels, size_t pitch, int scale, uint32_t on_color, uint32_t off_color);
+void chip8_render_8bit(chip8_t *ch, uint8_t *pixels, size_t pitch, int scale, uint8_t on_value, uint8_t off_value);
+// Same with the planes composited, a pixel gets palette[p] where bit n of p
+// is its value in plane n.
+void chip8_render_planes_rgba(chip8_t *ch, uint32_t *pixels, size_t pitch, int scale, const uint32_t palette[4]);
+void chip8_render_planes_8bit(chip8_t *ch, uint8_t *pixels, size_t pitch, int scale, const uint8_t palette[4]);
+// Only the rect at x, y of width by height display pixels, e.g. from
+// chip8_get_dirty_rect, drawn at its scaled position in pixels. The rest of
+// pixels is left as it was.
+void chip8_render_planes_rect_rgba(chip8_t *ch, uint32_t *pixels, size_t pitch, int scale, const uint32_t palette[4], int x, int y, int width, int height);
+void chip8_render_planes_rect_8bit(chip8_t *ch, uint8_t *pixels, size_t pitch, int scale, const uint8_t palette[4], int x, int y, int width, int height);
+
+// The display as bytes for sending elsewhere: both planes of 64 rows of 16
+// bytes, the leftmost pixel in the top bit. Lores programs only use the first
+// 8 bytes of the first 32 rows. chip8_encode_frame_delta writes frame XOR
+// prev_frame, run-length encoded, to out_delta (at most
+// CHIP8_FRAME_DELTA_MAX_SIZE bytes) and returns its size.
+// chip8_apply_frame_delta turns prev_frame into frame and returns false for
+// a malformed delta.
+#define CHIP8_FRAME_SIZE 2048
+#define CHIP8_FRAME_DELTA_MAX_SIZE (2 * CHIP8_FRAME_SIZE + 16)
+void chip8_get_frame(chip8_t *ch, uint8_t *out_frame);
+size_t chip8_encode_frame_delta(const uint8_t *prev_frame, const uint8_t *frame, uint8_t *out_delta);
+bool chip8_apply_frame_delta(uint8_t *frame, const uint8_t *delta, size_t size);
+
+// Many instances of one program stepped in lockstep, with results identical
+// to running each lane on its own. Batches run CHIP8_VARIANT_SCHIP programs with
+// CHIP8_QUIRKS_DEFAULT, a lane switched to another variant or quirks through
+// chip8_batch_get_lane fails. inputs holds one entry per lane. A lane
+// stops when it fails, chip8_batch_run_cycles returns the number still running.
+chip8_batch_t* chip8_batch_make(int num_lanes);
+void chip8_batch_destroy(chip8_batch_t *b);
+bool chip8_batch_load_program(chip8_batch_t *b, unsigned char *program, size_t size);
+int chip8_batch_run_cycles(chip8_batch_t *b, const chip8_keyboard_input_t *inputs, int num_cycles);
+int chip8_batch_get_num_lanes(chip8_batch_t *b);
+bool chip8_batch_lane_failed(chip8_batch_t *b, int lane);
+// The lane as a regular instance, up to date until the next
+// chip8_batch_run_cycles. Changes made through it are picked up by that call.
+chip8_t* chip8_batch_get_lane(chip8_batch_t *b, int lane);
+// Displays of all lanes, each 64 rows of 2 words laid out like chip8_get_framebuffer.
+// out must hold num_lanes * 128 words.
+void chip8_batch_get_framebuffers(chip8_batch_t *b, uint64_t *out);
+// Save states of all lanes back to back, same return values as chip8_save_state.
+size_t chip8_batch_save_states(chip8_batch_t *b, void *buf, size_t size);
+
 #endif /* chip8_h */
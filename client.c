@@ -0,0 +1,429 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Local client for server.c (Linux).
+
+    Usage: client [-s socket_path] [-n sessions] [-t seconds] [-xo] [-q quirks]
+                  [-i input_script] [-show] [-verify] rom
+
+    Opens sessions running rom (session i seeds its generator with i) and
+    applies the frame deltas the server streams back for -t seconds, 10 by
+    default. input_script is a file of "frame keymask" lines like
+    batch_runner's, the hex key mask is sent to every session once that many
+    60 Hz frames have passed. -show draws the display of the first session
+    in the terminal.
+
+    At the end, prints the number of frames and bytes received. -verify runs
+    every session locally up to the last frame it got and checks that the
+    decoded display is the same, which only holds without an input script.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "chip8.h"
+#include "server.h"
+
+#define MAX_LINE 4096
+#define MAX_EVENTS 65536
+#define MAX_EPOLL_EVENTS 256
+#define READ_BUF_SIZE (64 * 1024)
+
+typedef struct input_event {
+    uint64_t frame;
+    uint16_t keys;
+} input_event_t;
+
+typedef struct session {
+    int fd;
+    bool open;
+    bool stopped;               // the server sent STOP
+    uint32_t frame_number;      // of the last FRAME
+    int width;
+    int height;
+    int planes;
+    uint8_t frame[CHIP8_FRAME_SIZE];
+    uint8_t *in_buf;
+    size_t in_len;
+    uint64_t frames;
+    uint64_t bytes;
+} session_t;
+
+static int connect_to(const char *path);
+static bool send_message(int fd, uint8_t type, const uint8_t *payload, size_t size);
+static bool read_session(session_t *s, bool show);
+static bool handle_message(session_t *s, uint8_t type, const uint8_t *payload, size_t size, bool show);
+static void draw(const session_t *s);
+static bool verify(const session_t *s, unsigned char *program, size_t program_size, chip8_variant_t variant, chip8_quirks_t quirks, uint64_t seed);
+static int read_input_script(const char *path, input_event_t *events, int max_events);
+static unsigned char* read_file(const char *filename, size_t *out_size);
+static void put_u32(uint8_t *p, uint32_t v);
+static uint32_t get_u32(const uint8_t *p);
+static double now_ms(void);
+
+int main(int argc, char *argv[]) {
+    const char *path = SERVER_DEFAULT_SOCKET;
+    const char *rom_path = NULL;
+    const char *input_path = NULL;
+    int num_sessions = 1;
+    double seconds = 10;
+    chip8_variant_t variant = CHIP8_VARIANT_SCHIP;
+    chip8_quirks_t quirks = CHIP8_QUIRKS_DEFAULT;
+    bool show = false;
+    bool check = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            num_sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            quirks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            input_path = argv[++i];
+        } else if (strcmp(argv[i], "-xo") == 0) {
+            variant = CHIP8_VARIANT_XOCHIP;
+        } else if (strcmp(argv[i], "-show") == 0) {
+            show = true;
+        } else if (strcmp(argv[i], "-verify") == 0) {
+            check = true;
+        } else {
+            rom_path = argv[i];
+        }
+    }
+    if (rom_path == NULL || num_sessions < 1) {
+        printf("Usage: %s [-s socket_path] [-n sessions] [-t seconds] [-xo] [-q quirks] [-i input_script] [-show] [-verify] rom\n", argv[0]);
+        return 1;
+    }
+
+    size_t program_size;
+    unsigned char *program = read_file(rom_path, &program_size);
+    if (program == NULL || program_size > 0x10000) {
+        printf("Reading %s failed\n", rom_path);
+        return 1;
+    }
+    input_event_t *events = malloc(sizeof(input_event_t) * MAX_EVENTS);
+    int num_events = 0;
+    if (input_path != NULL) {
+        num_events = read_input_script(input_path, events, MAX_EVENTS);
+        if (num_events < 0) {
+            printf("Reading %s failed\n", input_path);
+            return 1;
+        }
+    }
+
+    int epoll_fd = epoll_create1(0);
+    session_t *sessions = calloc(num_sessions, sizeof(session_t));
+    uint8_t *load = malloc(SERVER_LOAD_SIZE + program_size);
+    load[0] = variant;
+    load[1] = quirks;
+    memcpy(load + SERVER_LOAD_SIZE, program, program_size);
+    for (int i = 0; i < num_sessions; i++) {
+        session_t *s = &sessions[i];
+        s->fd = connect_to(path);
+        s->in_buf = malloc(READ_BUF_SIZE);
+        uint64_t seed = i;
+        put_u32(load + 2, (uint32_t)seed);
+        put_u32(load + 6, (uint32_t)(seed >> 32));
+        if (s->fd < 0 || s->in_buf == NULL || !send_message(s->fd, SERVER_MSG_LOAD, load, SERVER_LOAD_SIZE + program_size)) {
+            printf("Connecting to %s failed: %s\n", path, strerror(errno));
+            return 1;
+        }
+        s->open = true;
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd, &ev);
+    }
+    free(load);
+    if (show) {
+        printf("\x1b[2J");
+    }
+
+    double start = now_ms();
+    int next_event = 0;
+    int num_open = num_sessions;
+    struct epoll_event ready[MAX_EPOLL_EVENTS];
+    while (num_open > 0) {
+        double elapsed = now_ms() - start;
+        if (elapsed >= seconds * 1000) {
+            break;
+        }
+        while (next_event < num_events && events[next_event].frame * 1000.0 / 60 <= elapsed) {
+            uint8_t keys[2] = {events[next_event].keys & 0xff, events[next_event].keys >> 8};
+            for (int i = 0; i < num_sessions; i++) {
+                if (sessions[i].open) {
+                    send_message(sessions[i].fd, SERVER_MSG_KEYS, keys, sizeof(keys));
+                }
+            }
+            next_event++;
+        }
+        int n = epoll_wait(epoll_fd, ready, MAX_EPOLL_EVENTS, 1000 / 60);
+        for (int i = 0; i < n; i++) {
+            session_t *s = ready[i].data.ptr;
+            if (s->open && !read_session(s, show && s == &sessions[0])) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+                s->open = false;
+                num_open--;
+            }
+        }
+    }
+    double elapsed = now_ms() - start;
+
+    uint64_t frames = 0, bytes = 0;
+    int stopped = 0, closed = 0, mismatches = 0;
+    for (int i = 0; i < num_sessions; i++) {
+        session_t *s = &sessions[i];
+        frames += s->frames;
+        bytes += s->bytes;
+        stopped += s->stopped;
+        closed += !s->open && !s->stopped;
+        if (check && !s->stopped && !verify(s, program, program_size, variant, quirks, i)) {
+            printf("session %d: display after frame %u differs from a local run\n", i, s->frame_number);
+            mismatches++;
+        }
+        close(s->fd);
+        free(s->in_buf);
+    }
+    printf("%d sessions, %llu frames in %.1f s (%.0f/s), %.1f bytes per frame, %d stopped, %d closed",
+           num_sessions, (unsigned long long)frames, elapsed / 1000, frames * 1000.0 / elapsed,
+           frames ? (double)bytes / frames : 0.0, stopped, closed);
+    if (check) {
+        printf(", %d of %d verified", num_sessions - stopped - mismatches, num_sessions - stopped);
+    }
+    printf("\n");
+    free(sessions);
+    free(events);
+    free(program);
+    return mismatches > 0;
+}
+
+// Returns false once the connection is closed
+static bool read_session(session_t *s, bool show) {
+    ssize_t n = read(s->fd, s->in_buf + s->in_len, READ_BUF_SIZE - s->in_len);
+    if (n <= 0) {
+        return n < 0 && errno == EINTR;
+    }
+    s->in_len += n;
+    size_t pos = 0;
+    while (s->in_len - pos >= SERVER_HEADER_SIZE) {
+        uint32_t size = get_u32(s->in_buf + pos + 1);
+        if (size > READ_BUF_SIZE - SERVER_HEADER_SIZE) {
+            return false;
+        }
+        if (s->in_len - pos < SERVER_HEADER_SIZE + size) {
+            break;
+        }
+        if (!handle_message(s, s->in_buf[pos], s->in_buf + pos + SERVER_HEADER_SIZE, size, show)) {
+            return false;
+        }
+        s->bytes += SERVER_HEADER_SIZE + size;
+        pos += SERVER_HEADER_SIZE + size;
+    }
+    memmove(s->in_buf, s->in_buf + pos, s->in_len - pos);
+    s->in_len -= pos;
+    return true;
+}
+
+static bool handle_message(session_t *s, uint8_t type, const uint8_t *payload, size_t size, bool show) {
+    switch (type) {
+        case SERVER_MSG_FRAME:
+            if (size < SERVER_FRAME_SIZE ||
+                !chip8_apply_frame_delta(s->frame, payload + SERVER_FRAME_SIZE, size - SERVER_FRAME_SIZE)) {
+                return false;
+            }
+            s->frame_number = get_u32(payload);
+            s->width = payload[4];
+            s->height = payload[5];
+            s->planes = payload[6];
+            s->frames++;
+            if (show) {
+                draw(s);
+            }
+            return true;
+        case SERVER_MSG_STOP:
+            s->stopped = true;
+            return false;
+        default:
+            return false;
+    }
+}
+
+// Two rows per line of text, pixels set in any plane are drawn
+static void draw(const session_t *s) {
+    static const char *blocks[4] = {" ", "\xe2\x96\x80", "\xe2\x96\x84", "\xe2\x96\x88"};
+    char text[64 + 32 * (128 * 3 + 1)];
+    size_t len = snprintf(text, sizeof(text), "\x1b[Hframe %u\n", s->frame_number);
+    const int row_bytes = CHIP8_FRAME_SIZE / 2 / 64;
+    for (int y = 0; y < s->height; y += 2) {
+        for (int x = 0; x < s->width; x++) {
+            int cell = 0;
+            for (int dy = 0; dy < 2; dy++) {
+                for (int p = 0; p < s->planes; p++) {
+                    uint8_t byte = s->frame[p * CHIP8_FRAME_SIZE / 2 + (y + dy) * row_bytes + x / 8];
+                    if ((byte >> (7 - x % 8)) & 1) {
+                        cell |= 1 << dy;
+                    }
+                }
+            }
+            size_t n = strlen(blocks[cell]);
+            memcpy(text + len, blocks[cell], n);
+            len += n;
+        }
+        text[len++] = '\n';
+    }
+    fwrite(text, 1, len, stdout);
+    fflush(stdout);
+}
+
+static bool verify(const session_t *s, unsigned char *program, size_t program_size, chip8_variant_t variant, chip8_quirks_t quirks, uint64_t seed) {
+    chip8_t *ch = chip8_make();
+    if (ch == NULL) {
+        return false;
+    }
+    chip8_set_variant(ch, variant);
+    chip8_set_quirks(ch, quirks);
+    bool ok = chip8_load_program(ch, program, program_size);
+    chip8_seed_rng(ch, seed);
+    chip8_keyboard_input_t input = {0};
+    for (uint32_t i = 0; ok && i < s->frame_number; i++) {
+        ok = chip8_run_frame(ch, &input);
+    }
+    uint8_t frame[CHIP8_FRAME_SIZE];
+    chip8_get_frame(ch, frame);
+    chip8_destroy(ch);
+    return ok && memcmp(frame, s->frame, sizeof(frame)) == 0;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Blocking, client messages are small
+static bool send_message(int fd, uint8_t type, const uint8_t *payload, size_t size) {
+    uint8_t header[SERVER_HEADER_SIZE];
+    header[0] = type;
+    put_u32(header + 1, (uint32_t)size);
+    if (send(fd, header, sizeof(header), MSG_NOSIGNAL) != sizeof(header)) {
+        return false;
+    }
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t n = send(fd, payload + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EINTR) {
+            return false;
+        }
+        sent += n > 0 ? n : 0;
+    }
+    return true;
+}
+
+static int read_input_script(const char *path, input_event_t *events, int max_events) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    int count = 0;
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), fp) && count < max_events) {
+        unsigned long long frame;
+        unsigned int keys;
+        if (line[0] == '#' || sscanf(line, "%llu %x", &frame, &keys) != 2) {
+            continue;
+        }
+        events[count].frame = frame;
+        events[count].keys = keys;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static unsigned char* read_file(const char *filename, size_t *out_len) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0L, SEEK_END);
+    long pos = ftell(fp);
+    if (pos < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    size_t file_size = pos;
+    rewind(fp);
+    unsigned char *file_contents = malloc(file_size);
+    if (!file_contents) {
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(file_contents, file_size, 1, fp) < 1) {
+        if (ferror(fp)) {
+            fclose(fp);
+            free(file_contents);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    *out_len = file_size;
+    return file_contents;
+}
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 
 #ifdef WIN32
@@ -30,21 +31,50 @@
 
 #include "chip8.h"
 
-#define RMASK 0x000000ff
-#define GMASK 0x0000ff00
-#define BMASK 0x00ff0000
-#define AMASK 0xff000000
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 320
+#define TICKS_PER_SECOND 60
+#define MAX_LAG_TICKS 5
+#define FRAME_INDEX 0x3
+#define FRAME_FRESH 0x4
 
-static void set_pixel(uint32_t *surface, int x, int y);
-static void set_scaled_pixel(uint32_t *surface, int scale, int x, int y);
-static void get_input(const Uint8 *state, chip8_keyboard_input_t *input);
+// off, plane 0, plane 1, both planes
+static const uint32_t palette[4] = {0x00000000, 0xffffffff, 0xffaa5500, 0xff555555};
+#define RECORDING_HASH_INTERVAL 1000
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_TONE_HZ 440
+#define AUDIO_RING_SAMPLES 8192
+#define AUDIO_LATENCY_SAMPLES 2048
+
+// Frames rotate between the two threads without locks. The emulation
+// thread draws into its back frame and swaps it with the middle one, the
+// render thread swaps its front frame with the middle one when that holds
+// a frame it hasn't shown yet. Each frame comes with the screen area that
+// changed since the last frame the render thread took, the only part it
+// uploads to the texture.
+typedef struct triple_buffer {
+    uint32_t *frames[3];
+    SDL_Rect changed[3]; // written by the emulation thread before it publishes the frame
+    SDL_atomic_t middle; // frame index, FRAME_FRESH if not taken yet
+} triple_buffer_t;
+
+typedef struct emulator {
+    chip8_t *ch8;
+    triple_buffer_t buffer;
+    SDL_atomic_t keys; // bit mask of pressed keys, written by the render thread
+    SDL_atomic_t running;
+    SDL_atomic_t failed;
+} emulator_t;
+
+static int emulation_thread(void *data);
+static void wait_until(Uint64 deadline);
+static int get_keys(const Uint8 *state);
+static void audio_callback(void *userdata, Uint8 *stream, int len);
 static unsigned char* read_file(const char *filename, size_t *out_size);
 
 int main(int argc, const char * argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s program\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        printf("Usage: %s program [recording]\n", argv[0]);
         return 1;
     }
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
@@ -56,12 +86,11 @@ int main(int argc, const char * argv[]) {
     char window_name_buf[256];
     snprintf(window_name_buf, sizeof(window_name_buf), "chip8 - %s", argv[1]);
 
-    SDL_Window *window;
-    SDL_Renderer *sdl_renderer;
-    SDL_CreateWindowAndRenderer(640, 320, 0, &window, &sdl_renderer);
-    SDL_SetWindowTitle(window, window_name_buf);
-    SDL_Surface *surface = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, RMASK, GMASK, BMASK, AMASK);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(sdl_renderer, surface);
+    SDL_Window *window = SDL_CreateWindow(window_name_buf, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                          SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+    SDL_Renderer *sdl_renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+    SDL_Texture *texture = SDL_CreateTexture(sdl_renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING,
+                                             SCREEN_WIDTH, SCREEN_HEIGHT);
 
     size_t program_size;
     unsigned char *program = read_file(argv[1], &program_size);
@@ -73,96 +102,231 @@ int main(int argc, const char * argv[]) {
     chip8_t *ch8 = chip8_make();
     assert(ch8);
 
+    size_t name_len = strlen(argv[1]);
+    if (name_len > 4 && strcmp(argv[1] + name_len - 4, ".xo8") == 0) {
+        chip8_set_variant(ch8, CHIP8_VARIANT_XOCHIP);
+        chip8_set_quirks(ch8, CHIP8_QUIRKS_XOCHIP);
+    }
+
     bool ok = chip8_load_program(ch8, program, program_size);
     assert(ok);
 
-    while (true) {
-        chip8_keyboard_input_t input = {};
+    // sidecar written by analyse.c, if there is one
+    char analysis_path[4096];
+    snprintf(analysis_path, sizeof(analysis_path), "%s.c8a", argv[1]);
+    size_t analysis_size;
+    char *analysis = (char*)read_file(analysis_path, &analysis_size);
+    if (analysis) {
+        if (!chip8_load_analysis(ch8, analysis, analysis_size)) {
+            printf("%s doesn't match the program\n", analysis_path);
+        }
+        free(analysis);
+    }
+    chip8_seed_rng(ch8, SDL_GetPerformanceCounter());
 
-        SDL_Event e;
-        SDL_PollEvent(&e);
-        if (e.type == SDL_QUIT) {
+    chip8_audio_ring_t *audio_ring = chip8_audio_ring_make(AUDIO_RING_SAMPLES);
+    assert(audio_ring);
+    SDL_AudioSpec want = {0};
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = 512;
+    want.callback = audio_callback;
+    want.userdata = audio_ring;
+    SDL_AudioDeviceID audio_device = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+    if (audio_device != 0) {
+        chip8_set_audio(ch8, audio_ring, AUDIO_SAMPLE_RATE, AUDIO_TONE_HZ);
+    }
+    bool audio_paused = true;
+
+    int status = 0;
+    emulator_t emu = {0};
+    FILE *recording = NULL;
+    if (argc == 3) {
+        recording = fopen(argv[2], "wb");
+        if (!recording || !chip8_start_recording(ch8, recording, RECORDING_HASH_INTERVAL)) {
+            printf("Recording to %s failed\n", argv[2]);
+            status = 1;
             goto end;
         }
+    }
 
-        const Uint8 *keyboard_state = SDL_GetKeyboardState(NULL);
-
-        get_input(keyboard_state, &input);
+    emu.ch8 = ch8;
+    for (int i = 0; i < 3; i++) {
+        emu.buffer.frames[i] = calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(uint32_t));
+        assert(emu.buffer.frames[i]);
+    }
+    // the emulation thread starts with frame 0, the render thread with frame 1
+    // and the blank frame 2 fills the whole texture first
+    emu.buffer.changed[2] = (SDL_Rect){0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    SDL_AtomicSet(&emu.buffer.middle, 2 | FRAME_FRESH);
+    SDL_AtomicSet(&emu.running, 1);
+    SDL_Thread *thread = SDL_CreateThread(emulation_thread, "emulation", &emu);
+    assert(thread);
 
-        int num_ticks = chip8_is_super(ch8) ? 16 : 8;
-        for (int i = 0; i < num_ticks; i++) {
-            ok = chip8_cpu_tick(ch8, &input);
-            assert(ok);
+    int front = 1;
+    while (SDL_AtomicGet(&emu.running)) {
+        SDL_Event e;
+        while (SDL_PollEvent(&e)) {
+            if (e.type == SDL_QUIT) {
+                SDL_AtomicSet(&emu.running, 0);
+            }
         }
-        if (chip8_should_beep(ch8)) {
-            puts("beep");
+        SDL_AtomicSet(&emu.keys, get_keys(SDL_GetKeyboardState(NULL)));
+        // start playing once there's enough queued to ride out scheduling jitter
+        if (audio_device != 0 && audio_paused && chip8_audio_ring_buffered(audio_ring) >= AUDIO_LATENCY_SAMPLES) {
+            SDL_PauseAudioDevice(audio_device, 0);
+            audio_paused = false;
         }
 
-        int scale = SCREEN_WIDTH / chip8_get_width(ch8);
-        memset(surface->pixels, 0, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
-        for (int y = 0; y < chip8_get_height(ch8); y++) {
-            for (int x = 0; x < chip8_get_width(ch8); x++) {
-                if (chip8_get_pixel(ch8, x, y)) {
-                    set_scaled_pixel((uint32_t*)surface->pixels, scale, x, y);
-                }
-            }
+        if (!(SDL_AtomicGet(&emu.buffer.middle) & FRAME_FRESH)) {
+            SDL_Delay(1);
+            continue;
         }
-
+        front = SDL_AtomicSet(&emu.buffer.middle, front) & FRAME_INDEX;
+        const SDL_Rect *changed = &emu.buffer.changed[front];
+        uint32_t *pixels = emu.buffer.frames[front] + changed->y * SCREEN_WIDTH + changed->x;
+        SDL_UpdateTexture(texture, changed, pixels, SCREEN_WIDTH * sizeof(uint32_t));
         SDL_RenderClear(sdl_renderer);
-        SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch);
         SDL_RenderCopy(sdl_renderer, texture, NULL, NULL);
         SDL_RenderPresent(sdl_renderer);
-
-        SDL_Delay(16);
     }
+    SDL_WaitThread(thread, NULL);
+    if (SDL_AtomicGet(&emu.failed)) {
+        puts("Program failed");
+    }
+
 end:
+    if (recording) {
+        chip8_stop_recording(ch8);
+        fclose(recording);
+    }
+    if (audio_device != 0) {
+        SDL_CloseAudioDevice(audio_device);
+    }
     chip8_destroy(ch8);
+    chip8_audio_ring_destroy(audio_ring);
+    for (int i = 0; i < 3; i++) {
+        free(emu.buffer.frames[i]);
+    }
+    free(program);
 
     SDL_DestroyTexture(texture);
-    SDL_FreeSurface(surface);
+    SDL_DestroyRenderer(sdl_renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
+    return status;
+}
+
+// Runs one 60 Hz timer period per tick, paced by the performance counter
+// so that presenting frames can't slow it down. The period is the core's
+// timer divider, so the delay and sound timers run at 60 Hz in every mode.
+// Only the part of the back frame the display changed in since that frame
+// was last drawn is redrawn.
+static int emulation_thread(void *data) {
+    emulator_t *emu = data;
+    chip8_t *ch8 = emu->ch8;
+    Uint64 tick_length = SDL_GetPerformanceFrequency() / TICKS_PER_SECOND;
+    Uint64 next_tick = SDL_GetPerformanceCounter();
+    SDL_Rect full = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    SDL_Rect stale[3] = {full, full, full}; // screen area of each frame older than the display
+    SDL_Rect unseen = full;                 // changes since the last frame the render thread took
+    int back = 0;
+    while (SDL_AtomicGet(&emu->running)) {
+        chip8_keyboard_input_t input;
+        int keys = SDL_AtomicGet(&emu->keys);
+        for (int i = 0; i < 16; i++) {
+            input.keys[i] = (keys >> i) & 1;
+        }
+
+        int cycles = chip8_get_timer_period(ch8);
+        while (cycles > 0) {
+            chip8_stop_reason_t reason;
+            cycles -= chip8_run_cycles(ch8, &input, cycles, &reason);
+            if (reason == CHIP8_STOP_ERROR) {
+                SDL_AtomicSet(&emu->failed, 1);
+                SDL_AtomicSet(&emu->running, 0);
+                return 1;
+            }
+        }
+
+        int x, y, width, height;
+        if (chip8_get_dirty_rect(ch8, &x, &y, &width, &height)) {
+            int scale = SCREEN_WIDTH / chip8_get_width(ch8);
+            SDL_Rect changed = {x * scale, y * scale, width * scale, height * scale};
+            for (int i = 0; i < 3; i++) {
+                SDL_UnionRect(&stale[i], &changed, &stale[i]);
+            }
+            SDL_UnionRect(&unseen, &changed, &unseen);
+            // in display pixels, rounded out in case the scale changed since
+            SDL_Rect *redraw = &stale[back];
+            int left = redraw->x / scale;
+            int top = redraw->y / scale;
+            int right = (redraw->x + redraw->w + scale - 1) / scale;
+            int bottom = (redraw->y + redraw->h + scale - 1) / scale;
+            chip8_render_planes_rect_rgba(ch8, emu->buffer.frames[back], SCREEN_WIDTH * sizeof(uint32_t), scale, palette,
+                                          left, top, right - left, bottom - top);
+            *redraw = (SDL_Rect){0, 0, 0, 0};
+            emu->buffer.changed[back] = unseen;
+            int previous = SDL_AtomicSet(&emu->buffer.middle, back | FRAME_FRESH);
+            back = previous & FRAME_INDEX;
+            if (!(previous & FRAME_FRESH)) {
+                // the render thread took the frame before this one
+                unseen = changed;
+            }
+            chip8_acknowledge_dirty(ch8);
+        }
+
+        next_tick += tick_length;
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now > next_tick + tick_length * MAX_LAG_TICKS) {
+            // too far behind (e.g. the process was suspended), don't try to catch up
+            next_tick = now;
+        }
+        wait_until(next_tick);
+    }
     return 0;
 }
 
-static void set_pixel(uint32_t *surface, int x, int y) {
-    if (x >= SCREEN_WIDTH || y >= SCREEN_HEIGHT) {
+// Sleeps for most of the wait and spins for the last millisecond,
+// SDL_Delay alone is too coarse to hold 60 Hz steady.
+static void wait_until(Uint64 deadline) {
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now >= deadline) {
         return;
     }
-    int ix = (y * SCREEN_WIDTH) + x;
-    surface[ix] = 0xffffffff;
+    Uint64 ms = (deadline - now) * 1000 / SDL_GetPerformanceFrequency();
+    if (ms > 1) {
+        SDL_Delay((Uint32)(ms - 1));
+    }
+    while (SDL_GetPerformanceCounter() < deadline) {
+    }
 }
 
-static void set_scaled_pixel(uint32_t *surface, int scale, int x, int y) {
-    int x_start = x * scale;
-    int x_end = (x + 1) * scale;
-    int y_start = y * scale;
-    int y_end = (y + 1) * scale;
-    for (int yi = y_start; yi < y_end; yi++) {
-        for (int xi = x_start; xi < x_end; xi++) {
-            set_pixel(surface, xi, yi);
-        }
-    }
+static void audio_callback(void *userdata, Uint8 *stream, int len) {
+    chip8_audio_ring_read(userdata, (int16_t*)stream, len / sizeof(int16_t));
 }
 
-static void get_input(const Uint8 *state, chip8_keyboard_input_t *input) {
-    if (state[SDL_SCANCODE_1]) input->keys[0x1] = true;
-    if (state[SDL_SCANCODE_2]) input->keys[0x2] = true;
-    if (state[SDL_SCANCODE_3]) input->keys[0x3] = true;
-    if (state[SDL_SCANCODE_4]) input->keys[0xc] = true;
-    if (state[SDL_SCANCODE_Q]) input->keys[0x4] = true;
-    if (state[SDL_SCANCODE_W]) input->keys[0x5] = true;
-    if (state[SDL_SCANCODE_E]) input->keys[0x6] = true;
-    if (state[SDL_SCANCODE_R]) input->keys[0xd] = true;
-    if (state[SDL_SCANCODE_A]) input->keys[0x7] = true;
-    if (state[SDL_SCANCODE_S]) input->keys[0x8] = true;
-    if (state[SDL_SCANCODE_D]) input->keys[0x9] = true;
-    if (state[SDL_SCANCODE_F]) input->keys[0xe] = true;
-    if (state[SDL_SCANCODE_Z]) input->keys[0xA] = true;
-    if (state[SDL_SCANCODE_X]) input->keys[0x0] = true;
-    if (state[SDL_SCANCODE_C]) input->keys[0xb] = true;
-    if (state[SDL_SCANCODE_V]) input->keys[0xf] = true;
+static int get_keys(const Uint8 *state) {
+    int keys = 0;
+    if (state[SDL_SCANCODE_1]) keys |= 1 << 0x1;
+    if (state[SDL_SCANCODE_2]) keys |= 1 << 0x2;
+    if (state[SDL_SCANCODE_3]) keys |= 1 << 0x3;
+    if (state[SDL_SCANCODE_4]) keys |= 1 << 0xc;
+    if (state[SDL_SCANCODE_Q]) keys |= 1 << 0x4;
+    if (state[SDL_SCANCODE_W]) keys |= 1 << 0x5;
+    if (state[SDL_SCANCODE_E]) keys |= 1 << 0x6;
+    if (state[SDL_SCANCODE_R]) keys |= 1 << 0xd;
+    if (state[SDL_SCANCODE_A]) keys |= 1 << 0x7;
+    if (state[SDL_SCANCODE_S]) keys |= 1 << 0x8;
+    if (state[SDL_SCANCODE_D]) keys |= 1 << 0x9;
+    if (state[SDL_SCANCODE_F]) keys |= 1 << 0xe;
+    if (state[SDL_SCANCODE_Z]) keys |= 1 << 0xA;
+    if (state[SDL_SCANCODE_X]) keys |= 1 << 0x0;
+    if (state[SDL_SCANCODE_C]) keys |= 1 << 0xb;
+    if (state[SDL_SCANCODE_V]) keys |= 1 << 0xf;
+    return keys;
 }
 
 static unsigned char* read_file(const char *filename, size_t *out_len) {
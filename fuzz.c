@@ -0,0 +1,200 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Fuzz target for chip8_load_program, chip8_cpu_tick and chip8_run_cycles.
+
+    libFuzzer: clang -O2 -g -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER -o fuzz fuzz.c chip8.c
+    AFL++:     afl-clang-fast -O2 -o fuzz fuzz.c chip8.c
+    Replay:    cc -O2 -o fuzz fuzz.c chip8.c && ./fuzz [-c cycles] [-n repeats] input ...
+
+    The first byte of an input picks the variant (bit 0), the quirks
+    profile (bits 1-2), the JIT (bit 3, with CHIP8_JIT) and whether to step
+    with chip8_cpu_tick instead of chip8_run_cycles (bit 4). The next two are
+    the mask of keys held down and the rest is the ROM.
+
+    Inputs reuse one instance per JIT mode. chip8_load_program only rewrites
+    the pages and display rows the previous input wrote, so a short run costs
+    about as much as the instructions it executes. The cycle budget (-c, 100000
+    by default) stops programs that never finish.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+
+#define FUZZ_HEADER_SIZE 3
+#define FUZZ_XOCHIP 0x1
+#define FUZZ_QUIRKS_SHIFT 1
+#define FUZZ_JIT 0x8
+#define FUZZ_STEP 0x10
+#define FUZZ_DEFAULT_CYCLES 100000
+#define FUZZ_IDLE_CHECK_INTERVAL 256
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+static chip8_stop_reason_t fuzz_run(const uint8_t *data, size_t size, int *out_cycles);
+
+static int max_cycles = FUZZ_DEFAULT_CYCLES;
+static chip8_t *instances[2];
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+#ifndef FUZZ_LIBFUZZER
+static int replay_file(const char *path, int repeats, double *out_ms);
+static double now_ms(void);
+
+int main(int argc, char *argv[]) {
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+    __AFL_INIT();
+    unsigned char *buf = __AFL_FUZZ_TESTCASE_BUF;
+    while (__AFL_LOOP(100000)) {
+        LLVMFuzzerTestOneInput(buf, __AFL_FUZZ_TESTCASE_LEN);
+    }
+    return 0;
+#else
+    int repeats = 1;
+    int num_files = 0;
+    int num_runs = 0;
+    double total_ms = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            max_cycles = atoi(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+            continue;
+        }
+        double ms = 0;
+        if (replay_file(argv[i], repeats, &ms) != 0) {
+            return 2;
+        }
+        total_ms += ms;
+        num_runs += repeats;
+        num_files++;
+    }
+    if (num_files == 0) {
+        printf("Usage: %s [-c cycles] [-n repeats] input ...\n", argv[0]);
+        return 2;
+    }
+    printf("%d runs in %.1f ms, %.0f execs/s\n", num_runs, total_ms, num_runs / (total_ms / 1000.0));
+    return 0;
+#endif
+}
+
+static int replay_file(const char *path, int repeats, double *out_ms) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("%s: can't open\n", path);
+        return 1;
+    }
+    static uint8_t data[FUZZ_HEADER_SIZE + 0x10000];
+    size_t size = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
+    int cycles = 0;
+    chip8_stop_reason_t reason = CHIP8_STOP_BUDGET;
+    double start = now_ms();
+    for (int i = 0; i < repeats; i++) {
+        reason = fuzz_run(data, size, &cycles);
+    }
+    *out_ms = now_ms() - start;
+    const char *reasons[] = {"budget", "wait key", "display", "beep", "error"};
+    printf("%s: %d cycles, stopped by %s\n", path, cycles, reasons[reason]);
+    return 0;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+#endif
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    int cycles;
+    fuzz_run(data, size, &cycles);
+    return 0;
+}
+
+static chip8_stop_reason_t fuzz_run(const uint8_t *data, size_t size, int *out_cycles) {
+    *out_cycles = 0;
+    if (size < FUZZ_HEADER_SIZE) {
+        return CHIP8_STOP_ERROR;
+    }
+    // one instance per JIT mode, chip8_set_jit drops all compiled code
+    uint8_t flags = data[0];
+    bool jit = (flags & FUZZ_JIT) != 0;
+    if (instances[jit] == NULL) {
+        instances[jit] = chip8_make();
+        if (instances[jit] == NULL) {
+            return CHIP8_STOP_ERROR;
+        }
+        // without CHIP8_JIT the instance just keeps interpreting
+        chip8_set_jit(instances[jit], jit ? CHIP8_JIT_ON : CHIP8_JIT_OFF);
+    }
+    chip8_t *ch = instances[jit];
+    chip8_set_variant(ch, flags & FUZZ_XOCHIP ? CHIP8_VARIANT_XOCHIP : CHIP8_VARIANT_SCHIP);
+    chip8_set_quirks(ch, (flags >> FUZZ_QUIRKS_SHIFT) & 0x3);
+    if (!chip8_load_program(ch, (unsigned char*)data + FUZZ_HEADER_SIZE, size - FUZZ_HEADER_SIZE)) {
+        return CHIP8_STOP_ERROR;
+    }
+    chip8_seed_rng(ch, 0);
+
+    chip8_keyboard_input_t input;
+    uint16_t keys = data[1] | (data[2] << 8);
+    for (int i = 0; i < 16; i++) {
+        input.keys[i] = (keys >> i) & 1;
+    }
+
+    // the watchdog. chip8_run_cycles skips idle loops, so programs that only
+    // wait use up the budget at once, stepping checks for them now and then.
+    chip8_stop_reason_t reason = CHIP8_STOP_BUDGET;
+    int cycles = 0;
+    while (cycles < max_cycles) {
+        if (flags & FUZZ_STEP) {
+            cycles++;
+            if (!chip8_cpu_tick(ch, &input)) {
+                reason = CHIP8_STOP_ERROR;
+                break;
+            }
+            if (cycles % FUZZ_IDLE_CHECK_INTERVAL == 0) {
+                chip8_idle_state_t idle = chip8_get_idle_state(ch, NULL);
+                if (idle == CHIP8_IDLE_HALTED || (idle == CHIP8_IDLE_WAIT_KEY && keys == 0)) {
+                    break;
+                }
+            }
+            continue;
+        }
+        int ran = chip8_run_cycles(ch, &input, max_cycles - cycles, &reason);
+        cycles += ran;
+        if (reason == CHIP8_STOP_ERROR || (reason == CHIP8_STOP_WAIT_KEY && keys == 0) || ran == 0) {
+            break;
+        }
+        reason = CHIP8_STOP_BUDGET;
+    }
+    *out_cycles = cycles;
+    return reason;
+}
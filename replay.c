@@ -0,0 +1,108 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Replays recordings made with chip8_start_recording at full speed.
+
+    Usage: replay [-jit] recording ...
+
+    Exits with 0 if every recording matched all of its state hashes,
+    1 if one diverged and 2 if one couldn't be read.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chip8.h"
+
+static int replay_file(const char *path, chip8_jit_mode_t jit_mode);
+static double now_ms(void);
+
+int main(int argc, char *argv[]) {
+    chip8_jit_mode_t jit_mode = CHIP8_JIT_OFF;
+    int status = 0;
+    int num_files = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-jit") == 0) {
+            jit_mode = CHIP8_JIT_ON;
+            continue;
+        }
+        int file_status = replay_file(argv[i], jit_mode);
+        if (file_status > status) {
+            status = file_status;
+        }
+        num_files++;
+    }
+    if (num_files == 0) {
+        printf("Usage: %s [-jit] recording ...\n", argv[0]);
+        return 2;
+    }
+    return status;
+}
+
+static int replay_file(const char *path, chip8_jit_mode_t jit_mode) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("%s: can't open\n", path);
+        return 2;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        printf("%s: can't read\n", path);
+        close(fd);
+        return 2;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("%s: can't map\n", path);
+        return 2;
+    }
+    chip8_replay_result_t result;
+    double start = now_ms();
+    chip8_replay(data, st.st_size, jit_mode, &result);
+    double elapsed = now_ms() - start;
+    munmap(data, st.st_size);
+
+    if (result.ok) {
+        printf("%s: ok, %llu cycles, %d hashes, %.3f ms\n", path, (unsigned long long)result.cycles,
+               result.checkpoints, elapsed);
+        return 0;
+    }
+    if (result.diverged_cycle != 0) {
+        printf("%s: diverged after cycle %llu, hash mismatch at cycle %llu\n", path,
+               (unsigned long long)result.last_good_cycle, (unsigned long long)result.diverged_cycle);
+        return 1;
+    }
+    printf("%s: malformed recording after %llu cycles\n", path, (unsigned long long)result.cycles);
+    return 2;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
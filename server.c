@@ -0,0 +1,548 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Headless session server (Linux).
+
+    Usage: server [-j workers] [-v] [socket_path]
+
+    Every connection to the Unix socket is a session with its own chip8_t,
+    driven by the messages described in server.h. Sessions run one 60 Hz
+    frame per tick and each frame that changed the display or the beeper is
+    sent as an XOR and RLE delta of the packed 1bpp display.
+
+    Connections are handed to a fixed pool of workers (one per core by
+    default), whichever has the fewest sessions. A worker runs an epoll loop
+    over its connections, a timerfd for the ticks and a pipe the accepting
+    thread passes new connections through, so no session ever waits for a
+    thread of its own. A worker that falls behind runs one frame per tick
+    and drops the missed ticks instead of catching up. Frames aren't sent to
+    clients that don't read them, the next one sent covers the changes.
+
+    With -v, prints the number of sessions, frames per second, bytes per
+    frame sent and how busy the workers are every 5 seconds.
+*/
+
+#define _GNU_SOURCE // accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "chip8.h"
+#include "server.h"
+
+#define FRAME_NS (1000000000 / 60)
+#define MAX_EPOLL_EVENTS 256
+#define MAX_BACKLOG (64 * 1024)     // unsent bytes after which frames are skipped
+#define STATS_INTERVAL_MS 5000
+
+typedef struct session {
+    int fd;
+    int index;                  // in worker->sessions
+    chip8_t *ch;
+    bool loaded;
+    bool stopped;               // closed once the STOP message is out
+    bool beeping;
+    bool want_write;            // EPOLLOUT is on
+    bool closed;                // freed once the current batch of events is handled
+    chip8_keyboard_input_t input;
+    uint32_t frame_number;
+    uint32_t sent_generation;
+    uint8_t frame[CHIP8_FRAME_SIZE]; // the display as of the last FRAME
+    uint8_t *in_buf;
+    size_t in_len;
+    uint8_t *out_buf;
+    size_t out_pos;
+    size_t out_len;
+    size_t out_capacity;
+} session_t;
+
+typedef struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    int timer_fd;
+    int pipe_fds[2];
+    session_t **sessions;
+    int num_sessions;
+    int capacity;
+    session_t **closed;         // sessions closed during the current batch of events
+    int num_closed;
+    atomic_int session_count;
+    atomic_uint_fast64_t frames_run;
+    atomic_uint_fast64_t frames_sent;
+    atomic_uint_fast64_t bytes_sent;
+    atomic_uint_fast64_t busy_ns;
+} worker_t;
+
+static bool start_worker(worker_t *w);
+static void* worker_main(void *arg);
+static void tick(worker_t *w);
+static void add_session(worker_t *w, int fd);
+static void close_session(worker_t *w, session_t *s);
+static void free_session(session_t *s);
+static bool read_session(session_t *s);
+static bool handle_message(session_t *s, uint8_t type, const uint8_t *payload, size_t size);
+static void send_frame(worker_t *w, session_t *s);
+static bool queue_message(session_t *s, uint8_t type, const uint8_t *payload, size_t size, const uint8_t *extra, size_t extra_size);
+static bool flush_session(worker_t *w, session_t *s);
+static void watch_session(worker_t *w, session_t *s, bool want_write);
+static int listen_on(const char *path);
+static void print_stats(worker_t *workers, int num_workers, double elapsed_ms);
+static void put_u32(uint8_t *p, uint32_t v);
+static uint32_t get_u32(const uint8_t *p);
+static uint64_t now_ns(void);
+
+int main(int argc, char *argv[]) {
+    int num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = SERVER_DEFAULT_SOCKET;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            num_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (argv[i][0] == '-') {
+            num_workers = 0;
+            break;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (num_workers < 1) {
+        printf("Usage: %s [-j workers] [-v] [socket_path]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = listen_on(path);
+    if (listen_fd < 0) {
+        printf("Listening on %s failed: %s\n", path, strerror(errno));
+        return 1;
+    }
+    worker_t *workers = calloc(num_workers, sizeof(worker_t));
+    for (int i = 0; i < num_workers; i++) {
+        if (!start_worker(&workers[i])) {
+            printf("Starting worker %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+    }
+    fprintf(stderr, "Listening on %s with %d workers\n", path, num_workers);
+
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    uint64_t stats_start = now_ns();
+    while (true) {
+        int n = poll(&pfd, 1, verbose ? STATS_INTERVAL_MS : -1);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        uint64_t now = now_ns();
+        if (verbose && now - stats_start >= STATS_INTERVAL_MS * 1000000ull) {
+            print_stats(workers, num_workers, (now - stats_start) / 1e6);
+            stats_start = now;
+        }
+        if (n <= 0) {
+            continue;
+        }
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        worker_t *target = &workers[0];
+        for (int i = 1; i < num_workers; i++) {
+            if (atomic_load(&workers[i].session_count) < atomic_load(&target->session_count)) {
+                target = &workers[i];
+            }
+        }
+        // counted now so the next connection sees it, the worker adds the session
+        atomic_fetch_add(&target->session_count, 1);
+        if (write(target->pipe_fds[1], &fd, sizeof(fd)) != sizeof(fd)) {
+            atomic_fetch_sub(&target->session_count, 1);
+            close(fd);
+        }
+    }
+    close(listen_fd);
+    unlink(path);
+    return 1;
+}
+
+static bool start_worker(worker_t *w) {
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w->epoll_fd < 0 || w->timer_fd < 0 || pipe(w->pipe_fds) != 0) {
+        return false;
+    }
+    struct itimerspec period = {{0, FRAME_NS}, {0, FRAME_NS}};
+    timerfd_settime(w->timer_fd, 0, &period, NULL);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->timer_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &ev);
+    ev.data.ptr = &w->pipe_fds[0];
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->pipe_fds[0], &ev);
+    return pthread_create(&w->thread, NULL, worker_main, w) == 0;
+}
+
+static void* worker_main(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (true) {
+        int n = epoll_wait(w->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &w->timer_fd) {
+                uint64_t expirations;
+                if (read(w->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                    tick(w);
+                }
+                continue;
+            }
+            if (ptr == &w->pipe_fds[0]) {
+                int fd;
+                if (read(w->pipe_fds[0], &fd, sizeof(fd)) == sizeof(fd)) {
+                    add_session(w, fd);
+                }
+                continue;
+            }
+            session_t *s = ptr;
+            if (s->closed) {
+                continue;
+            }
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                ok = read_session(s);
+            }
+            if (ok) {
+                ok = flush_session(w, s);
+            }
+            if (!ok || (s->stopped && s->out_pos == s->out_len)) {
+                close_session(w, s);
+            }
+        }
+        // closed sessions can still come up later in the same batch
+        for (int i = 0; i < w->num_closed; i++) {
+            free_session(w->closed[i]);
+        }
+        w->num_closed = 0;
+    }
+}
+
+static void tick(worker_t *w) {
+    uint64_t start = now_ns();
+    uint64_t frames = 0;
+    for (int i = 0; i < w->num_sessions; i++) {
+        session_t *s = w->sessions[i];
+        if (!s->loaded || s->stopped) {
+            continue;
+        }
+        frames++;
+        s->frame_number++;
+        if (!chip8_run_frame(s->ch, &s->input)) {
+            uint8_t reason = CHIP8_STOP_ERROR;
+            queue_message(s, SERVER_MSG_STOP, &reason, 1, NULL, 0);
+            s->stopped = true;
+        } else {
+            send_frame(w, s);
+        }
+        if (!flush_session(w, s) || (s->stopped && s->out_pos == s->out_len)) {
+            close_session(w, s);
+            i--;
+        }
+    }
+    atomic_fetch_add_explicit(&w->frames_run, frames, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->busy_ns, now_ns() - start, memory_order_relaxed);
+}
+
+static void send_frame(worker_t *w, session_t *s) {
+    uint32_t generation = chip8_get_frame_generation(s->ch);
+    bool beeping = chip8_should_beep(s->ch);
+    if ((generation == s->sent_generation && beeping == s->beeping) || s->out_len - s->out_pos > MAX_BACKLOG) {
+        return;
+    }
+    uint8_t frame[CHIP8_FRAME_SIZE];
+    uint8_t delta[CHIP8_FRAME_DELTA_MAX_SIZE];
+    chip8_get_frame(s->ch, frame);
+    size_t delta_size = chip8_encode_frame_delta(s->frame, frame, delta);
+    uint8_t header[SERVER_FRAME_SIZE];
+    put_u32(header, s->frame_number);
+    header[4] = (uint8_t)chip8_get_width(s->ch);
+    header[5] = (uint8_t)chip8_get_height(s->ch);
+    header[6] = (uint8_t)chip8_get_num_planes(s->ch);
+    header[7] = beeping;
+    if (!queue_message(s, SERVER_MSG_FRAME, header, sizeof(header), delta, delta_size)) {
+        return;
+    }
+    memcpy(s->frame, frame, sizeof(frame));
+    s->sent_generation = generation;
+    s->beeping = beeping;
+    atomic_fetch_add_explicit(&w->frames_sent, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->bytes_sent, SERVER_HEADER_SIZE + sizeof(header) + delta_size, memory_order_relaxed);
+}
+
+static void add_session(worker_t *w, int fd) {
+    session_t *s = calloc(1, sizeof(session_t));
+    if (s != NULL) {
+        s->ch = chip8_make();
+        s->in_buf = malloc(SERVER_HEADER_SIZE + SERVER_MAX_PAYLOAD);
+    }
+    if (w->num_sessions == w->capacity) {
+        int capacity = w->capacity ? w->capacity * 2 : 64;
+        session_t **sessions = realloc(w->sessions, capacity * sizeof(session_t*));
+        session_t **closed = sessions != NULL ? realloc(w->closed, capacity * sizeof(session_t*)) : NULL;
+        if (sessions != NULL) {
+            w->sessions = sessions;
+        }
+        if (closed != NULL) {
+            w->closed = closed;
+            w->capacity = capacity;
+        }
+    }
+    if (s == NULL || s->ch == NULL || s->in_buf == NULL || w->num_sessions == w->capacity) {
+        if (s != NULL) {
+            free_session(s);
+        }
+        close(fd);
+        atomic_fetch_sub(&w->session_count, 1);
+        return;
+    }
+    s->fd = fd;
+    s->index = w->num_sessions;
+    w->sessions[w->num_sessions++] = s;
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = s;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void close_session(worker_t *w, session_t *s) {
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    w->sessions[s->index] = w->sessions[--w->num_sessions];
+    w->sessions[s->index]->index = s->index;
+    atomic_fetch_sub(&w->session_count, 1);
+    s->closed = true;
+    w->closed[w->num_closed++] = s;
+}
+
+static void free_session(session_t *s) {
+    chip8_destroy(s->ch);
+    free(s->in_buf);
+    free(s->out_buf);
+    free(s);
+}
+
+// Returns false when the connection is closed or broke the protocol
+static bool read_session(session_t *s) {
+    while (true) {
+        ssize_t n = read(s->fd, s->in_buf + s->in_len, SERVER_HEADER_SIZE + SERVER_MAX_PAYLOAD - s->in_len);
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        s->in_len += n;
+        size_t pos = 0;
+        while (s->in_len - pos >= SERVER_HEADER_SIZE) {
+            uint32_t size = get_u32(s->in_buf + pos + 1);
+            if (size > SERVER_MAX_PAYLOAD) {
+                return false;
+            }
+            if (s->in_len - pos < SERVER_HEADER_SIZE + size) {
+                break;
+            }
+            if (!handle_message(s, s->in_buf[pos], s->in_buf + pos + SERVER_HEADER_SIZE, size)) {
+                return false;
+            }
+            pos += SERVER_HEADER_SIZE + size;
+        }
+        memmove(s->in_buf, s->in_buf + pos, s->in_len - pos);
+        s->in_len -= pos;
+    }
+}
+
+static bool handle_message(session_t *s, uint8_t type, const uint8_t *payload, size_t size) {
+    if (s->stopped) {
+        return true;
+    }
+    switch (type) {
+        case SERVER_MSG_LOAD: {
+            if (size < SERVER_LOAD_SIZE) {
+                return false;
+            }
+            uint64_t seed = get_u32(payload + 2) | (uint64_t)get_u32(payload + 6) << 32;
+            if (!chip8_set_variant(s->ch, payload[0]) || !chip8_set_quirks(s->ch, payload[1]) ||
+                !chip8_load_program(s->ch, (unsigned char*)payload + SERVER_LOAD_SIZE, size - SERVER_LOAD_SIZE)) {
+                return false;
+            }
+            chip8_seed_rng(s->ch, seed);
+            // the first frame is sent against a blank display
+            memset(s->frame, 0, sizeof(s->frame));
+            s->sent_generation = chip8_get_frame_generation(s->ch) - 1;
+            s->frame_number = 0;
+            s->loaded = true;
+            return true;
+        }
+        case SERVER_MSG_KEYS: {
+            if (size != 2) {
+                return false;
+            }
+            uint16_t keys = payload[0] | (payload[1] << 8);
+            for (int k = 0; k < 16; k++) {
+                s->input.keys[k] = (keys >> k) & 1;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static bool queue_message(session_t *s, uint8_t type, const uint8_t *payload, size_t size, const uint8_t *extra, size_t extra_size) {
+    size_t total = SERVER_HEADER_SIZE + size + extra_size;
+    if (s->out_pos == s->out_len) {
+        s->out_pos = 0;
+        s->out_len = 0;
+    }
+    if (s->out_len + total > s->out_capacity && s->out_pos > 0) {
+        memmove(s->out_buf, s->out_buf + s->out_pos, s->out_len - s->out_pos);
+        s->out_len -= s->out_pos;
+        s->out_pos = 0;
+    }
+    if (s->out_len + total > s->out_capacity) {
+        size_t capacity = s->out_capacity ? s->out_capacity : 4096;
+        while (capacity < s->out_len + total) {
+            capacity *= 2;
+        }
+        uint8_t *buf = realloc(s->out_buf, capacity);
+        if (buf == NULL) {
+            return false;
+        }
+        s->out_buf = buf;
+        s->out_capacity = capacity;
+    }
+    uint8_t *p = s->out_buf + s->out_len;
+    p[0] = type;
+    put_u32(p + 1, (uint32_t)(size + extra_size));
+    memcpy(p + SERVER_HEADER_SIZE, payload, size);
+    if (extra_size > 0) {
+        memcpy(p + SERVER_HEADER_SIZE + size, extra, extra_size);
+    }
+    s->out_len += total;
+    return true;
+}
+
+// Writes as much of the queue as the socket takes, returns false if it broke
+static bool flush_session(worker_t *w, session_t *s) {
+    while (s->out_pos < s->out_len) {
+        ssize_t n = send(s->fd, s->out_buf + s->out_pos, s->out_len - s->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        s->out_pos += n;
+    }
+    bool want_write = s->out_pos < s->out_len;
+    if (want_write != s->want_write) {
+        watch_session(w, s, want_write);
+    }
+    return true;
+}
+
+static void watch_session(worker_t *w, session_t *s, bool want_write) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = s;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->want_write = want_write;
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void print_stats(worker_t *workers, int num_workers, double elapsed_ms) {
+    int sessions = 0;
+    uint64_t frames_run = 0, frames_sent = 0, bytes_sent = 0, busy_ns = 0;
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *w = &workers[i];
+        sessions += atomic_load(&w->session_count);
+        frames_run += atomic_exchange(&w->frames_run, 0);
+        frames_sent += atomic_exchange(&w->frames_sent, 0);
+        bytes_sent += atomic_exchange(&w->bytes_sent, 0);
+        busy_ns += atomic_exchange(&w->busy_ns, 0);
+    }
+    fprintf(stderr, "%d sessions, %.0f frames/s, %.0f sent/s, %.1f bytes per frame sent, workers %.1f%% busy\n",
+            sessions, frames_run * 1000.0 / elapsed_ms, frames_sent * 1000.0 / elapsed_ms,
+            frames_sent ? (double)bytes_sent / frames_sent : 0.0, busy_ns / (elapsed_ms * 1e4 * num_workers));
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,49 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+#ifndef server_h
+#define server_h
+
+// Wire protocol shared by server.c and client.c. Every message is a type
+// byte and a 32-bit little-endian payload size followed by the payload,
+// all numbers little-endian.
+//
+// Client to server:
+//   LOAD   variant, quirks, seed (u64), program. Starts the session over.
+//   KEYS   mask of the keys held down (u16), applies from the next frame.
+// Server to client:
+//   FRAME  frame number (u32), width, height, planes, beeping, then the
+//          chip8_encode_frame_delta of the display against the previous FRAME
+//          (or an all-zero frame after a LOAD).
+//   STOP   chip8_stop_reason_t (u8). The program failed and the session is over.
+
+#define SERVER_DEFAULT_SOCKET "chip8.sock"
+#define SERVER_HEADER_SIZE 5
+#define SERVER_LOAD_SIZE 10         // LOAD payload without the program
+#define SERVER_FRAME_SIZE 8         // FRAME payload without the delta
+#define SERVER_MAX_PAYLOAD (SERVER_LOAD_SIZE + 0x10000)
+
+enum {
+    SERVER_MSG_LOAD = 1,
+    SERVER_MSG_KEYS = 2,
+    SERVER_MSG_FRAME = 3,
+    SERVER_MSG_STOP = 4,
+};
+
+#endif /* server_h */
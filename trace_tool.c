@@ -0,0 +1,323 @@
+/*
+    Copyright (c) 2018 Krzysztof Gabis
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+ */
+
+/*
+    Prints, filters and compares traces written by chip8_start_trace.
+
+    Usage: trace_tool [filters] trace
+           trace_tool -diff [-context n] trace_a trace_b
+
+    Filters:
+      -pc addr[-addr]       records with the PC in the range
+      -cycles from[-to]     records in the cycle range
+      -op pattern           opcodes matching e.g. 8XY4, DXYN or F.65, where
+                            hex digits must match and anything else doesn't matter
+      -reg x                records that wrote VX
+      -last n               only the last n matching records
+
+    -diff prints the records before the first one that differs and both
+    versions of it. Exits with 0 if the traces are identical, 1 if they
+    diverge and 2 if one couldn't be read.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "chip8.h"
+
+#define TRACE_HEADER_SIZE 8
+#define TRACE_RECORD_SIZE 16
+#define TRACE_READ_RECORDS 4096
+
+typedef struct trace_file {
+    FILE *fp;
+    uint8_t variant;
+    uint8_t quirks;
+    uint8_t buf[TRACE_READ_RECORDS * TRACE_RECORD_SIZE];
+    size_t buffered;            // records in buf
+    size_t pos;                 // next record in buf
+} trace_file_t;
+
+typedef struct trace_filter {
+    uint32_t pc_from, pc_to;
+    uint64_t cycle_from, cycle_to;
+    uint16_t op_mask, op_value;
+    int reg;
+    size_t last;
+} trace_filter_t;
+
+static int print_trace(const char *path, const trace_filter_t *filter);
+static int diff_traces(const char *path_a, const char *path_b, size_t context);
+static bool trace_open(trace_file_t *tf, const char *path);
+static bool trace_next(trace_file_t *tf, chip8_trace_record_t *out_rec);
+static bool trace_matches(const trace_filter_t *filter, const chip8_trace_record_t *rec);
+static bool records_equal(const chip8_trace_record_t *a, const chip8_trace_record_t *b);
+static void print_record(const char *prefix, const chip8_trace_record_t *rec);
+static bool parse_range(const char *s, uint64_t *out_from, uint64_t *out_to);
+static bool parse_pattern(const char *s, uint16_t *out_mask, uint16_t *out_value);
+
+int main(int argc, char *argv[]) {
+    trace_filter_t filter = {0, 0xffff, 0, UINT64_MAX, 0, 0, -1, 0};
+    bool diff = false;
+    size_t context = 16;
+    const char *paths[2];
+    int num_paths = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        uint64_t from, to;
+        if (strcmp(arg, "-diff") == 0) {
+            diff = true;
+        } else if (strcmp(arg, "-context") == 0 && value != NULL) {
+            context = strtoul(value, NULL, 0);
+            i++;
+        } else if (strcmp(arg, "-pc") == 0 && value != NULL && parse_range(value, &from, &to)) {
+            filter.pc_from = (uint32_t)from;
+            filter.pc_to = to == UINT64_MAX ? (uint32_t)from : (uint32_t)to;
+            i++;
+        } else if (strcmp(arg, "-cycles") == 0 && value != NULL && parse_range(value, &from, &to)) {
+            filter.cycle_from = from;
+            filter.cycle_to = to;
+            i++;
+        } else if (strcmp(arg, "-op") == 0 && value != NULL && parse_pattern(value, &filter.op_mask, &filter.op_value)) {
+            i++;
+        } else if (strcmp(arg, "-reg") == 0 && value != NULL) {
+            filter.reg = (int)strtol(value + (toupper((unsigned char)value[0]) == 'V'), NULL, 16) & 0xf;
+            i++;
+        } else if (strcmp(arg, "-last") == 0 && value != NULL) {
+            filter.last = strtoul(value, NULL, 0);
+            i++;
+        } else if (arg[0] != '-' && num_paths < 2) {
+            paths[num_paths++] = arg;
+        } else {
+            num_paths = -1;
+            break;
+        }
+    }
+    if (num_paths != (diff ? 2 : 1)) {
+        printf("Usage: %s [-pc addr[-addr]] [-cycles from[-to]] [-op pattern] [-reg x] [-last n] trace\n", argv[0]);
+        printf("       %s -diff [-context n] trace_a trace_b\n", argv[0]);
+        return 2;
+    }
+    if (diff) {
+        return diff_traces(paths[0], paths[1], context);
+    }
+    return print_trace(paths[0], &filter);
+}
+
+static int print_trace(const char *path, const trace_filter_t *filter) {
+    static trace_file_t tf;
+    if (!trace_open(&tf, path)) {
+        return 2;
+    }
+    // -last keeps the latest matches in a ring
+    chip8_trace_record_t *latest = NULL;
+    if (filter->last > 0) {
+        latest = malloc(filter->last * sizeof(chip8_trace_record_t));
+        if (latest == NULL) {
+            fclose(tf.fp);
+            return 2;
+        }
+    }
+    uint64_t matched = 0;
+    chip8_trace_record_t rec;
+    while (trace_next(&tf, &rec)) {
+        if (!trace_matches(filter, &rec)) {
+            continue;
+        }
+        if (latest != NULL) {
+            latest[matched % filter->last] = rec;
+        } else {
+            print_record("", &rec);
+        }
+        matched++;
+    }
+    if (latest != NULL) {
+        uint64_t count = matched < filter->last ? matched : filter->last;
+        for (uint64_t i = matched - count; i < matched; i++) {
+            print_record("", &latest[i % filter->last]);
+        }
+        free(latest);
+    }
+    fclose(tf.fp);
+    return 0;
+}
+
+static int diff_traces(const char *path_a, const char *path_b, size_t context) {
+    static trace_file_t a, b;
+    if (!trace_open(&a, path_a) || !trace_open(&b, path_b)) {
+        return 2;
+    }
+    if (a.variant != b.variant || a.quirks != b.quirks) {
+        printf("note: the traces were started with different variants or quirks\n");
+    }
+    chip8_trace_record_t *common = malloc((context > 0 ? context : 1) * sizeof(chip8_trace_record_t));
+    if (common == NULL) {
+        return 2;
+    }
+    chip8_trace_record_t ra, rb;
+    uint64_t index = 0;
+    int status = 0;
+    while (true) {
+        bool has_a = trace_next(&a, &ra);
+        bool has_b = trace_next(&b, &rb);
+        if (!has_a && !has_b) {
+            printf("traces match, %llu records\n", (unsigned long long)index);
+            break;
+        }
+        if (has_a && has_b && records_equal(&ra, &rb)) {
+            if (context > 0) {
+                common[index % context] = ra;
+            }
+            index++;
+            continue;
+        }
+        uint64_t shown = index < context ? index : context;
+        printf("first difference at record %llu\n", (unsigned long long)index);
+        for (uint64_t i = index - shown; i < index; i++) {
+            print_record("  ", &common[i % context]);
+        }
+        if (has_a) {
+            print_record("< ", &ra);
+        } else {
+            printf("< end of %s\n", path_a);
+        }
+        if (has_b) {
+            print_record("> ", &rb);
+        } else {
+            printf("> end of %s\n", path_b);
+        }
+        status = 1;
+        break;
+    }
+    free(common);
+    fclose(a.fp);
+    fclose(b.fp);
+    return status;
+}
+
+static bool trace_open(trace_file_t *tf, const char *path) {
+    memset(tf, 0, sizeof(trace_file_t));
+    tf->fp = fopen(path, "rb");
+    if (tf->fp == NULL) {
+        printf("%s: can't open\n", path);
+        return false;
+    }
+    uint8_t header[TRACE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, tf->fp) != 1 || memcmp(header, "CH8T", 4) != 0 ||
+        (header[4] | (header[5] << 8)) != 1) {
+        printf("%s: not a trace\n", path);
+        fclose(tf->fp);
+        return false;
+    }
+    tf->variant = header[6];
+    tf->quirks = header[7];
+    return true;
+}
+
+static bool trace_next(trace_file_t *tf, chip8_trace_record_t *out_rec) {
+    if (tf->pos == tf->buffered) {
+        size_t bytes = fread(tf->buf, 1, sizeof(tf->buf), tf->fp);
+        tf->buffered = bytes / TRACE_RECORD_SIZE;
+        tf->pos = 0;
+        if (tf->buffered == 0) {
+            return false;
+        }
+    }
+    const uint8_t *p = tf->buf + tf->pos * TRACE_RECORD_SIZE;
+    out_rec->cycle = 0;
+    for (int i = 7; i >= 0; i--) {
+        out_rec->cycle = (out_rec->cycle << 8) | p[i];
+    }
+    out_rec->pc = p[8] | (p[9] << 8);
+    out_rec->opcode = p[10] | (p[11] << 8);
+    out_rec->i_reg = p[12] | (p[13] << 8);
+    out_rec->reg = p[14];
+    out_rec->value = p[15];
+    tf->pos++;
+    return true;
+}
+
+static bool trace_matches(const trace_filter_t *filter, const chip8_trace_record_t *rec) {
+    return rec->pc >= filter->pc_from && rec->pc <= filter->pc_to &&
+        rec->cycle >= filter->cycle_from && rec->cycle <= filter->cycle_to &&
+        (rec->opcode & filter->op_mask) == filter->op_value &&
+        (filter->reg < 0 || rec->reg == filter->reg);
+}
+
+static bool records_equal(const chip8_trace_record_t *a, const chip8_trace_record_t *b) {
+    return a->cycle == b->cycle && a->pc == b->pc && a->opcode == b->opcode &&
+        a->i_reg == b->i_reg && a->reg == b->reg && a->value == b->value;
+}
+
+static void print_record(const char *prefix, const chip8_trace_record_t *rec) {
+    uint8_t code[2] = {rec->opcode >> 8, rec->opcode & 0xff};
+    char text[32];
+    if (rec->opcode == 0xf000) {
+        // the long load's operand isn't in the record, but I is
+        snprintf(text, sizeof(text), "LD I, 0x%04X", rec->i_reg);
+    } else {
+        chip8_disassemble(code, sizeof(code), text, sizeof(text));
+    }
+    printf("%s%10llu  %04X  %04X  %-20s I=%04X", prefix, (unsigned long long)rec->cycle, rec->pc, rec->opcode, text, rec->i_reg);
+    if (rec->reg != CHIP8_TRACE_NO_REG) {
+        printf("  V%X=%02X", rec->reg, rec->value);
+    }
+    printf("\n");
+}
+
+// "a" or "a-b", decimal or 0x-prefixed hex. A single value leaves *out_to at UINT64_MAX.
+static bool parse_range(const char *s, uint64_t *out_from, uint64_t *out_to) {
+    char *end;
+    *out_from = strtoull(s, &end, 0);
+    if (end == s) {
+        return false;
+    }
+    *out_to = UINT64_MAX;
+    if (*end == '-') {
+        const char *to = end + 1;
+        *out_to = strtoull(to, &end, 0);
+        if (end == to) {
+            return false;
+        }
+    }
+    return *end == '\0';
+}
+
+static bool parse_pattern(const char *s, uint16_t *out_mask, uint16_t *out_value) {
+    if (strlen(s) != 4) {
+        return false;
+    }
+    *out_mask = 0;
+    *out_value = 0;
+    for (int i = 0; i < 4; i++) {
+        int shift = (3 - i) * 4;
+        char c = s[i];
+        if (isdigit((unsigned char)c) || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f')) {
+            char digit[2] = {c, '\0'};
+            *out_mask |= 0xf << shift;
+            *out_value |= strtol(digit, NULL, 16) << shift;
+        }
+    }
+    return true;
+}